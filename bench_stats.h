@@ -0,0 +1,247 @@
+#ifndef BENCH_STATS_H
+#define BENCH_STATS_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* histogram of latencies in nanoseconds. buckets are exact below 64ns and
+ * then split each power of two into 32, so percentiles are within about 3%.
+ * times of 2^40ns (18 minutes) or more all land in the last bucket
+ */
+class LatencyHistogram
+{
+	static const unsigned int SUB_BITS = 5;
+	static const size_t SUB_COUNT = size_t(1) << SUB_BITS;
+	static const unsigned int MAX_BITS = 40;
+
+	std::vector<uint64_t> m_counts;
+	uint64_t m_count {0};
+	double m_sum {0};
+
+	static unsigned int highestBit(uint64_t x)
+	{
+#ifdef __GNUG__
+		return 63 - unsigned(__builtin_clzll(x));
+#else
+		unsigned int bit = 0;
+		while (x >>= 1) ++bit;
+		return bit;
+#endif
+	}
+
+	static size_t bucketIndex(uint64_t ns)
+	{
+		if (ns < 2 * SUB_COUNT) return size_t(ns);
+		if (ns >> MAX_BITS) ns = (uint64_t(1) << MAX_BITS) - 1;
+		auto shift = highestBit(ns) - SUB_BITS;
+		return shift * SUB_COUNT + size_t(ns >> shift);
+	}
+
+	// the middle of the times falling in bucket index
+	static double bucketValue(size_t index)
+	{
+		if (index < 2 * SUB_COUNT) return double(index);
+		auto shift = index / SUB_COUNT - 1;
+		auto low = uint64_t(index % SUB_COUNT + SUB_COUNT) << shift;
+		return double(low) + double((uint64_t(1) << shift) - 1) / 2;
+	}
+
+public:
+	LatencyHistogram()
+		: m_counts((MAX_BITS - SUB_BITS + 1) * SUB_COUNT)
+	{
+	}
+
+	void add(double ns)
+	{
+		m_counts[bucketIndex(ns > 0 ? uint64_t(ns) : 0)] += 1;
+		m_count += 1;
+		m_sum += ns;
+	}
+
+	void merge(const LatencyHistogram& other)
+	{
+		for (size_t i = 0; i < m_counts.size(); ++i) m_counts[i] += other.m_counts[i];
+		m_count += other.m_count;
+		m_sum += other.m_sum;
+	}
+
+	uint64_t count() const
+	{
+		return m_count;
+	}
+
+	double mean() const
+	{
+		return m_count ? m_sum / double(m_count) : 0;
+	}
+
+	// the time that p percent of the times are at most (0 if there are none)
+	double percentile(double p) const
+	{
+		if (!m_count) return 0;
+		auto rank = uint64_t(std::ceil(p / 100 * double(m_count)));
+		if (rank < 1) rank = 1;
+
+		uint64_t seen = 0;
+		for (size_t i = 0; i < m_counts.size(); ++i)
+		{
+			seen += m_counts[i];
+			if (seen >= rank) return bucketValue(i);
+		}
+		return bucketValue(m_counts.size() - 1);
+	}
+};
+
+// mean, sample standard deviation and 95% confidence interval of the mean of some samples
+struct Summary
+{
+	double mean;
+	double stddev;
+	double ci_low;
+	double ci_high;
+};
+
+inline Summary summarize(const std::vector<double>& samples)
+{
+	// two-sided 95% quantiles of Student's t distribution for 1 to 30 degrees of freedom
+	static const double t_95[] = {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+	};
+
+	Summary summary {0, 0, 0, 0};
+	if (samples.empty()) return summary;
+
+	auto n = samples.size();
+	for (auto sample : samples) summary.mean += sample / double(n);
+	summary.ci_low = summary.ci_high = summary.mean;
+	if (n < 2) return summary;
+
+	double squares = 0;
+	for (auto sample : samples) squares += (sample - summary.mean) * (sample - summary.mean);
+	summary.stddev = std::sqrt(squares / double(n - 1));
+
+	auto t = n - 1 <= 30 ? t_95[n - 2] : 1.960;
+	auto half_width = t * summary.stddev / std::sqrt(double(n));
+	summary.ci_low = summary.mean - half_width;
+	summary.ci_high = summary.mean + half_width;
+
+	return summary;
+}
+
+/* named results of a benchmark run, in order. printed as "name: value" lines
+ * (text), a header line and a row (csv), or a flat object (json)
+ */
+class Report
+{
+	struct field_t
+	{
+		std::string name;
+		std::string value; // already formatted
+		bool is_string;
+	};
+
+	std::vector<field_t> m_fields;
+
+	static std::string quote(const std::string& s, char escape)
+	{
+		std::string quoted = "\"";
+		for (auto c : s)
+		{
+			if (c == '"' || (c == '\\' && escape == '\\')) quoted += escape;
+			quoted += c;
+		}
+		return quoted + "\"";
+	}
+
+	static std::string csvField(const std::string& s)
+	{
+		return s.find_first_of(",\"\n") == std::string::npos ? s : quote(s, '"');
+	}
+
+public:
+	void add(const std::string& name, const std::string& value)
+	{
+		m_fields.push_back({name, value, true});
+	}
+
+	void add(const std::string& name, const char* value)
+	{
+		add(name, std::string(value));
+	}
+
+	void add(const std::string& name, double value)
+	{
+		// counts are printed in full
+		std::ostringstream out;
+		out.precision(value == std::floor(value) && std::fabs(value) < 1e15 ? 15 : 6);
+		out << (std::isfinite(value) ? value : 0);
+		m_fields.push_back({name, out.str(), false});
+	}
+
+	// add mean, stddev and confidence interval bounds of samples as name_mean etc.
+	void addSummary(const std::string& name, const std::vector<double>& samples)
+	{
+		auto summary = summarize(samples);
+		add(name + "_mean", summary.mean);
+		add(name + "_stddev", summary.stddev);
+		add(name + "_ci95_low", summary.ci_low);
+		add(name + "_ci95_high", summary.ci_high);
+	}
+
+	// add count, mean, p50, p99 and p99.9 of histogram as name_count etc.
+	void addHistogram(const std::string& name, const LatencyHistogram& histogram)
+	{
+		add(name + "_count", double(histogram.count()));
+		add(name + "_mean_ns", histogram.mean());
+		add(name + "_p50_ns", histogram.percentile(50));
+		add(name + "_p99_ns", histogram.percentile(99));
+		add(name + "_p999_ns", histogram.percentile(99.9));
+	}
+
+	/* format is text, csv or json. printing several reports with the same
+	 * fields one after the other, pass first = false for all but the first, so
+	 * that csv gets a single header line and text a blank line between them
+	 */
+	void print(std::ostream& out, const std::string& format, bool first = true) const
+	{
+		if (format == "text")
+		{
+			if (!first) out << "\n";
+			for (auto& field : m_fields) out << field.name << ": " << field.value << "\n";
+		}
+		else if (format == "csv")
+		{
+			for (size_t i = 0; i < m_fields.size() && first; ++i) out << (i ? "," : "") << csvField(m_fields[i].name);
+			if (first) out << "\n";
+			for (size_t i = 0; i < m_fields.size(); ++i) out << (i ? "," : "") << csvField(m_fields[i].value);
+			out << "\n";
+		}
+		else if (format == "json")
+		{
+			out << "{";
+			for (size_t i = 0; i < m_fields.size(); ++i)
+			{
+				auto& field = m_fields[i];
+				out << (i ? ", " : "") << quote(field.name, '\\') << ": " << (field.is_string ? quote(field.value, '\\') : field.value);
+			}
+			out << "}\n";
+		}
+		else
+		{
+			throw std::invalid_argument("unknown report format " + format);
+		}
+		out.flush();
+	}
+};
+
+#endif
@@ -0,0 +1,333 @@
+#ifndef CONCURRENT_FAST_MAP_H
+#define CONCURRENT_FAST_MAP_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "fast_map.h"
+#include "rwlock.h"
+
+/* thread-safe FastMap. lookups, inserts and deletes that don't need a global
+ * rebuild hold the top-level mutex shared and lock only the stripe guarding
+ * the subtable they touch. only global rebuilds (insertAndRebuild) hold the
+ * top-level mutex exclusively
+ */
+template <class K, class V, class... Policies>
+class ConcurrentFastMap
+{
+	typedef FastMap<K, V, Policies...> map_t;
+	typedef typename map_t::pair_t pair_t;
+	typedef typename map_t::subtable_t subtable_t;
+
+	/* stripes are mostly write locked, by inserts and erases, so they use the
+	 * single-word SpinRWMutex. RWMutex would sum its reader slots on every
+	 * write lock and take a cache line per slot in each stripe
+	 */
+	typedef SpinRWMutex stripe_mutex_t;
+	typedef BasicReadLock<stripe_mutex_t> StripeReadLock;
+	typedef BasicWriteLock<stripe_mutex_t> StripeWriteLock;
+
+	// pad stripes to separate cache lines so unrelated subtables don't contend
+	struct alignas(64) stripe_t
+	{
+		stripe_mutex_t mutex;
+	};
+
+public:
+	// construct with a hint that we need to store at least num_pairs pairs,
+	// guarding the subtables with num_stripes locks
+	ConcurrentFastMap(size_t num_pairs = 0, size_t num_stripes = 64)
+		: m_map {num_pairs},
+		m_stripes(std::max<size_t>(1, num_stripes)),
+		m_num_operations {0},
+		m_num_pairs {0},
+		m_num_buckets {m_map.bucketCount()}
+	{
+	}
+
+	size_t size() const
+	{
+		return m_num_pairs;
+	}
+
+	// try to insert pair into the hash table
+	bool insert(const pair_t& pair)
+	{
+		ReadLock lock(m_mutex);
+
+		{
+			auto i = subtableIndex(pair.first);
+			StripeWriteLock st_lock(stripe(i));
+			auto& st_bucket = m_map.m_table[i];
+
+			// check for duplicate key
+			if (st_bucket && st_bucket->count(pair.first)) return false;
+
+			if (m_num_operations < m_map.m_threshold)
+			{
+				// create subtable if it doesn't exist
+				if (!st_bucket)
+				{
+					st_bucket = m_map.newSubtable();
+					m_num_buckets += st_bucket->bucketCount();
+				}
+
+				// the subtable as counted once the pair is in
+				auto st_pairs = st_bucket->size() + 1;
+				auto st_buckets = st_bucket->isUnderCapacity() ? st_bucket->bucketCount() : st_bucket->bucketCountAfterInsert();
+
+				// insert if we don't grow the subtable or growing keeps the table balanced
+				if (st_bucket->isUnderCapacity() || reserveBuckets(*st_bucket))
+				{
+					++m_num_operations;
+					++m_num_pairs;
+
+					try
+					{
+						return st_bucket->insert(pair);
+					}
+					catch (...)
+					{
+						// a failed subtable rebuild may have dropped pairs or kept its old size
+						m_num_pairs += st_bucket->size() - st_pairs;
+						m_num_buckets += st_bucket->bucketCount() - st_buckets;
+						throw;
+					}
+				}
+			}
+		}
+
+		// else insert requires a global rebuild. FastMap::insert rechecks
+		// everything since another thread may have rebuilt in the meantime
+		UpgradeLock upgrade(lock);
+		return exclusive([&] { return m_map.insert(pair); });
+	}
+
+	// remove pair matching key from the table
+	size_t erase(const K& key)
+	{
+		ReadLock lock(m_mutex);
+
+		{
+			auto i = subtableIndex(key);
+			StripeWriteLock st_lock(stripe(i));
+			auto st_bucket = m_map.m_table[i];
+
+			if (!st_bucket || !st_bucket->erase(key)) return 0;
+
+			auto num_pairs = --m_num_pairs;
+			if (++m_num_operations < m_map.m_threshold && !map_t::isOversized(std::max(num_pairs, m_map.m_hint_pairs), m_map.m_threshold)) return 1;
+		}
+
+		// erase reached the threshold or emptied out the table, rebuild unless another thread already did
+		UpgradeLock upgrade(lock);
+		exclusive([&]
+		{
+			if (m_map.m_num_operations >= m_map.m_threshold || m_map.isOversized())
+				m_map.rebuild();
+			return true;
+		});
+
+		return 1;
+	}
+
+	// return (a copy of) the value matching key
+	V at(const K& key) const
+	{
+		ReadLock lock(m_mutex);
+
+		auto input = subtable_t::hashInput(key);
+		auto i = m_map.m_hash(input);
+		StripeReadLock st_lock(stripe(i));
+		auto st_bucket = m_map.m_table[i];
+
+		auto pair = st_bucket ? st_bucket->findPair(key, input) : nullptr;
+		if (!pair) throw std::out_of_range("ConcurrentFastMap::at");
+		return pair->second;
+	}
+
+	// return 1 if pair matching key is in table, else return 0
+	size_t count(const K& key) const
+	{
+		ReadLock lock(m_mutex);
+
+		auto input = subtable_t::hashInput(key);
+		auto i = m_map.m_hash(input);
+		StripeReadLock st_lock(stripe(i));
+		auto st_bucket = m_map.m_table[i];
+
+		return st_bucket && st_bucket->findPair(key, input);
+	}
+
+	// replace the contents of the map with the pairs in [first, last) (see FastMap::assign)
+	template <class It>
+	void assign(It first, It last)
+	{
+		WriteLock lock(m_mutex);
+		exclusive([&] { m_map.assign(first, last); return true; });
+	}
+
+	// set counts[k] to count(keys[k]) for each of the num_keys keys (see FastMap::countMany)
+	// each batch of keys holds the stripes it touches for the whole batch
+	void countMany(const K* keys, size_t num_keys, size_t* counts) const
+	{
+		ReadLock lock(m_mutex);
+
+		std::vector<stripe_mutex_t*> stripes;
+		for (size_t first = 0; first < num_keys; first += map_t::LOOKUP_BATCH_SIZE)
+		{
+			auto batch = std::min(map_t::LOOKUP_BATCH_SIZE, num_keys - first);
+
+			/* lock each stripe once and in address order. a waiting writer blocks
+			 * new readers, so a batch relocking a stripe it holds, or two batches
+			 * locking a pair of stripes in opposite orders, could deadlock
+			 */
+			stripes.clear();
+			for (size_t j = 0; j < batch; ++j) stripes.push_back(&stripe(subtableIndex(keys[first + j])));
+			std::sort(stripes.begin(), stripes.end());
+			stripes.erase(std::unique(stripes.begin(), stripes.end()), stripes.end());
+
+			for (auto stripe : stripes) stripe->lock_read();
+			m_map.countMany(keys + first, batch, counts + first);
+			for (auto stripe : stripes) stripe->unlock_read();
+		}
+	}
+
+	/* call f(pair) for each pair (see FastMap::forEach). each subtable is
+	 * scanned under its stripe's lock, so f sees it in a consistent state, but
+	 * other threads may change the map between subtables. rebuilds wait for
+	 * the scan. f must not use the map
+	 */
+	template <class F>
+	void forEach(F f) const
+	{
+		ReadLock lock(m_mutex);
+		forEachInRange(0, m_map.m_table.size(), f);
+	}
+
+	// same as forEach, but scanning ranges of subtables across pool (see FastMap::parallelForEach)
+	template <class F>
+	void parallelForEach(ThreadPool& pool, F f) const
+	{
+		ReadLock lock(m_mutex);
+		pool.forRange(m_map.m_table.size(), [&](size_t begin, size_t end) { forEachInRange(begin, end, f); });
+	}
+
+	// rebuild the entire table
+	void rebuild()
+	{
+		WriteLock lock(m_mutex);
+		exclusive([&] { m_map.rebuild(); return true; });
+	}
+
+	// rebuild the entire table, releasing memory the pairs don't need (see FastMap::shrinkToFit)
+	void shrinkToFit()
+	{
+		WriteLock lock(m_mutex);
+		exclusive([&] { m_map.shrinkToFit(); return true; });
+	}
+
+	// see FastMap::stats. waits for ongoing operations to finish
+	FastMapStats stats() const
+	{
+		WriteLock lock(m_mutex);
+		auto stats = m_map.stats();
+		stats.num_operations = m_num_operations;
+		stats.num_pairs = m_num_pairs;
+		stats.bucket_count = m_num_buckets;
+		return stats;
+	}
+
+	void resetStats()
+	{
+		WriteLock lock(m_mutex);
+		m_map.resetStats();
+	}
+
+	// spread the work of global rebuilds over pool (see FastMap::setThreadPool)
+	void setThreadPool(ThreadPool* pool)
+	{
+		WriteLock lock(m_mutex);
+		m_map.setThreadPool(pool);
+	}
+
+private:
+	// call f(pair) for each pair in subtables [begin, end), with m_mutex held
+	template <class F>
+	void forEachInRange(size_t begin, size_t end, F& f) const
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			StripeReadLock st_lock(stripe(i));
+			if (auto st_bucket = m_map.m_table[i]) st_bucket->forEach(f);
+		}
+	}
+
+	size_t subtableIndex(const K& key) const
+	{
+		return m_map.m_hash(subtable_t::hashInput(key));
+	}
+
+	stripe_mutex_t& stripe(size_t subtable_index) const
+	{
+		return m_stripes[subtable_index % m_stripes.size()].mutex;
+	}
+
+	// try to account for growing st_bucket by one pair. fails if that would
+	// unbalance the table (given all other concurrent growth)
+	bool reserveBuckets(const subtable_t& st_bucket)
+	{
+		auto growth = st_bucket.bucketCountAfterInsert() - st_bucket.bucketCount();
+		size_t num_buckets = m_num_buckets;
+
+		do
+		{
+			if (!map_t::isBucketCountBalanced(num_buckets + growth, m_map.m_table.size(), m_map.m_threshold)) return false;
+		}
+		while (!m_num_buckets.compare_exchange_weak(num_buckets, num_buckets + growth));
+
+		return true;
+	}
+
+	// run f on the underlying map, which must be locked for unique ownership
+	template <class F>
+	auto exclusive(F f) -> decltype(f())
+	{
+		m_map.m_num_operations = m_num_operations;
+		m_map.m_num_pairs = m_num_pairs;
+		m_map.m_num_buckets = m_num_buckets;
+
+		auto update = [&]
+		{
+			m_num_operations = m_map.m_num_operations;
+			m_num_pairs = m_map.m_num_pairs;
+			m_num_buckets = m_map.bucketCount();
+		};
+
+		try
+		{
+			auto result = f();
+			update();
+			return result;
+		}
+		catch (...)
+		{
+			// a failed rebuild still changes the map (see FastMap::rebuildFromList)
+			update();
+			throw;
+		}
+	}
+
+	map_t m_map; // underlying map. its counters are only up to date while m_mutex is held exclusively
+	mutable RWMutex m_mutex; // shared for ordinary operations, unique for global rebuilds
+	mutable std::vector<stripe_t> m_stripes; // locks for subtables (subtable i uses stripe i % size)
+	std::atomic<size_t> m_num_operations; // shadows m_map.m_num_operations
+	std::atomic<size_t> m_num_pairs; // shadows m_map.m_num_pairs
+	std::atomic<size_t> m_num_buckets; // shadows m_map.m_num_buckets
+};
+
+#endif
@@ -0,0 +1,78 @@
+#include "epoch.h"
+
+#include <thread>
+
+const size_t EpochReclaimer::NUM_STRIPES;
+
+size_t EpochReclaimer::threadStripe()
+{
+	// threads take stripes round-robin as they first pin an epoch
+	static std::atomic<size_t> next_stripe {0};
+	thread_local size_t stripe = next_stripe++ % NUM_STRIPES;
+	return stripe;
+}
+
+size_t EpochReclaimer::readers(size_t parity) const
+{
+	/* not a snapshot, but a reader that stays pinned for the whole scan is
+	 * always counted, and one that pins after the scan starts saw the new
+	 * epoch's data. each reader increments and decrements the same stripe,
+	 * so no stripe goes negative
+	 */
+	size_t count = 0;
+	for (auto& stripe : m_stripes) count += stripe.readers[parity].load();
+	return count;
+}
+
+EpochReclaimer::EpochReclaimer()
+	: m_stripes(NUM_STRIPES)
+{
+	for (auto& stripe : m_stripes)
+	{
+		stripe.readers[0] = 0;
+		stripe.readers[1] = 0;
+	}
+}
+
+EpochReclaimer::~EpochReclaimer()
+{
+	for (auto& retired : m_retired) retired.destroy(retired.object);
+}
+
+size_t EpochReclaimer::enter()
+{
+	/* a stale parity is harmless: synchronize() drains both parities. the
+	 * increment is sequentially consistent so that it is ordered before the
+	 * reader's (also sequentially consistent) loads of shared pointers
+	 */
+	auto stripe = threadStripe();
+	auto parity = m_epoch.load(std::memory_order_relaxed) & 1;
+	m_stripes[stripe].readers[parity].fetch_add(1);
+	return stripe << 1 | parity;
+}
+
+void EpochReclaimer::exit(size_t token)
+{
+	m_stripes[token >> 1].readers[token & 1].fetch_sub(1, std::memory_order_release);
+}
+
+void EpochReclaimer::synchronize()
+{
+	// after each flip, new readers pin the other parity, so the old one drains
+	for (int flip = 0; flip < 2; ++flip)
+	{
+		auto old_parity = m_epoch.fetch_add(1) & 1;
+		while (readers(old_parity)) std::this_thread::yield();
+	}
+}
+
+void EpochReclaimer::reclaim()
+{
+	if (m_retired.empty()) return;
+
+	synchronize();
+
+	std::vector<retired_t> retired;
+	retired.swap(m_retired);
+	for (auto& r : retired) r.destroy(r.object);
+}
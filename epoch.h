@@ -0,0 +1,86 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/* epoch-based reclamation (a simple form of RCU). readers pin the current
+ * epoch while they hold pointers into shared data, and writers that unlink an
+ * object retire it instead of deleting it. reclaim() waits for a grace period,
+ * after which no reader can still hold a pointer to a retired object, and
+ * only then destroys them.
+ *
+ * readers never wait: pinning is one atomic increment of a per-thread stripe
+ * of the counter for the epoch's parity. a grace period flips the epoch twice,
+ * each time waiting for the readers of the parity it just left to drain.
+ * retire() and reclaim() must not run concurrently with each other (writers
+ * are expected to be serialized anyway)
+ */
+class EpochReclaimer
+{
+	static const size_t NUM_STRIPES = 64;
+
+	// reader counts for both epoch parities, padded so threads don't share cache lines
+	struct alignas(64) stripe_t
+	{
+		std::atomic<size_t> readers[2];
+	};
+
+	struct retired_t
+	{
+		void* object;
+		void (*destroy)(void*);
+	};
+
+	std::vector<stripe_t> m_stripes;
+	std::atomic<size_t> m_epoch {0};
+	std::vector<retired_t> m_retired; // destroyed at the next reclaim
+
+	static size_t threadStripe(); // stripe for the calling thread
+	size_t readers(size_t parity) const; // number of readers pinned to parity
+public:
+	EpochReclaimer();
+	~EpochReclaimer(); // destroys all retired objects (no reader may still be pinned)
+	EpochReclaimer(const EpochReclaimer&) = delete;
+	EpochReclaimer& operator=(const EpochReclaimer&) = delete;
+
+	size_t enter(); // pin the current epoch, returning a token for exit
+	void exit(size_t token); // unpin
+
+	// delete object once no reader can reference it
+	template <class T>
+	void retire(T* object)
+	{
+		if (object) m_retired.push_back({object, [](void* p) { delete static_cast<T*>(p); }});
+	}
+
+	// number of objects waiting to be destroyed
+	size_t retiredCount() const
+	{
+		return m_retired.size();
+	}
+
+	void synchronize(); // wait until every reader pinned before the call has unpinned
+	void reclaim(); // wait for a grace period, then destroy everything retired before the call
+};
+
+// pin the current epoch, automatically unpinning when destroyed
+class EpochGuard
+{
+	EpochReclaimer& m_reclaimer;
+	size_t m_token;
+public:
+	EpochGuard(EpochReclaimer& reclaimer)
+		: m_reclaimer {reclaimer},
+		m_token {reclaimer.enter()}
+	{
+	}
+
+	~EpochGuard()
+	{
+		m_reclaimer.exit(m_token);
+	}
+};
+
+#endif
@@ -0,0 +1,325 @@
+#ifndef EPOCH_FAST_MAP_H
+#define EPOCH_FAST_MAP_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "epoch.h"
+#include "fast_map.h"
+
+/* thread-safe FastMap whose readers never block. writers are serialized by a
+ * mutex and never modify a table a reader can see: an insert or delete builds
+ * a copy of the one subtable it changes and swaps it in with an atomic store,
+ * and a full rehash builds a whole new top-level table off to the side and
+ * swaps in a pointer to it. the tables they replace are reclaimed once no
+ * reader can still be using them (see EpochReclaimer).
+ *
+ * lookups cost one atomic increment and decrement more than in FastMap, and
+ * their latency doesn't change while rehashes run. writes cost a subtable
+ * copy each, so this suits read-mostly workloads
+ */
+template <class K, class V, class... Policies>
+class EpochFastMap
+{
+	typedef FastMap<K, V, Policies...> map_t;
+	typedef typename map_t::pair_t pair_t;
+	typedef typename map_t::subtable_t subtable_t;
+	typedef typename map_t::hash_t hash_t;
+	typedef typename map_t::node_alloc_t node_alloc_t;
+
+	// a top-level table. readers see all of one state, or all of its replacement
+	struct state_t
+	{
+		hash_t hash;
+		size_t threshold;
+		std::vector<std::atomic<subtable_t*>> subtables;
+
+		state_t(size_t num_subtables)
+			: subtables(num_subtables)
+		{
+		}
+
+		~state_t()
+		{
+			for (auto& st_bucket : subtables) delete st_bucket.load(std::memory_order_relaxed);
+		}
+	};
+
+	// retired subtables are reclaimed in batches, since each reclaim waits for readers
+	static const size_t RECLAIM_BATCH_SIZE = 64;
+
+public:
+	// construct with a hint that we need to store at least num_pairs pairs
+	// (kept as long as FastMap keeps it, see FastMap::m_hint_pairs)
+	EpochFastMap(size_t num_pairs = 0)
+		: m_num_pairs {0},
+		m_hint_pairs {num_pairs}
+	{
+		map_t builder(num_pairs);
+		m_alloc = builder.m_alloc;
+		publish(builder);
+	}
+
+	~EpochFastMap()
+	{
+		delete m_state.load();
+	}
+
+	EpochFastMap(const EpochFastMap&) = delete;
+	EpochFastMap& operator=(const EpochFastMap&) = delete;
+
+	size_t size() const
+	{
+		return m_num_pairs;
+	}
+
+	// try to insert pair into the hash table
+	bool insert(const pair_t& pair)
+	{
+		std::lock_guard<std::mutex> lock(m_write_mutex);
+
+		auto& state = *m_state.load();
+		auto& st_bucket = state.subtables[state.hash(subtable_t::hashInput(pair.first))];
+		auto old_subtable = st_bucket.load();
+
+		// check for duplicate key
+		if (old_subtable && old_subtable->count(pair.first)) return false;
+
+		auto subtable = copySubtable(old_subtable, 1);
+		subtable->insert(pair);
+
+		++m_num_pairs;
+		replaceSubtable(state, st_bucket, subtable);
+
+		return true;
+	}
+
+	// remove pair matching key from the table
+	size_t erase(const K& key)
+	{
+		std::lock_guard<std::mutex> lock(m_write_mutex);
+
+		auto& state = *m_state.load();
+		auto& st_bucket = state.subtables[state.hash(subtable_t::hashInput(key))];
+		auto old_subtable = st_bucket.load();
+
+		if (!old_subtable || !old_subtable->count(key)) return 0;
+
+		// an empty subtable is simply dropped
+		subtable_t* subtable = nullptr;
+		if (old_subtable->size() > 1)
+		{
+			subtable = copySubtable(old_subtable, 0);
+			subtable->erase(key);
+		}
+
+		--m_num_pairs;
+		replaceSubtable(state, st_bucket, subtable);
+
+		return 1;
+	}
+
+	// return (a copy of) the value matching key
+	V at(const K& key) const
+	{
+		EpochGuard guard(m_epochs);
+
+		auto pair = findPair(key);
+		if (!pair) throw std::out_of_range("EpochFastMap::at");
+		return pair->second;
+	}
+
+	// return 1 if pair matching key is in table, else return 0
+	size_t count(const K& key) const
+	{
+		EpochGuard guard(m_epochs);
+		return findPair(key) != nullptr;
+	}
+
+	// set counts[k] to count(keys[k]) for each of the num_keys keys, pinning the epoch once
+	void countMany(const K* keys, size_t num_keys, size_t* counts) const
+	{
+		EpochGuard guard(m_epochs);
+
+		for (size_t k = 0; k < num_keys; ++k) counts[k] = findPair(keys[k]) != nullptr;
+	}
+
+	/* call f(pair) for each pair (see FastMap::forEach). the scan never
+	 * blocks writers, and sees each subtable as it was at some point during
+	 * the scan, but not all of them at the same point. f must not use the map
+	 */
+	template <class F>
+	void forEach(F f) const
+	{
+		EpochGuard guard(m_epochs);
+		auto& state = *m_state.load();
+		forEachInRange(state, 0, state.subtables.size(), f);
+	}
+
+	// same as forEach, but scanning ranges of subtables across pool (see FastMap::parallelForEach)
+	template <class F>
+	void parallelForEach(ThreadPool& pool, F f) const
+	{
+		// the pool's threads are covered by this thread's guard, as it waits for them
+		EpochGuard guard(m_epochs);
+		auto& state = *m_state.load();
+		pool.forRange(state.subtables.size(), [&](size_t begin, size_t end) { forEachInRange(state, begin, end, f); });
+	}
+
+	// replace the contents of the map with the pairs in [first, last) (see FastMap::assign)
+	template <class It>
+	void assign(It first, It last)
+	{
+		std::lock_guard<std::mutex> lock(m_write_mutex);
+
+		map_t builder(0, m_alloc);
+		builder.setThreadPool(m_pool);
+		builder.assign(first, last);
+		replaceState(builder);
+	}
+
+	// rebuild the entire table
+	void rebuild()
+	{
+		std::lock_guard<std::mutex> lock(m_write_mutex);
+		rebuildLocked();
+	}
+
+	// spread the work of global rebuilds over pool (see FastMap::setThreadPool)
+	void setThreadPool(ThreadPool* pool)
+	{
+		std::lock_guard<std::mutex> lock(m_write_mutex);
+		m_pool = pool;
+	}
+
+private:
+	// the pair matching key, or null (must be called with the epoch pinned)
+	const pair_t* findPair(const K& key) const
+	{
+		auto& state = *m_state.load();
+		auto input = subtable_t::hashInput(key);
+		auto subtable = state.subtables[state.hash(input)].load();
+		return subtable ? subtable->findPair(key, input) : nullptr;
+	}
+
+	// call f(pair) for each pair in subtables [begin, end) of state (with the epoch pinned)
+	template <class F>
+	static void forEachInRange(const state_t& state, size_t begin, size_t end, F& f)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			if (auto subtable = state.subtables[i].load()) subtable->forEach(f);
+		}
+	}
+
+	// a new subtable holding the pairs of subtable (if any), with room for extra more
+	subtable_t* copySubtable(const subtable_t* subtable, size_t extra)
+	{
+		auto copy = new subtable_t((subtable ? subtable->size() : 0) + extra, m_alloc);
+		if (!subtable) return copy;
+
+		for (size_t i = 0; i < subtable->m_table.size(); ++i)
+		{
+			if (auto pair = subtable->m_table.get(i)) copy->insert(*pair);
+		}
+
+		return copy;
+	}
+
+	/* publish subtable in place of the one in st_bucket and retire the old
+	 * one, then rebuild everything if that reached the operation threshold,
+	 * left the table far larger than needed or unbalanced it (see FastMap::insert)
+	 */
+	void replaceSubtable(state_t& state, std::atomic<subtable_t*>& st_bucket, subtable_t* subtable)
+	{
+		auto old_subtable = st_bucket.load();
+		m_num_buckets -= old_subtable ? old_subtable->bucketCount() : 0;
+		m_num_buckets += subtable ? subtable->bucketCount() : 0;
+
+		st_bucket.store(subtable);
+		retire(old_subtable);
+
+		if (++m_num_operations >= state.threshold || map_t::isOversized(std::max<size_t>(m_num_pairs, m_hint_pairs), state.threshold) ||
+			!map_t::isBucketCountBalanced(m_num_buckets, state.subtables.size(), state.threshold))
+			rebuildLocked();
+	}
+
+	// rebuild the entire table off to the side and swap it in
+	void rebuildLocked()
+	{
+		std::vector<pair_t> pairs;
+		pairs.reserve(m_num_pairs);
+		for (auto& st_bucket : m_state.load()->subtables)
+		{
+			auto subtable = st_bucket.load();
+			if (!subtable) continue;
+			for (size_t i = 0; i < subtable->m_table.size(); ++i)
+			{
+				if (auto pair = subtable->m_table.get(i)) pairs.push_back(*pair);
+			}
+		}
+
+		if (m_num_operations >= m_state.load()->threshold) m_hint_pairs = 0;
+		map_t builder(m_hint_pairs, m_alloc);
+		builder.setThreadPool(m_pool);
+		builder.assign(pairs.begin(), pairs.end());
+		replaceState(builder);
+	}
+
+	// publish the tables of builder as the new state and reclaim the old one
+	void replaceState(map_t& builder)
+	{
+		auto old_state = m_state.load();
+		publish(builder);
+		retire(old_state);
+		m_epochs.reclaim();
+	}
+
+	// take over the tables of builder (which must not be migrating) as the current state
+	void publish(map_t& builder)
+	{
+		auto state = new state_t(builder.m_table.size());
+		state->hash = builder.m_hash;
+		state->threshold = builder.m_threshold;
+		for (size_t i = 0; i < builder.m_table.size(); ++i)
+		{
+			// the builder's counters go with it
+			if (builder.m_table[i]) builder.m_table[i]->setCounters(nullptr);
+			state->subtables[i].store(builder.m_table[i], std::memory_order_relaxed);
+			builder.m_table[i] = nullptr;
+		}
+
+		m_num_pairs = builder.m_num_pairs;
+		m_num_buckets = builder.m_num_buckets;
+		m_num_operations = 0;
+
+		m_state.store(state);
+	}
+
+	template <class T>
+	void retire(T* object)
+	{
+		m_epochs.retire(object);
+		if (m_epochs.retiredCount() >= RECLAIM_BATCH_SIZE) m_epochs.reclaim();
+	}
+
+	std::atomic<state_t*> m_state {nullptr}; // current top-level table
+	mutable EpochReclaimer m_epochs;         // readers pin an epoch while using m_state
+	std::mutex m_write_mutex;                // serializes writers
+	node_alloc_t m_alloc;                    // shared by all subtables (and their copies)
+	ThreadPool* m_pool {nullptr};
+	std::atomic<size_t> m_num_pairs;
+	size_t m_hint_pairs;                     // the constructor's hint, 0 once it has expired
+	size_t m_num_operations {0};             // inserts and deletes since the last rebuild
+	size_t m_num_buckets {0};                // total size of the current subtables' hash tables
+};
+
+template <class K, class V, class... Policies>
+const size_t EpochFastMap<K, V, Policies...>::RECLAIM_BATCH_SIZE;
+
+#endif
@@ -3,68 +3,80 @@
 
 #include <algorithm>
 #include <cstddef>
-#include <functional>
+#include <memory>
 #include <stdexcept>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
-#include "random_utils.h"
+#include "fast_map_stats.h"
+#include "growth_policy.h"
+#include "hash_search.h"
+#include "slot_storage.h"
+#include "universal_hash.h"
 
-template<class K, class V> class FastMap;
+template<class K, class V, class Storage, class Allocator, class Hash, class Growth> class FastMap;
+template<class K, class V, class... Policies> class ConcurrentFastMap;
+template<class K, class V, class... Policies> class EpochFastMap;
+template<class K, class V, class Hash> class FrozenFastMap;
 
-template<class K, class V>
+template<class K, class V, class Storage = NodeStorage, class Allocator = std::allocator<std::pair<const K, V>>, class Hash = DefaultHash<K>, class Growth = DefaultGrowth>
 class FastLookupMap
 {
-	friend FastMap<K,V>;
+	// keys whose hash inputs only differ in bits the family doesn't read could never be separated
+	static_assert(PreHash<K>::INPUT_BITS <= Hash::INPUT_BITS, "Hash reads too few bits of the keys' hash inputs (see pre_hash.h)");
+	// the hash shares its room with the tags of small subtables, which copy it as raw bytes
+	static_assert(std::is_trivially_copyable<Hash>::value, "Hash must be trivially copyable");
 
-	typedef std::function<size_t(K)> hash_t;
+	friend FastMap<K,V,Storage,Allocator,Hash,Growth>;
+	template<class, class, class...> friend class ConcurrentFastMap;
+	template<class, class, class...> friend class EpochFastMap;
+	template<class, class, class> friend class FrozenFastMap;
+
+	typedef Hash hash_t;
 	typedef std::pair<const K, V> pair_t;
-	typedef std::vector<pair_t*> table_t;
+	typedef typename Storage::template table<K, V, Allocator> table_t;
+	typedef typename table_t::node_t node_t;
+	typedef std::vector<node_t> node_list_t; // pairs moved out of a table (used during rebuilds)
 
 public:
 	// construct with a hint that we need to store at least num_pairs pairs
-	FastLookupMap(size_t num_pairs = 0)
-		: m_num_pairs {0},
-		m_capacity {capacityFromNumPairs(num_pairs)}
+	FastLookupMap(size_t num_pairs = 0, const Allocator& alloc = Allocator())
+		: m_table {typename table_t::allocator_type(alloc)},
+		m_num_pairs {0},
+		m_capacity {capacityFromNumPairs(num_pairs)},
+		m_tags {0}
 	{
-		rebuild();
-	}
-
-	~FastLookupMap()
-	{
-		for (auto& bucket : m_table) delete bucket;
+		rebuild(m_capacity);
 	}
 
 	// try to insert a pair
 	bool insert(const pair_t& pair)
 	{
-		return insert(new pair_t(pair));
+		auto input = hashInput(pair.first);
+		if (findPair(pair.first, input)) return false;
+		insertNew(table_t::makeHashedNode(m_table.allocator(), input, pair), input);
+		return true;
 	}
 
 	// remove pair matching key from the table
 	size_t erase(const K& key)
 	{
-		if (!count(key)) return 0;
-
-		--m_num_pairs;
-		delete getBucket(key);
-		getBucket(key) = nullptr;
-
-		return 1;
+		return erase(key, hashInput(key));
 	}
 
 	// return the value matching key
 	const V& at(const K& key) const
 	{
-		if (!count(key)) throw std::out_of_range("FastLookupMap::at");
-		return getBucket(key)->second;
+		auto pair = findPair(key, hashInput(key));
+		if (!pair) throw std::out_of_range("FastLookupMap::at");
+		return pair->second;
 	}
 
 	// return 1 if pair matching key is in table, else return 0
 	size_t count(const K& key) const
 	{
-		auto bucket = getBucket(key);
-		return bucket && bucket->first == key;
+		return findPair(key, hashInput(key)) != nullptr;
 	}
 
 	// return number of pairs
@@ -88,56 +100,99 @@ public:
 	// number of elements in given bucket
 	size_t bucketSize(size_t n) const
 	{
-		return n < m_table.size() ? m_table[n] != nullptr : 0;
+		return n < m_table.size() ? m_table.occupied(n) : 0;
 	}
 
-	// bucket index for key
+	// bucket index for key (in a small or scanned subtable, the slot holding it, or bucketCount() if there is none)
 	size_t bucket(const K& key) const
 	{
+		if (isLinear()) return linearSlot(key, hashInput(key));
 		return hashKey(m_hash, key);
 	}
 
-	// return hash function
+	// call f with each pair, in no particular order
+	template <class F>
+	void forEach(F&& f) const
+	{
+		m_table.forEach(f);
+	}
+
+	// return hash function (small and scanned subtables have none, and return an unseeded one)
 	hash_t getHash() const
 	{
-		return m_hash;
+		return isLinear() ? hash_t() : m_hash;
 	}
 
 	// reserve enough space for at num_pairs pairs, possibly rehashing table
 	void reserve(size_t num_pairs)
 	{
 		size_t cap = capacityFromNumPairs(num_pairs);
-		if (cap > m_capacity)
-		{
-			m_capacity = cap;
-			rebuild();
-		}
+		if (cap > m_capacity) rebuild(cap);
+	}
+
+	// rehash the table at the capacity its current pairs need, releasing any memory beyond that
+	void shrinkToFit()
+	{
+		fitCapacity(m_num_pairs, 1);
 	}
 
 	// remove all pairs (without actually shrinking table)
 	void clear()
 	{
 		m_num_pairs = 0;
-		for (auto& bucket : m_table)
-		{
-			delete bucket;
-			bucket = nullptr;
-		}
+		m_table.clear();
 	}
 
 private:
+	/* subtables with capacity for at most SMALL_PAIRS pairs are small. their
+	 * pairs fill the first slots of a table with one slot per pair of
+	 * capacity, and m_tags packs a byte of each key's hash input in the room
+	 * that m_hash takes in hashed subtables. lookups
+	 * compare all the tags at once and then the keys of the slots that
+	 * matched, so small subtables need no hash function and never search for
+	 * one. they become perfect hash tables once they outgrow SMALL_PAIRS.
+	 *
+	 * larger subtables are scanned instead if two of their keys have equal
+	 * hash inputs (see pre_hash.h), which no hash function can separate. their
+	 * pairs fill the first slots of a table with one slot per pair of capacity
+	 * as well, but without tags, and lookups compare the stored inputs of every
+	 * pair. each rebuild tries hashing them again
+	 */
+	static const size_t SMALL_PAIRS = 8;
+
 	// static functions for determining hash table sizes
 
-	// how big would a hash table be with the given capacity?
+	static bool isSmallCapacity(size_t capacity)
+	{
+		return capacity <= SMALL_PAIRS;
+	}
+
+	// how big would a hash table be with the given capacity? (see Growth::subtableScale)
 	static size_t numBucketsFromCapacity(size_t capacity)
 	{
-		return 2 * capacity * (capacity - 1);
+		return isSmallCapacity(capacity) ? capacity : Growth::subtableScale() * capacity * (capacity - 1);
 	}
 
 	// how much capacity should we have if we know we need to store num_pairs?
+	// small subtables round up to a power of two, so that doubling reaches SMALL_PAIRS
 	static size_t capacityFromNumPairs(size_t num_pairs)
 	{
-		return 2 * std::max<size_t>(1, num_pairs);
+		if (num_pairs > SMALL_PAIRS) return 2 * num_pairs;
+
+		size_t capacity = 1;
+		while (capacity < num_pairs) capacity *= 2;
+		return capacity;
+	}
+
+	/* the capacity to use for num_pairs pairs, given the current capacity.
+	 * grows as needed, but only shrinks once the capacity is more than
+	 * shrink_slack times what num_pairs need, so subtables that empty out and
+	 * fill up again aren't resized every time
+	 */
+	static size_t fittedCapacity(size_t capacity, size_t num_pairs, size_t shrink_slack)
+	{
+		auto needed = capacityFromNumPairs(num_pairs);
+		return needed > capacity || capacity > shrink_slack * needed ? needed : capacity;
 	}
 
 	// how big would a hash table be if initialized with the given number of pairs?
@@ -147,62 +202,254 @@ private:
 	}
 
 	// convience functions for calculating the hashed value of a key
+	// (through its hash input, see pre_hash.h)
+	static uint64_t hashInput(const K& key)
+	{
+		return PreHash<K>::hash(key);
+	}
+
 	static size_t hashKey(const hash_t& hash, const K& key)
 	{
-		return hash(key);
+		return hash(hashInput(key));
+	}
+
+	// the tag of keys with hash input input in a small subtable: the top byte of a multiple of the input
+	static uint8_t tagOf(uint64_t input)
+	{
+		return uint8_t((input * 0x9e3779b97f4a7c15ULL) >> 56);
+	}
+
+	bool isSmall() const
+	{
+		return isSmallCapacity(m_capacity);
 	}
 
-	// check if a hash function has no collisions for the given buckets
-	// (where hash function has range num_buckets)
-	static bool isHashPerfect(const table_t& buckets, size_t num_buckets, const hash_t& hash)
+	// are the pairs in the first slots, as in small and scanned subtables?
+	// only hashed tables have more slots than capacity
+	bool isLinear() const
 	{
-		std::vector<bool> collision_map(num_buckets, false);
+		return m_table.size() == m_capacity;
+	}
 
-		for (auto& bucket : buckets)
+	// bit i set for each occupied slot of a small subtable whose tag matches input's
+	unsigned matchTags(uint64_t input) const
+	{
+		return match_tags(m_tags, tagOf(input), m_num_pairs);
+	}
+
+	void setTag(size_t i, uint8_t tag)
+	{
+		auto shift = 8 * i;
+		m_tags = (m_tags & ~(uint64_t(0xff) << shift)) | (uint64_t(tag) << shift);
+	}
+
+	// the slot of a small or scanned subtable holding key, whose hash input is input, or the table size if there is none
+	size_t linearSlot(const K& key, uint64_t input) const
+	{
+		if (!isSmall())
 		{
-			if (!bucket) continue;
-			auto hashed_key = hashKey(hash, bucket->first);
-			if (collision_map.at(hashed_key)) return false;
+			for (size_t i = 0; i < m_num_pairs; ++i)
+			{
+				auto pair = m_table.getIfInput(i, input);
+				if (pair && pair->first == key) return i;
+			}
+			return m_table.size();
+		}
 
-			collision_map[hashed_key] = true;
+		for (auto matches = matchTags(input); matches; matches &= matches - 1)
+		{
+			auto i = lowest_bit(matches);
+			auto pair = m_table.getIfInput(i, input);
+			if (pair && pair->first == key) return i;
 		}
+		return m_table.size();
+	}
 
-		return true;
+	// place node, whose key has hash input input, in the first free slot of a small or scanned subtable with room for it
+	pair_t* putLinear(node_t&& node, uint64_t input)
+	{
+		auto i = m_num_pairs;
+		m_table.put(i, std::move(node));
+		if (isSmall()) setTag(i, tagOf(input));
+		++m_num_pairs;
+		return m_table.get(i);
 	}
 
-	// find a collision-free hash function for the given buckets
-	// (where hash function has range num_buckets)
-	static hash_t findCollisionFreeHash(const table_t& buckets, size_t num_buckets)
+	// place node, whose key has hash input input, where the layout puts it (which must be free)
+	pair_t* putNode(node_t&& node, uint64_t input)
 	{
-		hash_t hash;
-		do
-			hash = random_hash<K>(num_buckets);
-		while (!isHashPerfect(buckets, num_buckets, hash));
+		if (isLinear()) return putLinear(std::move(node), input);
 
-		return hash;
+		auto i = m_hash(input);
+		m_table.put(i, std::move(node));
+		++m_num_pairs;
+		return m_table.get(i);
 	}
 
-	// try to insert pair (if non-null), rebuilding if necessary
-	bool insert(pair_t* bucket)
+	/* make the (empty) table a hashed one for capacity using hash, or a small
+	 * or scanned one if hash is null, with no pairs yet. the new slots are
+	 * allocated first, so if that throws the old layout stays
+	 */
+	void resetLayout(size_t capacity, const hash_t* hash)
 	{
-		// check for null/duplicate
-		if (!bucket || count(bucket->first)) return false;
+		m_table.resize(hash ? numBucketsFromCapacity(capacity) : capacity);
+		m_capacity = capacity;
+		m_num_pairs = 0;
+		if (hash)
+			m_hash = *hash;
+		else if (isSmall())
+			m_tags = 0;
+	}
 
-		++m_num_pairs;
+	/* after a rebuild failed, put node back where the current layout has room
+	 * for it, or else destroy it. until a rebuild has changed the layout that
+	 * is the old one, which has room for every pair that was in the table
+	 */
+	void restoreNode(node_t& node)
+	{
+		auto input = table_t::nodeHashInput(node);
+		if (isUnderCapacity() && (isLinear() || !m_table.occupied(m_hash(input))))
+		{
+			try
+			{
+				putNode(std::move(node), input);
+				return;
+			}
+			catch (...)
+			{
+				// placing it copies the key (see InlineSlots), which failed again
+			}
+		}
+		table_t::destroyNode(m_table.allocator(), node);
+	}
+
+	void restoreNodes(node_list_t& nodes, size_t first)
+	{
+		for (; first < nodes.size(); ++first) restoreNode(nodes[first]);
+	}
+
+	// find a collision-free hash function for the given pairs and store it in
+	// hash (where hash function has range num_buckets). false if there is none
+	bool findCollisionFreeHash(const node_list_t& nodes, size_t num_buckets, hash_t& hash) const
+	{
+		auto& search = HashSearch<hash_t>::local();
+		search.loadKeys(nodes.begin(), nodes.end(), [](const node_t& node) { return table_t::nodeHashInput(node); });
+		auto found = search.findCollisionFree(num_buckets, hash);
+		if (auto c = counters()) c->countCollisionFreeSearch(search.lastAttempts());
+		return found;
+	}
+
+	// count rebuilds in counters from now on (see FastMapCounters)
+	void setCounters(FastMapCounters* counters)
+	{
+#ifdef FAST_MAP_STATS
+		m_counters = counters;
+#else
+		(void)counters;
+#endif
+	}
+
+	// where rebuilds are counted, if anywhere (always null without FAST_MAP_STATS)
+	FastMapCounters* counters() const
+	{
+#ifdef FAST_MAP_STATS
+		return m_counters;
+#else
+		return nullptr;
+#endif
+	}
 
-		// if we're over capacity or there is a collision
-		if (m_num_pairs > m_capacity || getBucket(bucket->first))
+	// try to insert node, rebuilding if necessary. takes ownership of node
+	bool insert(node_t&& node)
+	{
+		auto input = table_t::nodeHashInput(node);
+
+		// check for duplicate
+		if (findPair(table_t::nodeKey(node), input))
+		{
+			table_t::destroyNode(m_table.allocator(), node);
+			return false;
+		}
+
+		insertNew(std::move(node), input);
+		return true;
+	}
+
+	/* insert node, whose key has hash input input and isn't in the table yet,
+	 * rebuilding if necessary. takes ownership of node and returns its pair
+	 */
+	pair_t* insertNew(node_t&& node, uint64_t input)
+	{
+		if (isLinear() && isUnderCapacity()) return putLinear(std::move(node), input);
+
+		// full small and scanned subtables are at capacity now, and don't hash
+		auto i = isLinear() ? 0 : m_hash(input);
+
+		// if we're at capacity or there is a collision
+		if (!isUnderCapacity() || m_table.occupied(i))
 		{
-			// force the new pair into the table and then rebuild
-			m_table.push_back(bucket);
-			rebuild();
-			return true;
+			// rebuild with the new pair
+			node_list_t nodes;
+			try
+			{
+				nodes.reserve(m_num_pairs + 1);
+				moveNodesToList(nodes);
+				nodes.push_back(std::move(node));
+			}
+			catch (...)
+			{
+				// keep the table as it was, without the new pair
+				restoreNodes(nodes, 0);
+				table_t::destroyNode(m_table.allocator(), node);
+				throw;
+			}
+			rebuildFromList(nodes, m_capacity);
+
+			// linear layouts keep the order of nodes, so the new pair is last
+			return isLinear() ? m_table.get(m_num_pairs - 1) : m_table.get(m_hash(input));
 		}
 
 		// no collision, under capacity. simple insert
-		getBucket(bucket->first) = bucket;
+		m_table.put(i, std::move(node));
+		++m_num_pairs;
 
-		return true;
+		return m_table.get(i);
+	}
+
+	// remove the pair matching key, whose hash input is input
+	size_t erase(const K& key, uint64_t input)
+	{
+		if (isLinear())
+		{
+			auto i = linearSlot(key, input);
+			if (i == m_table.size()) return 0;
+
+			// the last pair fills the gap
+			m_table.erase(i);
+			auto last = --m_num_pairs;
+			if (i != last)
+			{
+				m_table.move(last, i);
+				if (isSmall()) setTag(i, uint8_t(m_tags >> (8 * last)));
+			}
+			return 1;
+		}
+
+		auto i = m_hash(input);
+		auto found = m_table.getIfInput(i, input);
+		if (!found || !(found->first == key)) return 0;
+
+		--m_num_pairs;
+		m_table.erase(i);
+
+		return 1;
+	}
+
+	// set the capacity for num_pairs pairs (see fittedCapacity), rehashing if it changes
+	void fitCapacity(size_t num_pairs, size_t shrink_slack)
+	{
+		auto capacity = fittedCapacity(m_capacity, num_pairs, shrink_slack);
+		if (capacity != m_capacity) rebuild(capacity);
 	}
 
 	// check if we can (possibly) insert without rebuilding
@@ -211,15 +458,44 @@ private:
 		return m_num_pairs < m_capacity;
 	}
 
-	// convenience functions for getting the bucket for a key
-	inline pair_t*& getBucket(const K& key)
+	// the pair matching key, whose hash input is input, or null. keys are
+	// only compared if the slot's stored input (if any) matches
+	const pair_t* findPair(const K& key, uint64_t input) const
+	{
+		if (isLinear())
+		{
+			auto i = linearSlot(key, input);
+			return i < m_table.size() ? m_table.get(i) : nullptr;
+		}
+
+		auto pair = m_table.getIfInput(m_hash(input), input);
+		return pair && pair->first == key ? pair : nullptr;
+	}
+
+	pair_t* findPair(const K& key, uint64_t input)
 	{
-		return m_table.at(hashKey(m_hash, key));
+		return const_cast<pair_t*>(static_cast<const FastLookupMap*>(this)->findPair(key, input));
+	}
+
+	/* a lookup split in two, so that FastMap::lookupMany can overlap the
+	 * cache misses of many: probeSlot(input) is the slot to load for keys with
+	 * hash input input, and findPairAt is findPair once probeSlot's slot is loaded
+	 */
+	size_t probeSlot(uint64_t input) const
+	{
+		if (!isLinear()) return m_hash(input);
+		if (!isSmall()) return 0;
+
+		auto matches = matchTags(input);
+		return matches ? lowest_bit(matches) : 0;
 	}
 
-	inline pair_t* const& getBucket(const K& key) const
+	const pair_t* findPairAt(const K& key, uint64_t input, size_t slot) const
 	{
-		return m_table.at(hashKey(m_hash, key));
+		if (isLinear()) return findPair(key, input);
+
+		auto pair = m_table.getIfInput(slot, input);
+		return pair && pair->first == key ? pair : nullptr;
 	}
 
 	// how many buckets would there be if we insert another pair?
@@ -231,46 +507,137 @@ private:
 		return numBucketsFromCapacity(capacity);
 	}
 
-	// rebuild the table, getting it back into a consistent state
-	// e.g. too many pairs for capacity, collision exists, capacity was changed
-	void rebuild()
+	// rebuild the table at capacity (or more, if the pairs need it), getting it back into a consistent state
+	// e.g. too many pairs for capacity, collision exists, capacity is to change
+	void rebuild(size_t capacity)
 	{
-		// rebuilding is really easy if it's empty
-		if (m_num_pairs == 0)
+		node_list_t nodes;
+		nodes.reserve(m_num_pairs);
+		moveNodesToList(nodes);
+		rebuildFromList(nodes, capacity);
+	}
+
+	/* rebuild the (empty) table so that it holds exactly the pairs in nodes,
+	 * at capacity or more. if that throws (running out of memory, a hash
+	 * family without the range, or copying a key into InlineSlots), the
+	 * pairs not placed yet are put back or destroyed (see restoreNode), so
+	 * the table stays consistent and nothing leaks
+	 */
+	void rebuildFromList(node_list_t& nodes, size_t capacity)
+	{
+		// if we're over capacity, double it
+		while (nodes.size() > capacity) capacity *= 2;
+		auto new_table_size = numBucketsFromCapacity(capacity);
+		size_t k = 0; // nodes before k are in the table
+
+		try
 		{
-			m_table.resize(numBucketsFromCapacity(m_capacity));
-			m_hash = random_hash<K>(m_table.size());
-			return;
+			// small subtables just fill their slots in order
+			hash_t hash;
+			bool hashed = !isSmallCapacity(capacity);
+
+			// rebuilding is really easy if it's empty
+			if (hashed && nodes.empty())
+			{
+				hash = hash_t(new_table_size);
+			}
+			else if (hashed)
+			{
+				if (auto c = counters()) c->countSubtableRebuild();
+
+				// find a new hash function, or scan keys that no hash function can separate
+				hashed = findCollisionFreeHash(nodes, new_table_size, hash);
+			}
+
+			// move pairs back into the table
+			resetLayout(capacity, hashed ? &hash : nullptr);
+			for (; k < nodes.size(); ++k)
+			{
+				auto input = table_t::nodeHashInput(nodes[k]);
+				putNode(std::move(nodes[k]), input);
+			}
 		}
+		catch (...)
+		{
+			restoreNodes(nodes, k);
+			throw;
+		}
+	}
 
-		// if we're over capacity, double it
-		while (m_num_pairs > m_capacity) m_capacity *= 2;
-		auto new_table_size = numBucketsFromCapacity(m_capacity);
+	/* rebuild the (empty) table so that it holds exactly the pairs pointed to
+	 * by [first, last), with capacity for at least that many. used when a
+	 * FastMap rebuild hands each subtable its pairs in one piece. the current
+	 * hash is kept if it still fits, as most subtables only hold a few pairs.
+	 * the capacity is fitted to the pairs with shrink_slack (see fittedCapacity).
+	 * failures are handled as in rebuildFromList, so the table takes every node
+	 */
+	void assignNodes(node_t* const* first, node_t* const* last, size_t shrink_slack)
+	{
+		auto capacity = fittedCapacity(m_capacity, size_t(last - first), shrink_slack);
+		auto new_table_size = numBucketsFromCapacity(capacity);
 
-		// move all pairs into a temporary vector
-		table_t buckets;
-		buckets.reserve(m_num_pairs);
-		for (auto& bucket : m_table)
+		try
 		{
-			if (bucket)
+			// small subtables, and ones whose keys can't be separated, fill their slots in order
+			hash_t hash;
+			bool hashed = !isSmallCapacity(capacity);
+			if (hashed)
 			{
-				buckets.push_back(bucket);
-				bucket = nullptr;
+				auto& search = HashSearch<hash_t>::local();
+				search.loadKeys(first, last, [](const node_t* node) { return table_t::nodeHashInput(*node); });
+				hash = !isLinear() && m_hash.range() == new_table_size ? m_hash : hash_t(new_table_size);
+				if (auto c = counters()) c->countSubtableRebuild();
+				if (!search.isCollisionFree(hash))
+				{
+					hashed = search.findCollisionFree(new_table_size, hash);
+					if (auto c = counters()) c->countCollisionFreeSearch(search.lastAttempts());
+				}
 			}
+
+			resetLayout(capacity, hashed ? &hash : nullptr);
+			for (; first != last; ++first)
+			{
+				auto input = table_t::nodeHashInput(**first);
+				putNode(std::move(**first), input);
+			}
+		}
+		catch (...)
+		{
+			for (; first != last; ++first) restoreNode(**first);
+			throw;
 		}
+	}
 
-		// find a new hash function
-		m_hash = findCollisionFreeHash(buckets, new_table_size);
+	// move all pairs onto the end of nodes, leaving the table empty. if that
+	// throws, the pairs moved so far are put back and nodes is left as it was
+	void moveNodesToList(node_list_t& nodes)
+	{
+		auto first = nodes.size();
+		m_num_pairs = 0;
 
-		// move pairs back into the hash table
-		m_table.resize(new_table_size);
-		for (auto& bucket : buckets) getBucket(bucket->first) = bucket;
+		try
+		{
+			m_table.moveTo(nodes);
+		}
+		catch (...)
+		{
+			restoreNodes(nodes, first);
+			while (nodes.size() > first) nodes.pop_back();
+			throw;
+		}
 	}
 
 	table_t m_table;      // internal hash table
-	hash_t m_hash;        // hash function
 	size_t m_num_pairs;   // how many pairs are currently stored
 	size_t m_capacity;    // how many pairs can be stored without rebuilding
+	union
+	{
+		hash_t m_hash;    // hash function, unless small or scanned (see isLinear)
+		uint64_t m_tags;  // tag of the pair in slot i in byte i, while small (see isSmall)
+	};
+#ifdef FAST_MAP_STATS
+	FastMapCounters* m_counters {nullptr}; // the owning map's counters
+#endif
 };
 
 #endif
@@ -2,35 +2,196 @@
 #define FAST_MAP_H
 
 #include <algorithm>
-#include <functional>
+#include <atomic>
+#include <cstdlib>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <new>
 #include <stdexcept>
+#include <string>
 #include <utility>
 #include <vector>
 
 #include "fast_lookup_map.h"
+#include "frozen_fast_map.h"
+#include "thread_pool.h"
 
-template <class K, class V>
+template <class K, class V, class... Policies> class ConcurrentFastMap;
+template <class K, class V, class... Policies> class EpochFastMap;
+
+/* allocator for top-level tables. memory comes from calloc, which maps fresh
+ * zero pages for large blocks rather than clearing them, and value-initialized
+ * elements are left as they are. so a vector constructed with a size starts
+ * out zeroed (all null, for pointers) at next to no cost up front. other
+ * ways of growing such a vector must pass a value explicitly
+ */
+template <class T>
+struct ZeroedAllocator
+{
+	typedef T value_type;
+
+	ZeroedAllocator() = default;
+
+	template <class U>
+	ZeroedAllocator(const ZeroedAllocator<U>&)
+	{
+	}
+
+	T* allocate(size_t n)
+	{
+		auto p = std::calloc(n, sizeof(T));
+		if (!p) throw std::bad_alloc();
+		return static_cast<T*>(p);
+	}
+
+	void deallocate(T* p, size_t)
+	{
+		std::free(p);
+	}
+
+	template <class U>
+	void construct(U* p)
+	{
+		new (p) U;
+	}
+
+	template <class U, class... Args>
+	void construct(U* p, Args&&... args)
+	{
+		new (p) U(std::forward<Args>(args)...);
+	}
+
+	template <class U>
+	bool operator==(const ZeroedAllocator<U>&) const
+	{
+		return true;
+	}
+
+	template <class U>
+	bool operator!=(const ZeroedAllocator<U>&) const
+	{
+		return false;
+	}
+};
+
+/* Storage: how subtables hold their pairs (see slot_storage.h)
+ * Hash: the universal hash family (see universal_hash.h), applied to the keys' hash inputs (see pre_hash.h)
+ * Growth: how large the tables are relative to the number of pairs (see growth_policy.h)
+ */
+template <class K, class V, class Storage = NodeStorage, class Allocator = std::allocator<std::pair<const K, V>>, class Hash = DefaultHash<K>, class Growth = DefaultGrowth>
 class FastMap
 {
-	typedef std::function<size_t(K)> hash_t;
+	template <class, class, class...> friend class ConcurrentFastMap;
+	template <class, class, class...> friend class EpochFastMap;
+
+	typedef Hash hash_t;
 	typedef std::pair<const K, V> pair_t;
-	typedef FastLookupMap<K, V> subtable_t;
-	typedef std::vector<subtable_t*> table_t;
-	typedef std::vector<pair_t*> st_table_t; // the internal table type for the subtables (used during rebuilds)
+	typedef FastLookupMap<K, V, Storage, Allocator, Hash, Growth> subtable_t;
+	typedef std::vector<subtable_t*, ZeroedAllocator<subtable_t*>> table_t;
+	typedef typename subtable_t::table_t st_table_t; // the internal table type for the subtables
+	typedef typename subtable_t::node_t node_t;
+	typedef typename subtable_t::node_list_t node_list_t; // pairs moved out of the subtables (used during rebuilds)
+	typedef typename st_table_t::allocator_type node_alloc_t;
+	typedef FrozenFastMap<K, V, Hash> frozen_t;
 
 public:
+	/* iterates over the pairs, in no particular order. inserts, erases and
+	 * rebuilds invalidate every iterator. forEach is faster for a full scan
+	 */
+	class const_iterator
+	{
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef std::pair<const K, V> value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const value_type* pointer;
+		typedef const value_type& reference;
+
+		const_iterator() = default;
+
+		reference operator*() const
+		{
+			return *m_pair;
+		}
+
+		pointer operator->() const
+		{
+			return m_pair;
+		}
+
+		const_iterator& operator++()
+		{
+			++m_slot;
+			m_pair = m_map->nextPair(m_table, m_bucket, m_slot);
+			return *this;
+		}
+
+		const_iterator operator++(int)
+		{
+			auto it = *this;
+			++*this;
+			return it;
+		}
+
+		// every pair has its own address, and the end has none
+		bool operator==(const const_iterator& other) const
+		{
+			return m_pair == other.m_pair;
+		}
+
+		bool operator!=(const const_iterator& other) const
+		{
+			return m_pair != other.m_pair;
+		}
+
+	private:
+		friend class FastMap;
+
+		// the first pair of map
+		explicit const_iterator(const FastMap* map)
+			: m_map {map}
+		{
+			m_pair = m_map->nextPair(m_table, m_bucket, m_slot);
+		}
+
+		const FastMap* m_map {nullptr};
+		size_t m_table {0};  // 0 for m_table, 1 for m_old_table
+		size_t m_bucket {0}; // subtable bucket in that table
+		size_t m_slot {0};   // slot in that subtable (or in an opened snapshot)
+		const pair_t* m_pair {nullptr}; // null at the end
+	};
+
 	// construct with a hint that we need to store at least num_pairs pairs
-	FastMap(size_t num_pairs = 0)
-		: m_num_operations{0},
+	// (kept until the first rebuild due to operations, see m_hint_pairs)
+	// all pairs are allocated with (copies of) alloc
+	FastMap(size_t num_pairs = 0, const Allocator& alloc = Allocator())
+		: m_alloc{alloc},
+		m_pool{nullptr},
+		m_num_operations{0},
 		m_num_pairs{0},
-		m_threshold{thresholdFromNumPairs(num_pairs)}
+		m_num_buckets{0},
+		m_threshold{thresholdFromNumPairs(num_pairs)},
+		m_hint_pairs{num_pairs},
+		m_incremental{false},
+		m_migrate_pos{0},
+		m_migrate_step{0}
 	{
 		rebuild();
 	}
 
+	// construct holding the pairs in [first, last), built in one pass (see assign)
+	template <class It, class = typename std::iterator_traits<It>::iterator_category>
+	FastMap(It first, It last, const Allocator& alloc = Allocator())
+		: FastMap(0, alloc)
+	{
+		assign(first, last);
+	}
+
 	~FastMap()
 	{
 		for (auto& st_bucket : m_table) delete st_bucket;
+		for (auto& st_bucket : m_old_table) delete st_bucket;
 	}
 
 	size_t size() const
@@ -38,259 +199,1271 @@ public:
 		return m_num_pairs;
 	}
 
+	// return total size of the subtables' hash tables
+	// sum of s_j
+	size_t bucketCount() const
+	{
+		return m_num_buckets;
+	}
+
+	/* the most pairs the map can hold: beyond that its top-level table would
+	 * have more buckets than Hash can hash onto (Hash::MAX_RANGE). inserts
+	 * and assigns past it throw std::length_error
+	 */
+	static size_t maxSize()
+	{
+		// thresholds are set for at least 4 pairs (see thresholdFromNumPairs)
+		auto max_size = size_t(Hash::MAX_RANGE / Growth::topLevelScale() / (1 + Growth::thresholdScale()));
+		return max_size < 4 ? 0 : max_size;
+	}
+
 	// try to insert pair into the hash table
 	bool insert(const pair_t& pair)
 	{
-		// check for duplicate key
-		if (count(pair.first)) return false;
+		// a map serving a snapshot isn't copied in for a duplicate key
+		if (isOpenSnapshot() && m_snapshot.count(pair.first)) return false;
 
-		// after a certain number of successful inserts, do a rebuild regardless
-		if (m_num_operations >= m_threshold) return insertAndRebuild(pair);
+		auto input = subtable_t::hashInput(pair.first);
+		return findOrInsert(pair.first, input, [&] { return st_table_t::makeHashedNode(m_alloc, input, pair); }).second;
+	}
 
-		auto& st_bucket = getSubtable(pair.first);
+	// the same, moving the value into the map
+	bool insert(pair_t&& pair)
+	{
+		if (isOpenSnapshot() && m_snapshot.count(pair.first)) return false;
 
-		// create subtable if it doesn't exist
-		if (!st_bucket) st_bucket = new FastLookupMap<K, V>();
+		auto input = subtable_t::hashInput(pair.first);
+		return findOrInsert(pair.first, input, [&] { return st_table_t::makeHashedNode(m_alloc, input, std::move(pair)); }).second;
+	}
 
-		// if we can insert without growing the subtable, do that
-		if (st_bucket->isUnderCapacity())
-		{
-			++m_num_operations;
-			++m_num_pairs;
+	/* insert the pair constructed from args, unless its key is already in
+	 * the map. returns the value with that key and whether it was inserted.
+	 * the pair is constructed either way (see try_emplace). the value pointers
+	 * returned by this and the functions below stay valid until the next
+	 * insert or erase (for inline storage) or until the pair is erased
+	 * (for node storage)
+	 */
+	template <class... Args>
+	std::pair<V*, bool> emplace(Args&&... args)
+	{
+		auto node = st_table_t::makeNode(m_alloc, std::forward<Args>(args)...);
+		auto input = st_table_t::nodeHashInput(node);
 
-			return st_bucket->insert(pair);
+		bool inserted = false;
+		try
+		{
+			auto result = findOrInsert(st_table_t::nodeKey(node), input, [&] { inserted = true; return std::move(node); });
+			if (!inserted) st_table_t::destroyNode(m_alloc, node);
+			return std::make_pair(&result.first->second, inserted);
 		}
-
-		// else we need to see what the effect of adding the pair to the subtable would be
-
-		// Calculate new accumulated subtable allocation
-		// sum of s_j
-		/* TODO there may be a problem with excessive rebuilding.
-		 * since the subtales' capacities never shrink, if we add many pairs
-		 * then delete many pairs, we might always see the table as unbalanced
-		 * afterwards, until we add enough pairs to bump the threshold back up
-		 */
-		size_t num_buckets = st_bucket->bucketCountAfterInsert();
-		for (auto& stb : m_table)
+		catch (...)
 		{
-			if (stb && stb != st_bucket) num_buckets += stb->bucketCount();
+			if (!inserted) st_table_t::destroyNode(m_alloc, node);
+			throw;
 		}
+	}
 
-		// if the insert would be balanced, do that
-		if (isBucketCountBalanced(num_buckets, m_table.size(), m_threshold))
+	// insert a pair of key and the value constructed from args, unless key is
+	// already in the map. then nothing is constructed and args are left alone
+	template <class... Args>
+	std::pair<V*, bool> try_emplace(const K& key, Args&&... args)
+	{
+		auto input = subtable_t::hashInput(key);
+		auto result = findOrInsert(key, input, [&]
 		{
-			++m_num_operations;
-			++m_num_pairs;
+			return st_table_t::makeHashedNode(m_alloc, input, std::piecewise_construct,
+				std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+		});
+		return std::make_pair(&result.first->second, result.second);
+	}
 
-			return st_bucket->insert(pair);
-		}
+	// the same, moving key into the map
+	template <class... Args>
+	std::pair<V*, bool> try_emplace(K&& key, Args&&... args)
+	{
+		auto input = subtable_t::hashInput(key);
+		auto result = findOrInsert(key, input, [&]
+		{
+			return st_table_t::makeHashedNode(m_alloc, input, std::piecewise_construct,
+				std::forward_as_tuple(std::move(key)), std::forward_as_tuple(std::forward<Args>(args)...));
+		});
+		return std::make_pair(&result.first->second, result.second);
+	}
 
-		// else insert would unbalance table, rebuild
-		return insertAndRebuild(pair);
+	// assign value to the value matching key, or insert them if there is none
+	template <class M>
+	std::pair<V*, bool> insert_or_assign(const K& key, M&& value)
+	{
+		auto result = try_emplace(key, std::forward<M>(value));
+		if (!result.second) *result.first = std::forward<M>(value);
+		return result;
+	}
+
+	template <class M>
+	std::pair<V*, bool> insert_or_assign(K&& key, M&& value)
+	{
+		auto result = try_emplace(std::move(key), std::forward<M>(value));
+		if (!result.second) *result.first = std::forward<M>(value);
+		return result;
+	}
+
+	// the value matching key, inserting a value-initialized one if there is none
+	V& operator[](const K& key)
+	{
+		return *try_emplace(key).first;
+	}
+
+	V& operator[](K&& key)
+	{
+		return *try_emplace(std::move(key)).first;
 	}
 
 	// remove pair matching key from the table
 	size_t erase(const K& key)
 	{
-		if (!count(key)) return 0;
-
-		auto& st_bucket = getSubtable(key);
+		if (isOpenSnapshot())
+		{
+			if (!m_snapshot.count(key)) return 0;
+			thaw();
+		}
+		if (m_incremental && isMigrating()) migrate(m_migrate_step);
 
-		st_bucket->erase(key);
+		auto input = subtable_t::hashInput(key);
+		auto st_bucket = getSubtableFor(input);
+		if (!st_bucket || !st_bucket->erase(key, input)) return 0;
 
 		++m_num_operations;
 		--m_num_pairs;
 
-		if (m_num_operations >= m_threshold) rebuild();
+		if (m_num_operations >= m_threshold || isOversized())
+		{
+			if (m_incremental)
+				startMigration();
+			else
+				rebuild();
+		}
 
 		return 1;
 	}
 
 	// return the value matching key
-	V at(const K& key) const
+	const V& at(const K& key) const
 	{
-		if (!count(key)) throw std::out_of_range("FastMap::at");
-		auto& usubtable = getSubtable(key);
-		return !usubtable ? 0 : usubtable->at(key);
+		auto value = find(key);
+		if (!value) throw std::out_of_range("FastMap::at");
+		return *value;
+	}
+
+	// the value matching key, or null if there is none
+	const V* find(const K& key) const
+	{
+		auto pair = isOpenSnapshot() ? m_snapshot.getPair(key) : findPair(key);
+		return pair ? &pair->second : nullptr;
+	}
+
+	// the value matching key for changing in place, or null if there is none.
+	// if key is in a snapshot the map serves, this copies the pairs in first, as
+	// any change does, so lookups that won't write should use find
+	V* findForUpdate(const K& key)
+	{
+		if (isOpenSnapshot())
+		{
+			if (!m_snapshot.count(key)) return nullptr;
+			thaw();
+		}
+		auto pair = findPair(key);
+		return pair ? &pair->second : nullptr;
 	}
 
 	// return 1 if pair matching key is in table, else return 0
 	size_t count(const K& key) const
 	{
-		auto& st_bucket = getSubtable(key);
-		return st_bucket && st_bucket->count(key);
+		if (isOpenSnapshot()) return m_snapshot.count(key);
+		return findPair(key) != nullptr;
 	}
 
-	// rebuild the entire table
+	// set counts[k] to count(keys[k]) for each of the num_keys keys
+	// faster than separate calls to count for more than a few keys
+	void countMany(const K* keys, size_t num_keys, size_t* counts) const
+	{
+		lookupMany(keys, num_keys, [&](size_t k, const pair_t* pair) { counts[k] = pair != nullptr; });
+	}
+
+	// set values[k] to the value matching keys[k], or null if there is none, for each of the num_keys keys
+	void findMany(const K* keys, size_t num_keys, const V** values) const
+	{
+		lookupMany(keys, num_keys, [&](size_t k, const pair_t* pair) { values[k] = pair ? &pair->second : nullptr; });
+	}
+
+	const_iterator begin() const
+	{
+		return const_iterator(this);
+	}
+
+	const_iterator end() const
+	{
+		return const_iterator();
+	}
+
+	// call f(pair) for each pair, in no particular order. f must not change the map
+	template <class F>
+	void forEach(F f) const
+	{
+		if (isOpenSnapshot())
+		{
+			m_snapshot.forEachPair(f);
+			return;
+		}
+
+		for (auto table : {&m_table, &m_old_table}) forEachInRange(*table, 0, table->size(), f);
+	}
+
+	/* same as forEach, but the top-level table is split into ranges of
+	 * subtables that are scanned across pool, so f is called concurrently
+	 * from all of its threads
+	 */
+	template <class F>
+	void parallelForEach(ThreadPool& pool, F f) const
+	{
+		if (isOpenSnapshot())
+		{
+			pool.forRange(m_snapshot.m_num_slots, [&](size_t begin, size_t end)
+			{
+				for (size_t i = begin; i < end; ++i)
+				{
+					if (auto pair = m_snapshot.slotPair(i)) f(*pair);
+				}
+			});
+			return;
+		}
+
+		for (auto table : {&m_table, &m_old_table})
+		{
+			pool.forRange(table->size(), [&](size_t begin, size_t end) { forEachInRange(*table, begin, end, f); });
+		}
+	}
+
+	/* replace the contents of the map with the pairs in [first, last). the
+	 * table is sized once for all of them and every subtable is built at its
+	 * final size, which is much faster than inserting them one at a time.
+	 * of pairs with the same key only the first is kept
+	 */
+	template <class It>
+	void assign(It first, It last)
+	{
+		node_list_t nodes;
+		try
+		{
+			for (; first != last; ++first) pushNode(nodes, *first);
+
+			// the balanced hash search can't succeed with duplicate keys
+			dropDuplicates(nodes);
+		}
+		catch (...)
+		{
+			for (auto& node : nodes) st_table_t::destroyNode(m_alloc, node);
+			throw;
+		}
+
+		if (nodes.size() > maxSize())
+		{
+			for (auto& node : nodes) st_table_t::destroyNode(m_alloc, node);
+			throw std::length_error("FastMap::assign: more pairs than the hash family can hold");
+		}
+
+		deleteSubtables();
+		rebuildFromList(nodes);
+	}
+
+	// a compact read-only copy of the map (see FrozenFastMap)
+	frozen_t freeze() const
+	{
+		if (isOpenSnapshot()) return m_snapshot;
+
+		std::vector<const pair_t*> pairs;
+		pairs.reserve(m_num_pairs);
+
+		for (auto table : {&m_table, &m_old_table})
+		{
+			for (auto st_bucket : *table)
+			{
+				if (!st_bucket) continue;
+				for (size_t i = 0; i < st_bucket->m_table.size(); ++i)
+				{
+					if (auto pair = st_bucket->m_table.get(i)) pairs.push_back(pair);
+				}
+			}
+		}
+
+		return frozen_t(pairs);
+	}
+
+	// write a snapshot of the map to path (see FrozenFastMap::save)
+	void save(const std::string& path) const
+	{
+		freeze().save(path);
+	}
+
+	/* replace the contents of the map with the pairs in the snapshot at path.
+	 * lookups are served from the memory-mapped file (see FrozenFastMap::open)
+	 * without copying or rehashing anything, until the first change to the
+	 * map copies the pairs in and builds the map's own tables
+	 */
+	void open(const std::string& path)
+	{
+		auto snapshot = frozen_t::open(path);
+
+		deleteSubtables();
+		node_list_t nodes;
+		rebuildFromList(nodes);
+
+		m_snapshot = std::move(snapshot);
+		m_num_pairs = m_snapshot.size();
+	}
+
+	// rebuild the entire table (finishing any migration at once)
 	void rebuild()
 	{
-		insertAndRebuild(nullptr);
+		if (isOpenSnapshot())
+		{
+			thaw();
+			return;
+		}
+
+		node_list_t nodes;
+		nodes.reserve(m_num_pairs);
+		moveNodesToList(nodes);
+		rebuildFromList(nodes);
+	}
+
+	/* rebuild the entire table, shrinking the top-level table and every
+	 * subtable to what the current pairs need. rebuilds shrink them anyway
+	 * once they are several times larger than needed (and erasing most of the
+	 * pairs starts one), this also drops the spare room below that
+	 */
+	void shrinkToFit()
+	{
+		if (isOpenSnapshot())
+		{
+			thaw();
+			return;
+		}
+
+		m_hint_pairs = 0;
+		node_list_t nodes;
+		nodes.reserve(m_num_pairs);
+		moveNodesToList(nodes);
+		rebuildFromList(nodes, 1);
+	}
+
+	// spread the work of rebuilds over pool, or do it all on the calling
+	// thread if null (the default). pool must outlive its use by the map
+	void setThreadPool(ThreadPool* pool)
+	{
+		m_pool = pool;
 	}
 
-private:
-	// constants determining growth rates. TODO what happens when we vary these?
-	static const size_t THRESHOLD_SCALE = 2; // c, controls how the threshold scales based on number known pairs
-	static const size_t ST_BUCKET_SCALE = 3; // controls how number of buckets (for subtables) scales with the threshold
-	/* XXX in the paper they choose this to be 8 * sqrt(30) / 15 = 2.921,
-	 * in order to prove the linear space requirement of the map
+	/* in incremental mode, a full rebuild doesn't happen within a single
+	 * operation. instead the pairs move to a new top-level table a few
+	 * subtables at a time, as part of the inserts and erases that follow,
+	 * while lookups find each key in whichever table holds it. this bounds
+	 * the cost of every operation rather than just the amortized cost
+	 */
+	void setIncrementalRebuild(bool incremental)
+	{
+		m_incremental = incremental;
+		if (!m_incremental) finishMigration();
+	}
+
+	// is an incremental rebuild in progress?
+	bool isMigrating() const
+	{
+		return !m_old_table.empty();
+	}
+
+	/* a snapshot of the map's shape and of its rebuild counters. the counters
+	 * are only kept when compiled with FAST_MAP_STATS defined (stats.counting),
+	 * otherwise they read 0 and cost nothing. an opened snapshot that hasn't
+	 * been thawed yet has no subtables
 	 */
+	FastMapStats stats() const
+	{
+		FastMapStats stats;
+		m_counters.get(stats);
+		stats.num_pairs = m_num_pairs;
+		stats.threshold = m_threshold;
+		stats.num_operations = m_num_operations;
+		stats.num_subtables = m_table.size() + m_old_table.size();
+		stats.bucket_count = m_num_buckets;
+		stats.slot_bytes = 0;
+
+		for (auto table : {&m_table, &m_old_table})
+		{
+			for (auto st_bucket : *table)
+			{
+				auto num_pairs = st_bucket ? st_bucket->size() : 0;
+				if (stats.occupancy.size() <= num_pairs) stats.occupancy.resize(num_pairs + 1, 0);
+				++stats.occupancy[num_pairs];
+				if (st_bucket) stats.slot_bytes += st_table_t::slotBytes(st_bucket->bucketCount());
+			}
+		}
+
+		return stats;
+	}
+
+	// zero the counters in stats()
+	void resetStats()
+	{
+		m_counters.reset();
+	}
+
+	/* how many times more room than the current pairs need the tables may keep
+	 * before a rebuild shrinks them. deleting pairs until the threshold is
+	 * this many times what the remaining pairs would get also starts a rebuild
+	 */
+	static const size_t SHRINK_SLACK = 4;
+
+private:
+	// keys looked up together by lookupMany
+	static const size_t LOOKUP_BATCH_SIZE = 16;
+	// how many subtables ahead scans prefetch
+	static const size_t SCAN_PREFETCH_DISTANCE = 8;
+
+	// the constants determining growth rates come from Growth (see growth_policy.h)
 
 	// what should the threshold be if we need to store num_pairs pairs?
 	// (1 + c) * n
 	static size_t thresholdFromNumPairs(size_t num_pairs)
 	{
-		return (1 + THRESHOLD_SCALE) * std::max(num_pairs, (size_t)4);
+		return (1 + Growth::thresholdScale()) * std::max(num_pairs, (size_t)4);
 	}
 
 	// how many subtable buckets should we have for the current threshold?
 	// s(M)
 	static size_t stBucketCountFromThreshold(size_t threshold)
 	{
-		return ST_BUCKET_SCALE * threshold;
+		return Growth::topLevelScale() * threshold;
 	}
 
-	// find a balanced hash onto num_st_buckets for the pairs in buckets and the given threshold.
+	// find a balanced hash onto num_st_buckets for the pairs in nodes and the given threshold.
 	// return the hash and the distribution of pairs in the subtables
-	static std::pair<hash_t, std::vector<size_t>> findBalancedHash(const st_table_t& buckets, size_t num_st_buckets, size_t threshold)
+	static std::pair<hash_t, std::vector<uint32_t>> findBalancedHash(const node_list_t& nodes, size_t num_st_buckets, size_t threshold, ThreadPool* pool)
 	{
-		hash_t hash;
-		size_t num_buckets;
-		std::vector<size_t> hash_distribution(num_st_buckets);
+		auto& search = HashSearch<hash_t>::local();
+		search.loadKeys(nodes.begin(), nodes.end(), [](const node_t& node) { return st_table_t::nodeHashInput(node); });
 
-		do
-		{
-			hash = random_hash<K>(num_st_buckets);
+		// the resulting subtables' total number of buckets must be balanced
+		std::vector<uint32_t> hash_distribution;
+		auto cost = [](size_t num_pairs) { return subtable_t::numBucketsFromNumPairs(num_pairs); };
+		auto max_cost = maxBalancedBucketCount(num_st_buckets, threshold);
+		auto hash = pool ?
+			search.findBalanced(num_st_buckets, cost, max_cost, hash_distribution, *pool) :
+			search.findBalanced(num_st_buckets, cost, max_cost, hash_distribution);
 
-			// Calculate hash distribution
-			std::fill(hash_distribution.begin(), hash_distribution.end(), 0);
-			for (const auto& b : buckets) ++hash_distribution.at(hash(b->first));
+		return std::make_pair(hash, std::move(hash_distribution));
+	}
 
-			// Determine number of buckets in resulting subtables
-			num_buckets = 0;
-			for (auto size : hash_distribution) num_buckets += subtable_t::numBucketsFromNumPairs(size);
-		}
-		while (!isBucketCountBalanced(num_buckets, num_st_buckets, threshold));
+	// has the number of pairs fallen so far below what the threshold was set for that the tables should shrink?
+	static bool isOversized(size_t num_pairs, size_t threshold)
+	{
+		return thresholdFromNumPairs(num_pairs) * SHRINK_SLACK < threshold;
+	}
 
-		return std::make_pair(hash, hash_distribution);
+	// has the map shrunk so far below both its threshold and any hint that its tables should shrink?
+	bool isOversized() const
+	{
+		return isOversized(std::max(m_num_pairs, m_hint_pairs), m_threshold);
+	}
+
+	// how many pairs a rebuild should size the tables for: the current pairs,
+	// or the constructor's hint until the map reaches its threshold of operations
+	size_t pairsToFit()
+	{
+		if (m_num_operations >= m_threshold) m_hint_pairs = 0;
+		return std::max(m_num_pairs, m_hint_pairs);
 	}
 
 	// would the given total number of buckets be balanced for the threshold and number of subtable buckets?
 	static bool isBucketCountBalanced(size_t bucket_count, size_t st_bucket_count, size_t threshold)
 	{
-		if (bucket_count <= 4 * threshold) return true;
-		return (bucket_count - 4 * threshold) * st_bucket_count <= 32 * threshold * threshold;
+		return bucket_count <= maxBalancedBucketCount(st_bucket_count, threshold);
+	}
+
+	// largest balanced total number of buckets for the threshold and number of subtable buckets
+	// i.e. the largest bucket_count with (bucket_count - a * threshold) * st_bucket_count <= b * threshold^2
+	static size_t maxBalancedBucketCount(size_t st_bucket_count, size_t threshold)
+	{
+		// b * threshold^2 overflows 64 bits from about 250 million pairs on
+		return Growth::balanceLinear() * threshold + mulDiv(Growth::balanceQuadratic() * threshold, threshold, st_bucket_count);
+	}
+
+	// a * b / c without overflowing in between (the result has to fit)
+	static size_t mulDiv(size_t a, size_t b, size_t c)
+	{
+#ifdef __SIZEOF_INT128__
+		return size_t((unsigned __int128)a * b / c);
+#else
+		return size_t((long double)a * (long double)b / (long double)c);
+#endif
+	}
+
+	// a new subtable with room for num_pairs pairs, counting its rebuilds in m_counters
+	subtable_t* newSubtable(size_t num_pairs = 0)
+	{
+		auto subtable = new subtable_t(num_pairs, m_alloc);
+		subtable->setCounters(&m_counters);
+		return subtable;
+	}
+
+	// the subtable bucket for the key with hash input input
+	// keys whose old subtable hasn't been migrated yet are still in the old table
+	subtable_t*& getSubtableFor(uint64_t input)
+	{
+		if (isMigrating())
+		{
+			auto i = m_old_hash(input);
+			if (i >= m_migrate_pos) return m_old_table[i];
+		}
+		return m_table.at(m_hash(input));
 	}
 
-	// convenience functions for getting the subtable bucket for a key
-	subtable_t*& getSubtable(const K& key)
+	subtable_t* const& getSubtableFor(uint64_t input) const
 	{
-		return m_table.at(m_hash(key));
+		if (isMigrating())
+		{
+			auto i = m_old_hash(input);
+			if (i >= m_migrate_pos) return m_old_table[i];
+		}
+		return m_table.at(m_hash(input));
 	}
 
-	subtable_t* const& getSubtable(const K& key) const
+	// the pair matching key, or null. the key is hashed once, for both levels
+	const pair_t* findPair(const K& key) const
 	{
-		return m_table.at(m_hash(key));
+		auto input = subtable_t::hashInput(key);
+		auto st_bucket = getSubtableFor(input);
+		return st_bucket ? st_bucket->findPair(key, input) : nullptr;
 	}
 
-	// insert a new pair and rebuild the entire table
-	bool insertAndRebuild(const pair_t& new_pair)
+	pair_t* findPair(const K& key)
 	{
-		return insertAndRebuild(new pair_t(new_pair));
+		return const_cast<pair_t*>(static_cast<const FastMap*>(this)->findPair(key));
 	}
 
-	// insert a new pair (if non-null) and rebuild the entire table
-	// updates m_num_pairs and m_threshold, sets m_num_operations to 0
-	bool insertAndRebuild(pair_t* new_bucket)
+	/* the pair matching key, whose hash input is input, and whether it was
+	 * inserted: if there is none, the node made by make_node() is inserted.
+	 * each level hashes input once, unless inserting rebuilds it. key isn't
+	 * used once make_node has been called, so the node may take it over
+	 */
+	template <class MakeNode>
+	std::pair<pair_t*, bool> findOrInsert(const K& key, uint64_t input, MakeNode make_node)
 	{
-		// if the table is empty (and we aren't inserting) rebuilding is easy
-		if (!new_bucket && m_num_pairs == 0)
+		thaw();
+		if (m_incremental && isMigrating()) migrate(m_migrate_step);
+
+		auto& st_bucket = getSubtableFor(input);
+		if (st_bucket)
+		{
+			if (auto pair = st_bucket->findPair(key, input)) return std::make_pair(pair, false);
+		}
+		if (m_num_pairs >= maxSize()) throw std::length_error("FastMap::insert: more pairs than the hash family can hold");
+
+		// create subtable if it doesn't exist. before the node is made, so that it can't leak if this fails
+		if (!st_bucket)
+		{
+			st_bucket = newSubtable();
+			m_num_buckets += st_bucket->bucketCount();
+		}
+
+		auto node = make_node();
+		if (m_incremental) return std::make_pair(insertIncremental(*st_bucket, std::move(node), input), true);
+
+		// after a certain number of successful inserts, do a rebuild regardless
+		if (m_num_operations >= m_threshold) return std::make_pair(insertAndRebuild(std::move(node), input), true);
+
+		// if we can't insert without growing the subtable, see what the effect of adding the pair would be
+		if (!st_bucket->isUnderCapacity())
 		{
-			m_table.resize(stBucketCountFromThreshold(m_threshold));
-			m_hash = random_hash<K>(m_table.size());
-			m_num_operations = 0;
-			return false;
+			// Calculate new accumulated subtable allocation
+			// sum of s_j
+			/* subtables keep their capacity when pairs are deleted, so after many
+			 * deletes this may be unbalanced. the rebuild that follows shrinks them
+			 * (see SHRINK_SLACK), so it doesn't happen again right away
+			 */
+			size_t num_buckets = m_num_buckets - st_bucket->bucketCount() + st_bucket->bucketCountAfterInsert();
+
+			// if the insert would unbalance the table, rebuild
+			if (!isBucketCountBalanced(num_buckets, m_table.size(), m_threshold))
+				return std::make_pair(insertAndRebuild(std::move(node), input), true);
+
+			m_num_buckets = num_buckets;
 		}
 
-		// assume that non-null pair will be inserted
-		bool inserted = new_bucket != nullptr;
+		auto pair = insertInto(*st_bucket, std::move(node), input);
+		++m_num_operations;
+		++m_num_pairs;
+
+		return std::make_pair(pair, true);
+	}
 
-		// ensure duplicate keys are not added
-		if (new_bucket && count(new_bucket->first))
+	/* call found(k, pair) for each of the num_keys keys, with the pair
+	 * matching keys[k] or null. a lookup is a chain of dependent loads (top
+	 * level bucket, subtable, slot, node), so the keys go through each link of
+	 * the chain together in batches, prefetching the next link for every key
+	 * before using any of them. that way the cache misses overlap
+	 */
+	template <class F>
+	void lookupMany(const K* keys, size_t num_keys, F found) const
+	{
+		if (isOpenSnapshot())
 		{
-			delete new_bucket;
-			new_bucket = nullptr;
-			inserted = false;
+			for (size_t k = 0; k < num_keys; ++k) found(k, m_snapshot.getPair(keys[k]));
+			return;
 		}
 
-		// move all pairs from subtales into a list
-		st_table_t buckets = moveBucketsToList(m_num_pairs + 1);
+		uint64_t inputs[LOOKUP_BATCH_SIZE];
+		subtable_t* const* st_buckets[LOOKUP_BATCH_SIZE];
+		const subtable_t* subtables[LOOKUP_BATCH_SIZE];
+		size_t buckets[LOOKUP_BATCH_SIZE];
+
+		for (size_t first = 0; first < num_keys; first += LOOKUP_BATCH_SIZE)
+		{
+			auto batch = std::min(LOOKUP_BATCH_SIZE, num_keys - first);
+			auto batch_keys = keys + first;
+
+			// the top-level hash is the same for every key, so hash the whole batch at once
+			for (size_t j = 0; j < batch; ++j) inputs[j] = subtable_t::hashInput(batch_keys[j]);
+			if (isMigrating())
+			{
+				for (size_t j = 0; j < batch; ++j) st_buckets[j] = &getSubtableFor(inputs[j]);
+			}
+			else
+			{
+				hash_many(m_hash, inputs, batch, buckets);
+				for (size_t j = 0; j < batch; ++j) st_buckets[j] = &m_table[buckets[j]];
+			}
+
+			for (size_t j = 0; j < batch; ++j) prefetch(st_buckets[j]);
+
+			for (size_t j = 0; j < batch; ++j)
+			{
+				subtables[j] = *st_buckets[j];
+				if (subtables[j]) prefetch(subtables[j]);
+			}
 
-		// add new pair, if specified
-		if (new_bucket) buckets.push_back(new_bucket);
+			for (size_t j = 0; j < batch; ++j)
+			{
+				if (!subtables[j]) continue;
+				buckets[j] = subtables[j]->probeSlot(inputs[j]);
+				subtables[j]->m_table.prefetchSlot(buckets[j]);
+			}
 
-		m_num_pairs = buckets.size();
+			for (size_t j = 0; j < batch; ++j)
+			{
+				if (subtables[j]) subtables[j]->m_table.prefetchPair(buckets[j]);
+			}
 
-		/* TODO
-		 * worry about threshold (thus m_table) shrinking and leaking memory.
-		 * do we even want threshold to be able to shrink e.g. if we are given
-		 * a hint for a large threshold in the constructor?
-		 */
-		m_threshold = thresholdFromNumPairs(m_num_pairs);
-		m_table.resize(stBucketCountFromThreshold(m_threshold));
+			for (size_t j = 0; j < batch; ++j)
+			{
+				found(first + j, subtables[j] ? subtables[j]->findPairAt(batch_keys[j], inputs[j], buckets[j]) : nullptr);
+			}
+		}
+	}
 
-		// get balanced hash and hash distribution
-		auto hd_pair = findBalancedHash(buckets, m_table.size(), m_threshold);
-		m_hash = hd_pair.first;
-		auto& hash_distribution = hd_pair.second;
+	// call f(pair) for each pair in the subtables of table[begin, end)
+	template <class F>
+	void forEachInRange(const table_t& table, size_t begin, size_t end, F& f) const
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			// subtables are separate allocations, so start loading the next ones early
+			if (i + SCAN_PREFETCH_DISTANCE < end && table[i + SCAN_PREFETCH_DISTANCE]) prefetch(table[i + SCAN_PREFETCH_DISTANCE]);
+			if (table[i]) table[i]->forEach(f);
+		}
+	}
 
-		// all subtables should either be empty or null
-		for (size_t i = 0; i < m_table.size(); ++i)
+	/* the first pair at or after a position, moving the position to it, or
+	 * null if there is none. the position is a slot of the subtable in bucket
+	 * of m_table, or of m_old_table if table is 1 (or just a slot of an opened
+	 * snapshot)
+	 */
+	const pair_t* nextPair(size_t& table, size_t& bucket, size_t& slot) const
+	{
+		if (isOpenSnapshot())
 		{
-			// resize if subtable exists
-			if (m_table[i])
-				m_table[i]->reserve(hash_distribution[i]);
-			// else make a new subtable if needed
-			else if (hash_distribution[i])
-				m_table[i] = new FastLookupMap<K, V>(hash_distribution[i]);
+			for (; slot < m_snapshot.m_num_slots; ++slot)
+			{
+				if (auto pair = m_snapshot.slotPair(slot)) return pair;
+			}
+			return nullptr;
 		}
 
-		// move pairs from list back into subtables
-		for (auto& b : buckets) getSubtable(b->first)->insert(b);
+		for (; table < 2; ++table, bucket = 0, slot = 0)
+		{
+			auto& st_buckets = table ? m_old_table : m_table;
+			for (; bucket < st_buckets.size(); ++bucket, slot = 0)
+			{
+				auto st_bucket = st_buckets[bucket];
+				if (!st_bucket) continue;
 
+				slot = st_bucket->m_table.nextOccupied(slot);
+				if (slot < st_bucket->m_table.size()) return st_bucket->m_table.get(slot);
+			}
+		}
+		return nullptr;
+	}
+
+	// insert node, whose key has hash input input, into subtable (its
+	// subtable) in incremental mode. returns its pair
+	pair_t* insertIncremental(subtable_t& subtable, node_t&& node, uint64_t input)
+	{
+		auto st_buckets = subtable.bucketCount();
+		auto pair = insertInto(subtable, std::move(node), input);
+
+		// the subtable may have grown
+		m_num_buckets += subtable.bucketCount() - st_buckets;
+
+		++m_num_operations;
+		++m_num_pairs;
+
+		// balance is only checked once a migration completes
+		if (m_num_operations >= m_threshold ||
+			(!isMigrating() && !isBucketCountBalanced(m_num_buckets, m_table.size(), m_threshold)))
+		{
+			// finishing the last migration may move the pair. keys with equal
+			// hash inputs may share its subtable, so look it up by key
+			K key = pair->first;
+			startMigration();
+			pair = getSubtableFor(input)->findPair(key, input);
+		}
+
+		return pair;
+	}
+
+	// begin moving all pairs to a new top-level table, sized for the current
+	// number of pairs and with a new (random) hash
+	void startMigration()
+	{
+		finishMigration();
+
+		// a freshly allocated table, so that it doesn't need clearing (see ZeroedAllocator).
+		// it and its hash are made first, so that if that fails the map is left as it was
+		auto threshold = thresholdFromNumPairs(pairsToFit());
+		table_t table(stBucketCountFromThreshold(threshold));
+		hash_t hash(table.size());
+		m_counters.countMigration();
+
+		m_old_table.swap(m_table);
+		m_table.swap(table);
+		m_old_hash = m_hash;
+		m_hash = hash;
+		m_migrate_pos = 0;
+
+		m_threshold = threshold;
 		m_num_operations = 0;
-		return inserted;
+
+		// migrate enough subtables per operation to finish within half the
+		// operations before the next rebuild is due
+		m_migrate_step = std::max<size_t>(1, (2 * m_old_table.size() + m_threshold - 1) / m_threshold);
 	}
 
-	// move all the nonempty buckets out of the subtables and into one list
-	// this places the map in an inconsistent state
-	st_table_t moveBucketsToList(size_t size_hint = 0)
+	// migrate the next num_st_buckets subtable buckets of the old table
+	void migrate(size_t num_st_buckets)
 	{
-		st_table_t buckets;
-		buckets.reserve(size_hint);
+		auto end = std::min(m_old_table.size(), m_migrate_pos + num_st_buckets);
+		for (; m_migrate_pos < end; ++m_migrate_pos)
+		{
+			auto& old_bucket = m_old_table[m_migrate_pos];
+			if (!old_bucket) continue;
+
+			m_migrate_nodes.clear();
+			size_t num_taken = 0; // nodes before num_taken went to new subtables (see rebuildFromList)
+
+			try
+			{
+				old_bucket->moveNodesToList(m_migrate_nodes);
+				m_num_buckets -= old_bucket->bucketCount();
+				delete old_bucket;
+				old_bucket = nullptr;
+
+				for (auto& node : m_migrate_nodes)
+				{
+					auto& st_bucket = m_table.at(m_hash(st_table_t::nodeHashInput(node)));
+					auto st_buckets = st_bucket ? st_bucket->bucketCount() : 0;
+
+					if (!st_bucket) st_bucket = newSubtable();
+					++num_taken;
+					st_bucket->insert(std::move(node));
+
+					m_num_buckets += st_bucket->bucketCount() - st_buckets;
+				}
+			}
+			catch (...)
+			{
+				restoreNodes(m_migrate_nodes, num_taken);
+				throw;
+			}
+		}
+
+		if (m_migrate_pos < m_old_table.size()) return;
+
+		// done. if the new hash turned out unbalanced, try another
+		table_t().swap(m_old_table);
+		if (!isBucketCountBalanced(m_num_buckets, m_table.size(), m_threshold)) startMigration();
+	}
+
+	// complete any migration (and any that follow it) right away
+	void finishMigration()
+	{
+		while (isMigrating()) migrate(m_old_table.size());
+	}
+
+	// insert node, whose key has hash input input and isn't in the map yet,
+	// and rebuild the entire table. returns its pair
+	pair_t* insertAndRebuild(node_t&& node, uint64_t input)
+	{
+		// move all pairs from subtables into a list, after the new pair
+		node_list_t nodes;
+		try
+		{
+			nodes.reserve(m_num_pairs + 1);
+			nodes.push_back(std::move(node));
+			moveNodesToList(nodes);
+		}
+		catch (...)
+		{
+			// the map is left as it was, without the new pair
+			st_table_t::destroyNode(m_alloc, nodes.empty() ? node : nodes.front());
+			recount();
+			throw;
+		}
+
+		rebuildFromList(nodes);
+
+		// keys with equal hash inputs may share the pair's subtable, so it is found by key.
+		// moving a pair copies its const key, so the list still holds it (or points to it)
+		return getSubtableFor(input)->findPair(st_table_t::nodeKey(nodes.front()), input);
+	}
+
+	/* rebuild the entire table (whose pairs have all been moved to nodes)
+	 * updates m_num_pairs and m_threshold, sets m_num_operations to 0
+	 * tables keep at most shrink_slack times the room they need (see SHRINK_SLACK).
+	 * the top-level table and its hash only change together, and subtables
+	 * stay consistent when their rebuilds fail (see FastLookupMap::rebuildFromList),
+	 * so if this throws the nodes no subtable took are put back (see
+	 * restoreNode) and the map is left consistent, if maybe unbalanced
+	 */
+	void rebuildFromList(node_list_t& nodes, size_t shrink_slack = SHRINK_SLACK)
+	{
+		FastMapCounters::RebuildTimer timer(m_counters);
+		m_num_pairs = nodes.size();
+
+		m_threshold = thresholdFromNumPairs(pairsToFit());
+		auto num_st_buckets = stBucketCountFromThreshold(m_threshold);
+		size_t num_taken = 0; // nodes before num_taken went to subtables, which keep or destroy them even if they throw
+
+		try
+		{
+			// if the table is empty rebuilding is easy
+			if (m_num_pairs == 0)
+			{
+				hash_t hash(num_st_buckets);
+				resizeTable(num_st_buckets, shrink_slack);
+				m_hash = hash;
+				m_num_buckets = 0;
+				for (auto& st_bucket : m_table)
+				{
+					if (!st_bucket) continue;
+					st_bucket->fitCapacity(0, shrink_slack);
+					m_num_buckets += st_bucket->bucketCount();
+				}
+				m_num_operations = 0;
+				return;
+			}
+
+			// get balanced hash and hash distribution
+			auto hd_pair = findBalancedHash(nodes, num_st_buckets, m_threshold, m_pool);
+			m_counters.countBalancedSearch(HashSearch<hash_t>::local().lastAttempts());
+			resizeTable(num_st_buckets, shrink_slack);
+			m_hash = hd_pair.first;
+			auto& hash_distribution = hd_pair.second;
+
+			if (m_pool)
+			{
+				num_taken = nodes.size();
+				assignSubtables(nodes, hash_distribution, shrink_slack);
+			}
+			else
+			{
+				// all subtables should either be empty or null
+				for (size_t i = 0; i < m_table.size(); ++i)
+				{
+					// resize if subtable exists
+					if (m_table[i])
+						m_table[i]->fitCapacity(hash_distribution[i], shrink_slack);
+					// else make a new subtable if needed
+					else if (hash_distribution[i])
+						m_table[i] = newSubtable(hash_distribution[i]);
+				}
 
+				// move pairs from list back into subtables, reusing any stored hash inputs
+				for (auto& node : nodes)
+				{
+					++num_taken;
+					getSubtableFor(st_table_t::nodeHashInput(node))->insert(std::move(node));
+				}
+
+				m_num_buckets = 0;
+				for (auto& st_bucket : m_table)
+				{
+					if (st_bucket) m_num_buckets += st_bucket->bucketCount();
+				}
+			}
+
+			// the balanced hash counts every subtable at exactly the size it needs,
+			// so if the room kept on top of that unbalances the table, give it up
+			if (!isBucketCountBalanced(m_num_buckets, m_table.size(), m_threshold))
+			{
+				m_num_buckets = 0;
+				for (auto& st_bucket : m_table)
+				{
+					if (!st_bucket) continue;
+					st_bucket->shrinkToFit();
+					m_num_buckets += st_bucket->bucketCount();
+				}
+			}
+		}
+		catch (...)
+		{
+			restoreNodes(nodes, num_taken);
+			throw;
+		}
+
+		m_num_operations = 0;
+	}
+
+	/* parallel half of rebuildFromList: move nodes into the (empty or null)
+	 * subtables according to the new hash and its distribution, using m_pool.
+	 * the pairs are grouped by subtable first (a counting sort, by pointer) so
+	 * that every subtable is then rebuilt from its own slice independently.
+	 * takes every node: if this throws, the ones no subtable took are put back
+	 */
+	void assignSubtables(node_list_t& nodes, const std::vector<uint32_t>& hash_distribution, size_t shrink_slack)
+	{
+		std::vector<node_t*> sorted;
+		std::vector<char> taken; // whether subtable i took its slice of sorted
+		bool is_sorted = false;
+
+		try
+		{
+			// each cursor starts at the beginning of its subtable's slice and ends at the end
+			std::vector<std::atomic<size_t>> cursors(m_table.size());
+			size_t offset = 0;
+			for (size_t i = 0; i < m_table.size(); ++i)
+			{
+				cursors[i].store(offset, std::memory_order_relaxed);
+				offset += hash_distribution[i];
+			}
+
+			sorted.resize(nodes.size());
+			taken.resize(m_table.size(), false);
+			m_pool->forRange(nodes.size(), [&](size_t begin, size_t end)
+			{
+				for (size_t k = begin; k < end; ++k)
+				{
+					auto i = m_hash(st_table_t::nodeHashInput(nodes[k]));
+					sorted[cursors[i].fetch_add(1, std::memory_order_relaxed)] = &nodes[k];
+				}
+			});
+			is_sorted = true;
+
+			// rebuild the subtables, each with its own perfect hash search
+			std::atomic<size_t> num_buckets {0};
+			m_pool->forRange(m_table.size(), [&](size_t begin, size_t end)
+			{
+				size_t chunk_buckets = 0;
+				for (size_t i = begin; i < end; ++i)
+				{
+					auto& st_bucket = m_table[i];
+
+					// existing subtables are already empty
+					if (hash_distribution[i])
+					{
+						if (!st_bucket) st_bucket = newSubtable(hash_distribution[i]);
+						auto slice_end = cursors[i].load(std::memory_order_relaxed);
+						taken[i] = true;
+						st_bucket->assignNodes(&sorted[slice_end - hash_distribution[i]], &sorted[slice_end], shrink_slack);
+					}
+					else if (st_bucket)
+					{
+						st_bucket->fitCapacity(0, shrink_slack);
+					}
+
+					if (st_bucket) chunk_buckets += st_bucket->bucketCount();
+				}
+				num_buckets += chunk_buckets;
+			});
+
+			m_num_buckets = num_buckets;
+		}
+		catch (...)
+		{
+			if (!is_sorted)
+			{
+				for (auto& node : nodes) restoreNode(node);
+				throw;
+			}
+
+			size_t offset = 0;
+			for (size_t i = 0; i < m_table.size(); offset += hash_distribution[i++])
+			{
+				if (taken[i]) continue;
+				for (size_t k = offset; k < offset + hash_distribution[i]; ++k) restoreNode(*sorted[k]);
+			}
+			throw;
+		}
+	}
+
+	// destroy all but the first of the nodes with each key, keeping the rest in order
+	void dropDuplicates(node_list_t& nodes)
+	{
+		// sort by hash input and then position, so equal keys end up together, earliest first
+		std::vector<std::pair<uint64_t, size_t>> order(nodes.size());
+		for (size_t k = 0; k < nodes.size(); ++k)
+			order[k] = std::make_pair(st_table_t::nodeHashInput(nodes[k]), k);
+		std::sort(order.begin(), order.end());
+
+		auto key = [&](size_t i) -> const K& { return st_table_t::nodeKey(nodes[order[i].second]); };
+
+		std::vector<char> duplicate(nodes.size(), false);
+		size_t num_duplicates = 0;
+		for (size_t run = 0, run_end; run < order.size(); run = run_end)
+		{
+			run_end = run + 1;
+			while (run_end < order.size() && order[run_end].first == order[run].first) ++run_end;
+
+			// different keys may share a hash input, so compare each with the kept ones before it
+			for (size_t j = run + 1; j < run_end; ++j)
+			{
+				for (size_t i = run; i < j; ++i)
+				{
+					if (duplicate[order[i].second] || !(key(i) == key(j))) continue;
+
+					duplicate[order[j].second] = true;
+					++num_duplicates;
+					break;
+				}
+			}
+		}
+
+		if (!num_duplicates) return;
+
+		node_list_t unique;
+		unique.reserve(nodes.size() - num_duplicates);
+		for (size_t k = 0; k < nodes.size(); ++k)
+		{
+			if (duplicate[k])
+				st_table_t::destroyNode(m_alloc, nodes[k]);
+			else
+				unique.push_back(std::move(nodes[k]));
+		}
+		nodes.swap(unique);
+	}
+
+	// are lookups still served by an opened snapshot?
+	bool isOpenSnapshot() const
+	{
+		return m_snapshot.size() != 0;
+	}
+
+	// copy the pairs of an opened snapshot into the map, which then no longer needs it
+	void thaw()
+	{
+		if (!isOpenSnapshot()) return;
+
+		node_list_t nodes;
+		try
+		{
+			nodes.reserve(m_snapshot.size());
+			m_snapshot.forEachPair([&](const pair_t& pair) { pushNode(nodes, pair); });
+		}
+		catch (...)
+		{
+			// the snapshot still serves lookups
+			for (auto& node : nodes) st_table_t::destroyNode(m_alloc, node);
+			throw;
+		}
+		m_snapshot = frozen_t();
+
+		rebuildFromList(nodes);
+	}
+
+	// drop all pairs and subtables, abandoning any migration or opened snapshot.
+	// the top-level table keeps its size, so that it still matches its hash
+	void deleteSubtables()
+	{
 		for (auto& st_bucket : m_table)
 		{
-			if (!st_bucket) continue;
+			delete st_bucket;
+			st_bucket = nullptr;
+		}
+		for (auto& st_bucket : m_old_table) delete st_bucket;
+		table_t().swap(m_old_table);
+		m_snapshot = frozen_t();
+		m_num_pairs = 0;
+		m_num_buckets = 0;
+	}
+
+	// resize the top-level table, deleting the (empty) subtables that no longer fit
+	// its memory is reallocated if it has more than shrink_slack times the room needed
+	// if allocating the new table throws, the old one is left as it was
+	void resizeTable(size_t num_st_buckets, size_t shrink_slack)
+	{
+		if (m_table.capacity() > shrink_slack * num_st_buckets)
+		{
+			table_t table(num_st_buckets);
+			std::copy(m_table.begin(), m_table.begin() + std::ptrdiff_t(std::min(num_st_buckets, m_table.size())), table.begin());
+			m_table.swap(table);
+			for (size_t i = num_st_buckets; i < table.size(); ++i) delete table[i];
+		}
+		else
+		{
+			// shrinking within the capacity doesn't allocate
+			for (size_t i = num_st_buckets; i < m_table.size(); ++i) delete m_table[i];
+			m_table.resize(num_st_buckets, nullptr);
+		}
+	}
 
-			for (auto& bucket : st_bucket->m_table)
+	/* move all the pairs out of the subtables onto the end of nodes, abandoning
+	 * any migration. this places the map in an inconsistent state. if that
+	 * throws, the pairs moved so far are put back into their subtables (see
+	 * FastLookupMap::restoreNode) and nodes is left as it was
+	 */
+	void moveNodesToList(node_list_t& nodes)
+	{
+		auto first = nodes.size();
+
+		try
+		{
+			for (auto table : {&m_table, &m_old_table})
 			{
-				if (!bucket) continue;
-				buckets.push_back(bucket);
-				bucket = nullptr;
+				for (auto st_bucket : *table)
+				{
+					if (st_bucket) st_bucket->moveNodesToList(nodes);
+				}
 			}
+		}
+		catch (...)
+		{
+			for (auto k = first; k < nodes.size(); ++k) getSubtableFor(st_table_t::nodeHashInput(nodes[k]))->restoreNode(nodes[k]);
+			while (nodes.size() > first) nodes.pop_back();
+			recount();
+			throw;
+		}
 
-			st_bucket->clear();
+		for (auto& st_bucket : m_old_table) delete st_bucket;
+		table_t().swap(m_old_table);
+	}
+
+	// add a node holding the pair constructed from args to nodes. if that throws, nothing leaks
+	template <class... Args>
+	void pushNode(node_list_t& nodes, Args&&... args)
+	{
+		auto node = st_table_t::makeNode(m_alloc, std::forward<Args>(args)...);
+		try
+		{
+			nodes.push_back(std::move(node));
 		}
+		catch (...)
+		{
+			st_table_t::destroyNode(m_alloc, node);
+			throw;
+		}
+	}
 
-		return buckets;
+	// insert node, whose key has hash input input and isn't in the map yet, into
+	// subtable (see FastLookupMap::insertNew). the counts are redone if that throws
+	pair_t* insertInto(subtable_t& subtable, node_t&& node, uint64_t input)
+	{
+		try
+		{
+			return subtable.insertNew(std::move(node), input);
+		}
+		catch (...)
+		{
+			// a failed subtable rebuild may have dropped pairs or kept its old size
+			recount();
+			throw;
+		}
 	}
 
+	// after a rebuild failed part way, insert node, which no subtable took, into the
+	// subtable its key hashes to now. if that fails too, the node is destroyed
+	void restoreNode(node_t& node)
+	{
+		bool taken = false;
+		try
+		{
+			auto& st_bucket = getSubtableFor(st_table_t::nodeHashInput(node));
+			if (!st_bucket) st_bucket = newSubtable();
+			taken = true;
+			st_bucket->insert(std::move(node));
+		}
+		catch (...)
+		{
+			// subtables keep or destroy the nodes they take, even when they fail
+			if (!taken) st_table_t::destroyNode(m_alloc, node);
+		}
+	}
+
+	// restore the nodes from first on (see restoreNode) and count what the subtables hold
+	void restoreNodes(node_list_t& nodes, size_t first)
+	{
+		for (; first < nodes.size(); ++first) restoreNode(nodes[first]);
+		recount();
+	}
+
+	// count the pairs and buckets of all subtables again
+	void recount()
+	{
+		m_num_pairs = 0;
+		m_num_buckets = 0;
+		for (auto table : {&m_table, &m_old_table})
+		{
+			for (auto st_bucket : *table)
+			{
+				if (!st_bucket) continue;
+				m_num_pairs += st_bucket->size();
+				m_num_buckets += st_bucket->bucketCount();
+			}
+		}
+	}
+
+	node_alloc_t m_alloc;           // allocator shared by all subtables
 	table_t m_table;                // internal hash table
 	hash_t m_hash;                  // hash function
+	ThreadPool* m_pool;             // where rebuilds run, null for the calling thread
 	// variables
 	size_t m_num_operations; // how many successful inserts/deletes have been performed since the last rebuild
 	size_t m_num_pairs; // how many pairs are currently stored
+	size_t m_num_buckets; // sum of s_j, the total size of the subtables' hash tables
 	size_t m_threshold; // M, the threshold
+	/* pairs the constructor was told to expect, 0 once the hint has expired.
+	 * until then rebuilds size the tables for at least this many pairs and
+	 * erases don't shrink them. the hint expires at the first rebuild due to
+	 * reaching the threshold of operations (by then the map has had the
+	 * chance to fill up), or at shrinkToFit
+	 */
+	size_t m_hint_pairs;
+	// incremental rebuilds
+	bool m_incremental;       // migrate to new tables incrementally instead of rebuilding at once
+	table_t m_old_table;      // table being migrated from, empty unless migrating
+	hash_t m_old_hash;        // its hash function
+	size_t m_migrate_pos;     // subtable buckets of the old table before this one have been migrated
+	size_t m_migrate_step;    // subtable buckets to migrate per operation
+	node_list_t m_migrate_nodes; // scratch list for migrating a subtable
+	frozen_t m_snapshot;      // opened snapshot serving lookups until the first change, empty otherwise
+	FastMapCounters m_counters; // see stats()
 	/* the threshold ties together several aspects of the table:
 	 *   - how many operations can be done before a rebuild
 	 *   - how many buckets there are at the top level
@@ -298,4 +1471,7 @@ private:
 	 */
 };
 
+template <class K, class V, class Storage, class Allocator, class Hash, class Growth>
+const size_t FastMap<K, V, Storage, Allocator, Hash, Growth>::LOOKUP_BATCH_SIZE;
+
 #endif
@@ -0,0 +1,151 @@
+#ifndef FAST_MAP_STATS_H
+#define FAST_MAP_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// a snapshot of a FastMap's statistics (see FastMap::stats)
+struct FastMapStats
+{
+	bool counting; // whether the counters were kept (only when compiled with FAST_MAP_STATS)
+
+	// counters, since construction or the last resetStats
+	size_t global_rebuilds;         // full rebuilds, from inserts (insertAndRebuild), erases, rebuild() or assign
+	double global_rebuild_seconds;  // time spent rehashing the pairs in them
+	size_t migrations;              // incremental rebuilds started
+	size_t subtable_rebuilds;       // subtables rehashed with pairs in them (on their own or as part of a global rebuild)
+	size_t balanced_searches;       // top-level hash searches (findBalancedHash)
+	size_t balanced_attempts;       // hashes tried by them
+	size_t collision_free_searches; // subtable hash searches (findCollisionFreeHash)
+	size_t collision_free_attempts; // hashes tried by them
+
+	// current state
+	size_t num_pairs;
+	size_t threshold;               // operations between global rebuilds
+	size_t num_operations;          // operations since the last global rebuild
+	size_t num_subtables;           // size of the top-level table (both tables while migrating)
+	size_t bucket_count;            // total size of the subtables' hash tables (bucketCount())
+	size_t slot_bytes;              // memory taken by those slots (not counting separately allocated pairs)
+	std::vector<size_t> occupancy;  // occupancy[k] is the number of subtables holding k pairs (missing ones count as empty)
+};
+
+#ifdef FAST_MAP_STATS
+
+/* counters updated by a FastMap and its subtables. updates are relaxed
+ * atomics, as subtables may rebuild concurrently (in a ConcurrentFastMap or
+ * a parallel global rebuild)
+ */
+class FastMapCounters
+{
+	std::atomic<size_t> m_global_rebuilds {0};
+	std::atomic<uint64_t> m_global_rebuild_ns {0};
+	std::atomic<size_t> m_migrations {0};
+	std::atomic<size_t> m_subtable_rebuilds {0};
+	std::atomic<size_t> m_balanced_searches {0};
+	std::atomic<size_t> m_balanced_attempts {0};
+	std::atomic<size_t> m_collision_free_searches {0};
+	std::atomic<size_t> m_collision_free_attempts {0};
+
+	static void add(std::atomic<size_t>& counter, size_t n)
+	{
+		counter.fetch_add(n, std::memory_order_relaxed);
+	}
+
+public:
+	// times a global rebuild, from construction to destruction
+	class RebuildTimer
+	{
+		FastMapCounters& m_counters;
+		std::chrono::steady_clock::time_point m_start;
+	public:
+		RebuildTimer(FastMapCounters& counters)
+			: m_counters {counters},
+			m_start {std::chrono::steady_clock::now()}
+		{
+		}
+
+		~RebuildTimer()
+		{
+			auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+			add(m_counters.m_global_rebuilds, 1);
+			m_counters.m_global_rebuild_ns.fetch_add(uint64_t(ns), std::memory_order_relaxed);
+		}
+	};
+
+	static constexpr bool counting()
+	{
+		return true;
+	}
+
+	void countMigration() { add(m_migrations, 1); }
+	void countSubtableRebuild() { add(m_subtable_rebuilds, 1); }
+	void countBalancedSearch(size_t attempts) { add(m_balanced_searches, 1); add(m_balanced_attempts, attempts); }
+	void countCollisionFreeSearch(size_t attempts) { add(m_collision_free_searches, 1); add(m_collision_free_attempts, attempts); }
+
+	// copy the counters into stats
+	void get(FastMapStats& stats) const
+	{
+		stats.counting = true;
+		stats.global_rebuilds = m_global_rebuilds;
+		stats.global_rebuild_seconds = double(m_global_rebuild_ns) / 1e9;
+		stats.migrations = m_migrations;
+		stats.subtable_rebuilds = m_subtable_rebuilds;
+		stats.balanced_searches = m_balanced_searches;
+		stats.balanced_attempts = m_balanced_attempts;
+		stats.collision_free_searches = m_collision_free_searches;
+		stats.collision_free_attempts = m_collision_free_attempts;
+	}
+
+	void reset()
+	{
+		for (auto counter : {&m_global_rebuilds, &m_migrations, &m_subtable_rebuilds, &m_balanced_searches,
+			&m_balanced_attempts, &m_collision_free_searches, &m_collision_free_attempts})
+			counter->store(0, std::memory_order_relaxed);
+		m_global_rebuild_ns.store(0, std::memory_order_relaxed);
+	}
+};
+
+#else
+
+// without FAST_MAP_STATS nothing is counted, and all of this compiles away
+class FastMapCounters
+{
+public:
+	class RebuildTimer
+	{
+	public:
+		RebuildTimer(FastMapCounters&) {}
+	};
+
+	static constexpr bool counting()
+	{
+		return false;
+	}
+
+	void countMigration() {}
+	void countSubtableRebuild() {}
+	void countBalancedSearch(size_t) {}
+	void countCollisionFreeSearch(size_t) {}
+
+	void get(FastMapStats& stats) const
+	{
+		stats.counting = false;
+		stats.global_rebuilds = 0;
+		stats.global_rebuild_seconds = 0;
+		stats.migrations = 0;
+		stats.subtable_rebuilds = 0;
+		stats.balanced_searches = 0;
+		stats.balanced_attempts = 0;
+		stats.collision_free_searches = 0;
+		stats.collision_free_attempts = 0;
+	}
+
+	void reset() {}
+};
+
+#endif
+
+#endif
@@ -0,0 +1,466 @@
+#ifndef FROZEN_FAST_MAP_H
+#define FROZEN_FAST_MAP_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fast_lookup_map.h"
+#include "hash_search.h"
+#include "universal_hash.h"
+
+/* immutable perfect-hash index for data that is built once and then only
+ * read, made with FastMap::freeze or from a range of pairs. like FastMap, a
+ * key is hashed to a bucket and then by the bucket's own perfect hash to a
+ * slot, but nothing is kept for later writes: there is one bucket per pair,
+ * a bucket of b pairs gets exactly b^2 slots, and the slots of every bucket
+ * are packed into one array of pairs at 32-bit offsets. a lookup reads one
+ * bucket and one slot.
+ *
+ * empty slots hold a copy of a pair that hashes somewhere else (another pair
+ * of the bucket, or for an empty bucket the pair after it), which no key that
+ * hashes there can match. so lookups compare keys without an occupancy check.
+ *
+ * keys with equal hash inputs (see pre_hash.h) always land in the same bucket
+ * and no hash separates them. such a bucket keeps its pairs in order in its
+ * first slots instead, and lookups that miss the first one scan the rest.
+ *
+ * the buckets and slots never change once built, so copies of a map share
+ * them, and save() writes them to a file that open() maps back into memory
+ * as is (for keys, values and hashes that can be copied as raw bytes)
+ */
+template <class K, class V, class Hash = DefaultHash<K>>
+class FrozenFastMap
+{
+	template <class, class, class, class, class, class> friend class FastMap;
+
+	typedef Hash hash_t;
+	typedef std::pair<const K, V> pair_t;
+	typedef FastLookupMap<K, V, NodeStorage, std::allocator<pair_t>, Hash> subtable_t; // for hashInput
+
+	struct bucket_t
+	{
+		hash_t hash; // onto the bucket's slots, maps every key to 0 for buckets with fewer than 2 pairs or scanned ones
+		uint32_t offset {0}; // index of the bucket's first slot
+		uint32_t num_scanned {0}; // pairs in the first slots of a bucket with equal hash inputs, else 0
+	};
+
+	// buckets and slots of a map built in memory
+	struct data_t
+	{
+		std::vector<bucket_t> buckets;
+		std::vector<pair_t> slots;
+	};
+
+	/* snapshot files are this header, then the buckets and then the slots,
+	 * each starting at a multiple of SNAPSHOT_ALIGNMENT (a page on most
+	 * systems). the buckets and slots are stored exactly as in memory
+	 */
+	static const uint32_t SNAPSHOT_VERSION = 3;
+	static const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+	static const size_t SNAPSHOT_ALIGNMENT = 4096;
+
+	struct snapshot_header_t
+	{
+		char magic[8];         // "FASTMAP" and a null
+		uint32_t version;      // SNAPSHOT_VERSION when written
+		uint32_t byte_order;   // SNAPSHOT_BYTE_ORDER as written by the saving machine
+		uint64_t layout;       // fingerprint of the key, value and hash types
+		uint64_t pair_size;
+		uint64_t bucket_size;
+		uint64_t num_pairs;
+		uint64_t num_buckets;
+		uint64_t num_slots;
+		uint64_t buckets_offset; // in bytes from the start of the file
+		uint64_t slots_offset;
+		uint64_t file_size;
+		hash_t hash;           // the top-level hash
+	};
+
+public:
+	FrozenFastMap()
+		: m_buckets {nullptr},
+		m_slots {nullptr},
+		m_num_buckets {0},
+		m_num_slots {0},
+		m_num_pairs {0}
+	{
+	}
+
+	// construct holding the pairs in [first, last). of pairs with the same key only the first is kept
+	template <class It, class = typename std::iterator_traits<It>::iterator_category>
+	FrozenFastMap(It first, It last)
+		: FrozenFastMap()
+	{
+		std::vector<pair_t> copies(first, last);
+		std::vector<const pair_t*> pairs;
+		pairs.reserve(copies.size());
+		for (auto& pair : copies) pairs.push_back(&pair);
+
+		dropDuplicates(pairs);
+		build(pairs);
+	}
+
+	size_t size() const
+	{
+		return m_num_pairs;
+	}
+
+	// return the value matching key
+	const V& at(const K& key) const
+	{
+		auto pair = getPair(key);
+		if (!pair) throw std::out_of_range("FrozenFastMap::at");
+		return pair->second;
+	}
+
+	// return 1 if pair matching key is in table, else return 0
+	size_t count(const K& key) const
+	{
+		return getPair(key) != nullptr;
+	}
+
+	// number of top-level buckets
+	size_t bucketCount() const
+	{
+		return m_num_buckets;
+	}
+
+	// number of slots for pairs, including the ones holding filler copies
+	size_t slotCount() const
+	{
+		return m_num_slots;
+	}
+
+	// bytes used by the index (not counting memory owned by the hashes or the pairs themselves)
+	size_t memoryUsage() const
+	{
+		return sizeof(*this) + m_num_buckets * sizeof(bucket_t) + m_num_slots * sizeof(pair_t);
+	}
+
+	// can maps of this type be saved and opened? (keys, values and hashes must be copyable as raw bytes)
+	static constexpr bool canSnapshot()
+	{
+		return std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value && std::is_trivially_copyable<hash_t>::value;
+	}
+
+	// write the map to a snapshot file at path, replacing any existing file. the
+	// file is written under a temporary name first, so maps that have the old
+	// file open keep working
+	void save(const std::string& path) const
+	{
+		checkSnapshotTypes();
+
+		snapshot_header_t header;
+		std::memset(static_cast<void*>(&header), 0, sizeof(header)); // so padding is written as zeroes
+		std::memcpy(header.magic, "FASTMAP", 8);
+		header.version = SNAPSHOT_VERSION;
+		header.byte_order = SNAPSHOT_BYTE_ORDER;
+		header.layout = layoutFingerprint();
+		header.pair_size = sizeof(pair_t);
+		header.bucket_size = sizeof(bucket_t);
+		header.num_pairs = m_num_pairs;
+		header.num_buckets = m_num_buckets;
+		header.num_slots = m_num_slots;
+		header.buckets_offset = SNAPSHOT_ALIGNMENT;
+		header.slots_offset = alignSnapshot(header.buckets_offset + m_num_buckets * sizeof(bucket_t));
+		header.file_size = header.slots_offset + m_num_slots * sizeof(pair_t);
+		header.hash = m_hash;
+
+		auto temp_path = path + ".tmp";
+		std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+		auto write = [&](const void* data, size_t size, size_t offset)
+		{
+			// pad with zeroes up to offset first
+			static const char zeroes[SNAPSHOT_ALIGNMENT] = {};
+			if (!file) return;
+			file.write(zeroes, std::streamsize(offset - size_t(file.tellp())));
+			file.write(static_cast<const char*>(data), std::streamsize(size));
+		};
+		write(&header, sizeof(header), 0);
+		write(m_buckets, m_num_buckets * sizeof(bucket_t), header.buckets_offset);
+		write(m_slots, m_num_slots * sizeof(pair_t), header.slots_offset);
+
+		file.close();
+		if (!file || std::rename(temp_path.c_str(), path.c_str()) != 0)
+		{
+			std::remove(temp_path.c_str());
+			throw std::runtime_error("FrozenFastMap::save failed to write " + path);
+		}
+	}
+
+	/* map the snapshot file at path into memory and serve lookups straight
+	 * from it: nothing is copied or rehashed, so opening takes about the same
+	 * time for any size of map, and pages are only read in as lookups touch
+	 * them. the file must not change while any copy of the map is open.
+	 * throws if the file isn't a snapshot of this type of map. beyond the
+	 * header, the contents are trusted
+	 */
+	static FrozenFastMap open(const std::string& path)
+	{
+		checkSnapshotTypes();
+
+		// close fd (unless it's negative) and throw the error in errno, saved first as close may change it
+		auto fail = [&](int fd, const char* what)
+		{
+			int error = errno;
+			if (fd >= 0) ::close(fd);
+			throw std::system_error(error, std::generic_category(), std::string(what) + " " + path);
+		};
+
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) fail(fd, "FrozenFastMap::open failed to open");
+
+		struct stat file_stat;
+		if (::fstat(fd, &file_stat) != 0) fail(fd, "FrozenFastMap::open failed to stat");
+
+		auto size = size_t(file_stat.st_size);
+		if (size < sizeof(snapshot_header_t))
+		{
+			::close(fd);
+			throw std::runtime_error("FrozenFastMap::open: " + path + " is not a snapshot");
+		}
+
+		void* address = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (address == MAP_FAILED) fail(fd, "FrozenFastMap::open failed to map");
+		// the mapping stays valid without the file descriptor
+		::close(fd);
+
+		FrozenFastMap map;
+		map.m_memory = std::shared_ptr<const void>(address, [size](const void* p) { ::munmap(const_cast<void*>(p), size); });
+
+		snapshot_header_t header;
+		std::memcpy(&header, address, sizeof(header));
+
+		auto fits = [&](uint64_t offset, uint64_t count, size_t item_size)
+		{
+			return offset % SNAPSHOT_ALIGNMENT == 0 && offset <= size && count <= (size - offset) / item_size;
+		};
+		if (std::memcmp(header.magic, "FASTMAP", 8) != 0)
+			throw std::runtime_error("FrozenFastMap::open: " + path + " is not a snapshot");
+		if (header.version != SNAPSHOT_VERSION || header.byte_order != SNAPSHOT_BYTE_ORDER ||
+			header.layout != layoutFingerprint() || header.pair_size != sizeof(pair_t) || header.bucket_size != sizeof(bucket_t))
+			throw std::runtime_error("FrozenFastMap::open: " + path + " is a snapshot of a different version or type of map");
+		if (header.file_size != size || !fits(header.buckets_offset, header.num_buckets, sizeof(bucket_t)) ||
+			!fits(header.slots_offset, header.num_slots, sizeof(pair_t)) || (header.num_pairs && (!header.num_buckets || !header.num_slots)))
+			throw std::runtime_error("FrozenFastMap::open: " + path + " is truncated or corrupt");
+
+		auto bytes = static_cast<const char*>(address);
+		map.m_hash = header.hash;
+		map.m_buckets = reinterpret_cast<const bucket_t*>(bytes + header.buckets_offset);
+		map.m_slots = reinterpret_cast<const pair_t*>(bytes + header.slots_offset);
+		map.m_num_buckets = size_t(header.num_buckets);
+		map.m_num_slots = header.num_pairs ? size_t(header.num_slots) : 0;
+		map.m_num_pairs = size_t(header.num_pairs);
+
+		return map;
+	}
+
+private:
+	// construct holding exactly the (distinct) pairs pointed to by pairs
+	explicit FrozenFastMap(const std::vector<const pair_t*>& pairs)
+		: FrozenFastMap()
+	{
+		build(pairs);
+	}
+
+	// the pair matching key, or null
+	const pair_t* getPair(const K& key) const
+	{
+		if (!m_num_slots) return nullptr;
+
+		auto input = subtable_t::hashInput(key);
+		auto& bucket = m_buckets[m_hash(input)];
+		auto& pair = m_slots[bucket.offset + bucket.hash(input)];
+		if (pair.first == key) return &pair;
+
+		for (uint32_t i = 1; i < bucket.num_scanned; ++i)
+		{
+			auto& scanned = m_slots[bucket.offset + i];
+			if (scanned.first == key) return &scanned;
+		}
+		return nullptr;
+	}
+
+	// fill the (empty) map with copies of the distinct pairs pointed to by pairs
+	void build(const std::vector<const pair_t*>& pairs)
+	{
+		if (pairs.empty()) return;
+		if (pairs.size() > std::numeric_limits<uint32_t>::max() / 3)
+			throw std::length_error("FrozenFastMap has too many pairs for 32-bit offsets");
+
+		m_num_pairs = pairs.size();
+		auto input = [](const pair_t* pair) { return subtable_t::hashInput(pair->first); };
+
+		/* one bucket per pair, with b^2 slots for a bucket of b pairs. a universal
+		 * hash gives under 2 slots per pair on average, but some draws cluster
+		 * the keys, so insist on at most 2.5 (retrying is cheap next to the
+		 * memory it saves)
+		 */
+		auto& search = HashSearch<hash_t>::local();
+		search.loadKeys(pairs.begin(), pairs.end(), input);
+		std::vector<uint32_t> distribution;
+		m_hash = search.findBalanced(m_num_pairs, [](size_t b) { return b * b; }, m_num_pairs * 5 / 2, distribution);
+
+		// group the pairs by bucket
+		auto data = std::make_shared<data_t>();
+		auto& buckets = data->buckets;
+		buckets.resize(m_num_pairs);
+		std::vector<size_t> starts(m_num_pairs + 1);
+		size_t num_slots = 0;
+		for (size_t i = 0; i < m_num_pairs; ++i)
+		{
+			buckets[i].offset = uint32_t(num_slots);
+			num_slots += size_t(distribution[i]) * distribution[i];
+			starts[i + 1] = starts[i] + distribution[i];
+		}
+
+		std::vector<const pair_t*> grouped(m_num_pairs);
+		{
+			auto cursors = starts;
+			for (auto pair : pairs) grouped[cursors[m_hash(input(pair))]++] = pair;
+		}
+
+		// place every pair with its bucket's perfect hash. the extra slot at the
+		// end is read by lookups in the empty buckets after the last pair
+		std::vector<const pair_t*> sources(num_slots + 1, pairs.front());
+		for (size_t i = 0; i < m_num_pairs; ++i)
+		{
+			auto first = grouped.begin() + ptrdiff_t(starts[i]);
+			auto last = grouped.begin() + ptrdiff_t(starts[i + 1]);
+			if (first == last) continue;
+
+			auto& bucket = buckets[i];
+			auto b = size_t(last - first);
+			if (b > 1)
+			{
+				search.loadKeys(first, last, input);
+				if (!search.findCollisionFree(b * b, bucket.hash)) bucket.num_scanned = uint32_t(b);
+			}
+
+			std::fill_n(sources.begin() + bucket.offset, b * b, *first);
+			if (bucket.num_scanned)
+				std::copy(first, last, sources.begin() + bucket.offset);
+			else
+				for (auto it = first; it != last; ++it) sources[bucket.offset + bucket.hash(input(*it))] = *it;
+		}
+
+		auto& slots = data->slots;
+		slots.reserve(sources.size());
+		for (auto pair : sources) slots.push_back(*pair);
+
+		m_buckets = buckets.data();
+		m_slots = slots.data();
+		m_num_buckets = buckets.size();
+		m_num_slots = slots.size();
+		m_memory = std::move(data);
+	}
+
+	// call f(pair) for every pair stored, skipping the filler copies
+	template <class F>
+	void forEachPair(F f) const
+	{
+		for (size_t i = 0; i < m_num_slots; ++i)
+		{
+			if (auto pair = slotPair(i)) f(*pair);
+		}
+	}
+
+	// the pair in slot i, or null if the slot is empty
+	const pair_t* slotPair(size_t i) const
+	{
+		// a pair is the real one if it sits in the slot its key hashes to, or
+		// among the pairs of a scanned bucket
+		auto input = subtable_t::hashInput(m_slots[i].first);
+		auto& bucket = m_buckets[m_hash(input)];
+		bool real = bucket.offset + bucket.hash(input) == i || (i >= bucket.offset && i - bucket.offset < bucket.num_scanned);
+		return real ? &m_slots[i] : nullptr;
+	}
+
+	static void checkSnapshotTypes()
+	{
+		static_assert(canSnapshot(), "FrozenFastMap snapshots store keys, values and hashes as raw bytes");
+	}
+
+	// round a file offset up to SNAPSHOT_ALIGNMENT
+	static uint64_t alignSnapshot(uint64_t offset)
+	{
+		return (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+	}
+
+	// FNV-1a of the map's type name, which differs for different key, value or hash types
+	static uint64_t layoutFingerprint()
+	{
+		uint64_t fingerprint = 0xcbf29ce484222325ULL;
+		for (auto c = typeid(FrozenFastMap).name(); *c; ++c) fingerprint = (fingerprint ^ uint8_t(*c)) * 0x100000001b3ULL;
+		return fingerprint;
+	}
+
+	// remove all but the first of the pairs with each key, keeping the rest in order
+	static void dropDuplicates(std::vector<const pair_t*>& pairs)
+	{
+		// sort by hash input and then position, so equal keys end up together, earliest first
+		std::vector<std::pair<uint64_t, size_t>> order(pairs.size());
+		for (size_t k = 0; k < pairs.size(); ++k) order[k] = std::make_pair(subtable_t::hashInput(pairs[k]->first), k);
+		std::sort(order.begin(), order.end());
+
+		std::vector<char> duplicate(pairs.size(), false);
+		for (size_t run = 0, run_end; run < order.size(); run = run_end)
+		{
+			run_end = run + 1;
+			while (run_end < order.size() && order[run_end].first == order[run].first) ++run_end;
+
+			// different keys may share a hash input, so compare each with the kept ones before it
+			for (size_t j = run + 1; j < run_end; ++j)
+			{
+				for (size_t i = run; i < j; ++i)
+				{
+					if (duplicate[order[i].second] || !(pairs[order[i].second]->first == pairs[order[j].second]->first)) continue;
+
+					duplicate[order[j].second] = true;
+					break;
+				}
+			}
+		}
+
+		size_t kept = 0;
+		for (size_t k = 0; k < pairs.size(); ++k)
+		{
+			if (!duplicate[k]) pairs[kept++] = pairs[k];
+		}
+		pairs.resize(kept);
+	}
+
+	hash_t m_hash;                    // top-level hash, onto the buckets
+	std::shared_ptr<const void> m_memory; // keeps the buckets and slots alive: a data_t or a mapped snapshot
+	const bucket_t* m_buckets;        // each bucket's hash and slots
+	const pair_t* m_slots;            // every bucket's slots, back to back, plus one
+	size_t m_num_buckets;
+	size_t m_num_slots;               // 0 if there are no pairs
+	size_t m_num_pairs;               // how many pairs are stored
+};
+
+template <class K, class V, class Hash> const uint32_t FrozenFastMap<K, V, Hash>::SNAPSHOT_VERSION;
+template <class K, class V, class Hash> const uint32_t FrozenFastMap<K, V, Hash>::SNAPSHOT_BYTE_ORDER;
+template <class K, class V, class Hash> const size_t FrozenFastMap<K, V, Hash>::SNAPSHOT_ALIGNMENT;
+
+#endif
@@ -0,0 +1,7 @@
+#include "growth_policy.h"
+
+size_t TunableGrowth::threshold_scale = DefaultGrowth::thresholdScale();
+size_t TunableGrowth::top_level_scale = DefaultGrowth::topLevelScale();
+size_t TunableGrowth::balance_linear = DefaultGrowth::balanceLinear();
+size_t TunableGrowth::balance_quadratic = DefaultGrowth::balanceQuadratic();
+size_t TunableGrowth::subtable_scale = DefaultGrowth::subtableScale();
@@ -0,0 +1,83 @@
+#ifndef GROWTH_POLICY_H
+#define GROWTH_POLICY_H
+
+#include <cmath>
+#include <cstddef>
+
+/* growth policies for FastMap: the constants relating the sizes of its tables
+ * to the number of pairs, which trade memory against rebuilds. with n pairs
+ * at the last rebuild,
+ *   thresholdScale() = c: the threshold is M = (1 + c) * n operations
+ *   topLevelScale() = s: the top-level table has s * M subtable buckets, s(M)
+ *   balanceLinear() = a, balanceQuadratic() = b: the subtables may have at
+ *       most a * M + b * M^2 / s(M) slots in total before the table counts
+ *       as unbalanced and is rebuilt
+ *   subtableScale() = f: a subtable with capacity m has f * m * (m - 1) slots
+ *       (small ones, of capacity at most 8, have m, see FastLookupMap::isSmall)
+ *
+ * a rebuild searches for a top-level hash meeting the balance bound, and
+ * never finishes if the bound is too tight for the other constants (see
+ * is_growth_feasible)
+ */
+
+// the constants FastMap has always used
+struct DefaultGrowth
+{
+	static constexpr size_t thresholdScale() { return 2; }
+	/* XXX in the paper they choose this to be 8 * sqrt(30) / 15 = 2.921,
+	 * in order to prove the linear space requirement of the map
+	 */
+	static constexpr size_t topLevelScale() { return 3; }
+	static constexpr size_t balanceLinear() { return 4; }
+	static constexpr size_t balanceQuadratic() { return 32; }
+	static constexpr size_t subtableScale() { return 2; }
+};
+
+/* constants set at run time, so that many settings can be tried without
+ * compiling a map for each (see the tuning sweep in main). they are shared by
+ * every map using this policy and start out as DefaultGrowth's. change them
+ * only while no such map exists
+ */
+struct TunableGrowth
+{
+	static size_t threshold_scale;
+	static size_t top_level_scale;
+	static size_t balance_linear;
+	static size_t balance_quadratic;
+	static size_t subtable_scale;
+
+	static size_t thresholdScale() { return threshold_scale; }
+	static size_t topLevelScale() { return top_level_scale; }
+	static size_t balanceLinear() { return balance_linear; }
+	static size_t balanceQuadratic() { return balance_quadratic; }
+	static size_t subtableScale() { return subtable_scale; }
+};
+
+/* do the constants of Growth leave the top-level hash search a reasonable
+ * chance? with n pairs hashed into s(M) subtable buckets, and a subtable of
+ * k pairs given capacity 2k (at least 2), the expected total of the
+ * subtables' slots must stay below 90% of the balance bound. empty subtables
+ * count too, with 2f slots each. small subtables take less than that, so
+ * this errs on the safe side
+ */
+template <class Growth>
+bool is_growth_feasible()
+{
+	if (Growth::topLevelScale() == 0 || Growth::subtableScale() == 0) return false;
+
+	// per pair at the last rebuild
+	auto threshold = double(1 + Growth::thresholdScale());
+	auto st_buckets = double(Growth::topLevelScale()) * threshold;
+	auto f = double(Growth::subtableScale());
+
+	// about e^(-n / s(M)) of the subtables are empty
+	auto load = 1 / st_buckets;
+	auto empty = st_buckets * std::exp(-load) * 2 * f;
+	// sum of f * 2k * (2k - 1) over the rest, from the expected sum of k^2 being n + n^2 / s(M)
+	auto used = f * (4 * (1 + load) - 2);
+	auto bound = double(Growth::balanceLinear()) * threshold + double(Growth::balanceQuadratic()) * threshold / double(Growth::topLevelScale());
+
+	return empty + used < 0.9 * bound;
+}
+
+#endif
@@ -0,0 +1,399 @@
+#ifndef HASH_SEARCH_H
+#define HASH_SEARCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "thread_pool.h"
+#include "universal_hash.h"
+
+/* random search for the hash functions used by rebuilds. each pass over the
+ * keys tests a batch of candidate hashes at once and drops a candidate as soon
+ * as it fails, so a failed attempt rarely costs a full pass on its own.
+ * scratch buffers are kept between searches; use one searcher per thread
+ * (see local()). the batch size and counters are shared by all threads
+ */
+template <class Hash>
+class HashSearch
+{
+	static const size_t WORD_BITS = 64;
+	static const size_t HASH_CHUNK = 64; // keys hashed at once (see hash_many)
+
+public:
+	static const size_t DEFAULT_BATCH_SIZE = 4;
+	// balanced searches keep a distribution as large as the top-level table
+	// per candidate, so they test fewer at once
+	static const size_t MAX_BALANCED_BATCH_SIZE = 2;
+	/* failed attempts after which a collision-free search checks that the
+	 * keys' inputs are distinct. every caller gives the keys enough buckets
+	 * that a candidate succeeds at least half the time, so runs this long
+	 * practically only happen with equal inputs
+	 */
+	static const size_t DUPLICATE_CHECK_ATTEMPTS = 64;
+
+	// running totals for one kind of search, over all threads
+	struct Counters
+	{
+		size_t searches {0}; // number of searches
+		size_t attempts {0}; // number of candidate hashes tried (including losers of the final batch)
+	};
+
+	// the searcher for the calling thread
+	static HashSearch& local()
+	{
+		static thread_local HashSearch search;
+		return search;
+	}
+
+	// number of candidates tested per pass
+	static size_t batchSize()
+	{
+		return shared().batch_size;
+	}
+
+	static void setBatchSize(size_t batch_size)
+	{
+		shared().batch_size = std::max<size_t>(1, batch_size);
+	}
+
+	static Counters collisionFreeCounters()
+	{
+		return shared().collision_free.get();
+	}
+
+	static Counters balancedCounters()
+	{
+		return shared().balanced.get();
+	}
+
+	// number of candidate hashes tried by this searcher's most recent search
+	size_t lastAttempts() const
+	{
+		return m_last_attempts;
+	}
+
+	// load the keys for the next search. input maps each item to the key's hash input
+	template <class It, class Input>
+	void loadKeys(It first, It last, Input input)
+	{
+		m_keys.clear();
+		for (; first != last; ++first) m_keys.push_back(input(*first));
+	}
+
+	// does hash map the loaded keys onto distinct buckets?
+	bool isCollisionFree(const Hash& hash)
+	{
+		auto& bitmap = m_check_bitmap;
+		auto num_words = (hash.range() + WORD_BITS - 1) / WORD_BITS;
+		if (bitmap.size() < num_words) bitmap.resize(num_words, 0);
+
+		bool collision_free = true;
+		size_t hashed[HASH_CHUNK];
+		for (size_t first = 0; first < m_keys.size() && collision_free; first += HASH_CHUNK)
+		{
+			auto n = std::min(HASH_CHUNK, m_keys.size() - first);
+			hash_many(hash, &m_keys[first], n, hashed);
+
+			for (size_t k = 0; k < n; ++k)
+			{
+				auto i = hashed[k];
+				auto& word = bitmap[i / WORD_BITS];
+				auto bit = uint64_t(1) << (i % WORD_BITS);
+
+				if (word & bit)
+				{
+					collision_free = false;
+					break;
+				}
+
+				word |= bit;
+				m_check_touched.push_back(i / WORD_BITS);
+			}
+		}
+
+		for (auto w : m_check_touched) bitmap[w] = 0;
+		m_check_touched.clear();
+
+		return collision_free;
+	}
+
+	/* find a hash onto num_buckets with no collisions among the loaded keys
+	 * and store it in hash. returns false, leaving hash alone, if two of the
+	 * keys have equal hash inputs, as no hash can separate those
+	 */
+	bool findCollisionFree(size_t num_buckets, Hash& hash)
+	{
+		// a family that can't hash onto num_buckets throws std::out_of_range on
+		// seeding. try that before the bitmaps grow for it
+		Hash(num_buckets).range();
+
+		auto& keys = m_keys;
+		shared().collision_free.add(1, 0);
+		m_last_attempts = 0;
+		auto batch = batchSize();
+		prepare(batch, m_bitmaps);
+		m_touched.resize(batch);
+
+		auto num_words = (num_buckets + WORD_BITS - 1) / WORD_BITS;
+		for (auto& bitmap : m_bitmaps)
+		{
+			// bitmaps are always left zeroed, so only new words need clearing
+			if (bitmap.size() < num_words) bitmap.resize(num_words, 0);
+		}
+
+		while (true)
+		{
+			size_t live = batch;
+			for (size_t c = 0; c < batch; ++c)
+			{
+				m_hashes[c].seed(num_buckets);
+				m_dead[c] = false;
+			}
+			shared().collision_free.add(0, batch);
+			m_last_attempts += batch;
+
+			// mark each key's bucket for every surviving candidate, a chunk of keys at a time
+			size_t hashed[HASH_CHUNK];
+			for (size_t first = 0; first < keys.size() && live; first += HASH_CHUNK)
+			{
+				auto n = std::min(HASH_CHUNK, keys.size() - first);
+				for (size_t c = 0; c < batch; ++c)
+				{
+					if (m_dead[c]) continue;
+					hash_many(m_hashes[c], &keys[first], n, hashed);
+
+					for (size_t k = 0; k < n; ++k)
+					{
+						auto i = hashed[k];
+						auto& word = m_bitmaps[c][i / WORD_BITS];
+						auto bit = uint64_t(1) << (i % WORD_BITS);
+
+						if (word & bit)
+						{
+							m_dead[c] = true;
+							--live;
+							break;
+						}
+
+						word |= bit;
+						m_touched[c].push_back(i / WORD_BITS);
+					}
+				}
+			}
+
+			// leave the bitmaps zeroed for the next attempt
+			for (size_t c = 0; c < batch; ++c)
+			{
+				for (auto w : m_touched[c]) m_bitmaps[c][w] = 0;
+				m_touched[c].clear();
+			}
+
+			for (size_t c = 0; c < batch; ++c)
+			{
+				if (m_dead[c]) continue;
+
+				hash = m_hashes[c];
+				return true;
+			}
+
+			// keys with equal hash inputs collide under every hash, so once
+			// the search runs long, make sure it can succeed at all
+			if (m_last_attempts % DUPLICATE_CHECK_ATTEMPTS < batch && hasDuplicateKeys()) return false;
+		}
+	}
+
+	/* find a hash onto num_buckets distributing the loaded keys such that
+	 * sum over buckets of cost(bucket size) <= max_cost,
+	 * where cost is nondecreasing. stores the winner's bucket sizes in distribution
+	 */
+	template <class Cost>
+	Hash findBalanced(size_t num_buckets, Cost cost, size_t max_cost, std::vector<uint32_t>& distribution)
+	{
+		auto& keys = m_keys;
+		shared().balanced.add(1, 0);
+		m_last_attempts = 0;
+		auto batch = std::min(batchSize(), MAX_BALANCED_BATCH_SIZE);
+		prepare(batch, m_distributions);
+
+		while (true)
+		{
+			size_t live = batch;
+			for (size_t c = 0; c < batch; ++c)
+			{
+				m_hashes[c].seed(num_buckets);
+				m_distributions[c].assign(num_buckets, 0);
+				m_costs[c] = num_buckets * cost(0);
+				m_dead[c] = m_costs[c] > max_cost;
+				if (m_dead[c]) --live;
+			}
+			shared().balanced.add(0, batch);
+			m_last_attempts += batch;
+
+			// the total cost only grows, so drop candidates as soon as they exceed the max
+			size_t hashed[HASH_CHUNK];
+			for (size_t first = 0; first < keys.size() && live; first += HASH_CHUNK)
+			{
+				auto n = std::min(HASH_CHUNK, keys.size() - first);
+				for (size_t c = 0; c < batch; ++c)
+				{
+					if (m_dead[c]) continue;
+					hash_many(m_hashes[c], &keys[first], n, hashed);
+
+					for (size_t k = 0; k < n; ++k)
+					{
+						auto size = m_distributions[c][hashed[k]]++;
+						m_costs[c] += cost(size + 1) - cost(size);
+
+						if (m_costs[c] > max_cost)
+						{
+							m_dead[c] = true;
+							--live;
+							break;
+						}
+					}
+				}
+			}
+
+			for (size_t c = 0; c < batch; ++c)
+			{
+				if (m_dead[c]) continue;
+
+				distribution.swap(m_distributions[c]);
+				return m_hashes[c];
+			}
+		}
+	}
+
+	/* same as findBalanced, but each candidate's distribution is counted
+	 * across pool. candidates are tried one at a time and without early
+	 * rejection, since every pass is already spread over the whole pool
+	 */
+	template <class Cost>
+	Hash findBalanced(size_t num_buckets, Cost cost, size_t max_cost, std::vector<uint32_t>& distribution, ThreadPool& pool)
+	{
+		auto& keys = m_keys;
+		shared().balanced.add(1, 0);
+		m_last_attempts = 0;
+		distribution.resize(num_buckets);
+
+		// the counts are left zeroed after every pass
+		if (m_num_counts < num_buckets)
+		{
+			m_counts.reset(new std::atomic<uint32_t>[num_buckets]());
+			m_num_counts = num_buckets;
+		}
+		auto counts = m_counts.get();
+
+		Hash hash;
+		while (true)
+		{
+			hash.seed(num_buckets);
+			shared().balanced.add(0, 1);
+			++m_last_attempts;
+
+			pool.forRange(keys.size(), [&](size_t begin, size_t end)
+			{
+				size_t hashed[HASH_CHUNK];
+				for (size_t first = begin; first < end; first += HASH_CHUNK)
+				{
+					auto n = std::min(HASH_CHUNK, end - first);
+					hash_many(hash, &keys[first], n, hashed);
+					for (size_t k = 0; k < n; ++k) counts[hashed[k]].fetch_add(1, std::memory_order_relaxed);
+				}
+			});
+
+			// collect the counts (zeroing them) and total their cost
+			std::atomic<size_t> total_cost {0};
+			pool.forRange(num_buckets, [&](size_t begin, size_t end)
+			{
+				size_t chunk_cost = 0;
+				for (size_t i = begin; i < end; ++i)
+				{
+					distribution[i] = counts[i].exchange(0, std::memory_order_relaxed);
+					chunk_cost += cost(distribution[i]);
+				}
+				total_cost += chunk_cost;
+			});
+
+			if (total_cost <= max_cost) return hash;
+		}
+	}
+
+private:
+	// Counters as updated by concurrent searches
+	struct AtomicCounters
+	{
+		std::atomic<size_t> searches {0};
+		std::atomic<size_t> attempts {0};
+
+		void add(size_t num_searches, size_t num_attempts)
+		{
+			searches.fetch_add(num_searches, std::memory_order_relaxed);
+			attempts.fetch_add(num_attempts, std::memory_order_relaxed);
+		}
+
+		Counters get() const
+		{
+			Counters counters;
+			counters.searches = searches;
+			counters.attempts = attempts;
+			return counters;
+		}
+	};
+
+	// settings and counters shared by every thread's searcher
+	struct Shared
+	{
+		std::atomic<size_t> batch_size {DEFAULT_BATCH_SIZE};
+		AtomicCounters collision_free;
+		AtomicCounters balanced;
+	};
+
+	static Shared& shared()
+	{
+		static Shared shared;
+		return shared;
+	}
+
+	// are any two of the loaded keys equal?
+	bool hasDuplicateKeys() const
+	{
+		auto keys = m_keys;
+		std::sort(keys.begin(), keys.end());
+		return std::adjacent_find(keys.begin(), keys.end()) != keys.end();
+	}
+
+	// size per-candidate buffers for a batch
+	template <class Buffer>
+	void prepare(size_t batch, std::vector<Buffer>& buffers)
+	{
+		m_hashes.resize(batch);
+		buffers.resize(batch);
+		m_dead.resize(batch);
+		m_costs.resize(batch);
+	}
+
+	std::vector<uint64_t> m_keys; // hash inputs of the keys being searched for
+	std::vector<Hash> m_hashes; // current candidates
+	std::vector<char> m_dead; // whether each candidate has been rejected
+	std::vector<size_t> m_costs; // running cost of each candidate (balanced search)
+	std::vector<std::vector<uint64_t>> m_bitmaps; // occupied buckets per candidate (collision-free search)
+	std::vector<std::vector<size_t>> m_touched; // nonzero words of each bitmap
+	std::vector<uint64_t> m_check_bitmap; // occupied buckets of the hash being checked (isCollisionFree)
+	std::vector<size_t> m_check_touched;
+	std::vector<std::vector<uint32_t>> m_distributions; // bucket sizes per candidate (balanced search)
+	std::unique_ptr<std::atomic<uint32_t>[]> m_counts; // shared bucket sizes (parallel balanced search)
+	size_t m_num_counts {0};
+	size_t m_last_attempts {0}; // candidates tried by the most recent search
+};
+
+template <class Hash> const size_t HashSearch<Hash>::HASH_CHUNK;
+template <class Hash> const size_t HashSearch<Hash>::DEFAULT_BATCH_SIZE;
+template <class Hash> const size_t HashSearch<Hash>::MAX_BALANCED_BATCH_SIZE;
+template <class Hash> const size_t HashSearch<Hash>::DUPLICATE_CHECK_ATTEMPTS;
+
+#endif
@@ -1,25 +1,525 @@
+#include <algorithm>
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
 #include <boost/program_options.hpp>
 
 #include "speed_test.h"
+#include "concurrent_fast_map.h"
+#include "epoch_fast_map.h"
 #include "fast_map.h"
+#include "node_pool.h"
+#include "sharded_fast_map.h"
 
-// TODO: Figure out constants c and s(M),M relationship
-//       When # partitions decreases, is it better to reduce memory allocation or to track separate partition count
+// TODO: When # partitions decreases, is it better to reduce memory allocation or to track separate partition count
 namespace po = boost::program_options;
 
+// the speed test's operations, loaded or generated as the options say (and recorded if asked)
+Trace make_trace(const po::variables_map& options)
+{
+	Trace trace;
+	if (options.count("trace"))
+	{
+		trace = Trace::load(options["trace"].as<std::string>());
+	}
+	else
+	{
+		WorkloadConfig workload;
+		workload.distribution = options["workload"].as<std::string>();
+		workload.key_max = options["key-max"].as<int>();
+		workload.reads = options["read"].as<int>();
+		workload.writes = options["write"].as<int>();
+		workload.erases = options["erase"].as<int>();
+		workload.prepop = options["pop"].as<int>();
+		workload.num_ops = options["iters"].as<int>();
+		workload.zipf_theta = options["zipf-theta"].as<double>();
+		workload.seed = options["seed"].as<uint64_t>();
+		trace = generate_trace(workload);
+	}
+	if (options.count("record-trace")) trace.save(options["record-trace"].as<std::string>());
+	return trace;
+}
+
+// add the options the speed test ran with to report
+void add_config(Report& report, const po::variables_map& options, const Trace& trace)
+{
+	for (const char* name : {"map", "storage", "alloc", "hash"}) report.add(name, options[name].as<std::string>());
+	if (options.count("trace"))
+	{
+		report.add("trace", options["trace"].as<std::string>());
+	}
+	else
+	{
+		report.add("workload", options["workload"].as<std::string>());
+		for (const char* name : {"key-max", "read", "write", "erase", "pop"}) report.add(name, options[name].as<int>());
+		report.add("zipf-theta", options["zipf-theta"].as<double>());
+		report.add("seed", double(options["seed"].as<uint64_t>()));
+	}
+	report.add("ops", double(trace.ops.size()));
+	for (const char* name : {"threads", "batch", "warmup", "trials"}) report.add(name, options[name].as<int>());
+}
+
+// add the map's stats from the timed run of the speed test to report
+void add_stats(Report& report, const SpeedResult& timed)
+{
+	if (!timed.has_stats) throw std::invalid_argument("--stats needs the fast or concurrent map");
+
+	auto& stats = timed.stats;
+	report.add("stats_counting", stats.counting ? "yes" : "no (build with FAST_MAP_STATS)");
+	report.add("global_rebuilds", double(stats.global_rebuilds));
+	report.add("global_rebuild_seconds", stats.global_rebuild_seconds);
+	report.add("migrations", double(stats.migrations));
+	report.add("subtable_rebuilds", double(stats.subtable_rebuilds));
+	report.add("balanced_searches", double(stats.balanced_searches));
+	report.add("balanced_attempts", double(stats.balanced_attempts));
+	report.add("collision_free_searches", double(stats.collision_free_searches));
+	report.add("collision_free_attempts", double(stats.collision_free_attempts));
+	report.add("num_pairs", double(stats.num_pairs));
+	report.add("threshold", double(stats.threshold));
+	report.add("num_operations", double(stats.num_operations));
+	report.add("num_subtables", double(stats.num_subtables));
+	report.add("bucket_count", double(stats.bucket_count));
+	report.add("slot_bytes", double(stats.slot_bytes));
+	for (size_t k = 0; k < stats.occupancy.size(); ++k) report.add("occupancy_" + std::to_string(k), double(stats.occupancy[k]));
+}
+
+// call f with the storage policy selected by name
+template <class F>
+void with_storage(const std::string& name, F f)
+{
+	if (name == "node")
+		f(NodeStorage());
+	else if (name == "inline")
+		f(InlineStorage());
+	else
+		throw po::invalid_option_value(name);
+}
+
+// call f with an allocator for pairs of type P selected by name
+template <class P, class F>
+void with_allocator(const std::string& name, F f)
+{
+	if (name == "std")
+		f(std::allocator<P>());
+	else if (name == "pool")
+		f(PoolAllocator<P>());
+	else
+		throw po::invalid_option_value(name);
+}
+
+// call f with a hash family selected by name
+template <class F>
+void with_hash(const std::string& name, F f)
+{
+	if (name == "mersenne")
+		f(MersenneHash());
+	else if (name == "mod-prime")
+		f(ModPrimeHash());
+	else if (name == "mersenne61")
+		f(Mersenne61Hash());
+	else if (name == "multiply-shift")
+		f(MultiplyShiftHash());
+	else if (name == "tabulation")
+		f(TabulationHash());
+	else
+		throw po::invalid_option_value(name);
+}
+
+// turn on incremental rebuilds where the map supports them
+template <class K, class V, class... Policies>
+void set_incremental(FastMap<K, V, Policies...>& map, bool incremental)
+{
+	map.setIncrementalRebuild(incremental);
+}
+
+template <class T>
+void set_incremental(T&, bool incremental)
+{
+	if (incremental) throw po::error("--incremental requires --map fast");
+}
+
+// throw if map type T isn't synchronized and num_threads threads would share it
+template <class K, class V, class... Policies>
+void check_threads(FastMap<K, V, Policies...>*, int num_threads)
+{
+	if (num_threads > 1) throw po::error("--map fast is single-threaded, use --threads 1");
+}
+
+template <class K, class V>
+void check_threads(UnorderedMapAdapter<K, V>*, int num_threads)
+{
+	if (num_threads > 1) throw po::error("--map unordered is single-threaded, use --threads 1");
+}
+
+template <class T>
+void check_threads(T*, int)
+{
+}
+
+// run the freeze test where the map supports it
+template <class K, class V, class... Policies>
+FreezeResult run_freeze_test(FastMap<K, V, Policies...>*, int num_pairs)
+{
+	return freeze_test<FastMap<K, V, Policies...>>(num_pairs);
+}
+
+template <class T>
+FreezeResult run_freeze_test(T*, int)
+{
+	throw po::error("--freeze-test requires --map fast");
+}
+
+// run the shrink test where the map supports it
+template <class K, class V, class... Policies>
+ShrinkResult run_shrink_test(FastMap<K, V, Policies...>*, int num_pairs)
+{
+	return shrink_test<FastMap<K, V, Policies...>>(num_pairs);
+}
+
+template <class T>
+ShrinkResult run_shrink_test(T*, int)
+{
+	throw po::error("--shrink-test requires --map fast");
+}
+
+// run the scan test where the map supports it
+template <class T>
+auto run_scan_test(T*, int num_pairs, ThreadPool& pool, int = 0) -> decltype(std::declval<const T&>().forEach(std::declval<void (*)(const std::pair<const int, int>&)>()), ScanResult())
+{
+	return scan_test<T>(num_pairs, pool);
+}
+
+template <class T>
+ScanResult run_scan_test(T*, int, ThreadPool&, long = 0)
+{
+	throw po::error("--scan-test requires --map fast, concurrent or epoch");
+}
+
+// run the snapshot test where the map supports it
+template <class K, class V, class Storage, class Alloc, class Hash, class Growth, class = typename std::enable_if<FrozenFastMap<K, V, Hash>::canSnapshot()>::type>
+SnapshotResult run_snapshot_test(FastMap<K, V, Storage, Alloc, Hash, Growth>*, int num_pairs, const std::string& path)
+{
+	return snapshot_test<FastMap<K, V, Storage, Alloc, Hash, Growth>>(num_pairs, path);
+}
+
+template <class T>
+SnapshotResult run_snapshot_test(T*, int, const std::string&)
+{
+	throw po::error("--snapshot-test requires --map fast and keys, values and a hash that can be saved");
+}
+
+// run the speed test (or rebuild or latency test) on map type T hashing with Hash, using the parsed options
+template <class T, class Hash>
+void run_speed_test(const po::variables_map& options)
+{
+	HashSearch<Hash>::setBatchSize(options["search-batch"].as<int>());
+
+	std::unique_ptr<ThreadPool> pool;
+	auto rebuild_threads = options["rebuild-threads"].as<int>();
+	if (rebuild_threads > 1) pool.reset(new ThreadPool(size_t(rebuild_threads)));
+
+	if (options.count("bulk-test"))
+	{
+		auto result = bulk_test<T>(options["bulk-test"].as<int>(), pool.get());
+		std::cout
+			<< "seconds to insert one at a time: " << result.insert_seconds << std::endl
+			<< "seconds to assign in bulk: " << result.assign_seconds << std::endl;
+		return;
+	}
+
+	if (options.count("freeze-test"))
+	{
+		auto result = run_freeze_test(static_cast<T*>(nullptr), options["freeze-test"].as<int>());
+		std::cout
+			<< "seconds to freeze: " << result.freeze_seconds << std::endl
+			<< "ns per lookup in map: " << result.map_lookup_ns << std::endl
+			<< "ns per lookup in frozen map: " << result.frozen_lookup_ns << std::endl
+			<< "frozen map bytes per pair: " << result.frozen_bytes_per_pair << std::endl;
+		return;
+	}
+
+	if (options.count("shrink-test"))
+	{
+		auto result = run_shrink_test(static_cast<T*>(nullptr), options["shrink-test"].as<int>());
+		std::cout
+			<< "top-level buckets when full: " << result.full_subtables << std::endl
+			<< "top-level buckets when emptied: " << result.emptied_subtables << std::endl
+			<< "ns per insert or erase in emptied map: " << result.churn_ns << std::endl
+			<< "ns per insert or erase in hinted map: " << result.hinted_churn_ns << std::endl;
+		return;
+	}
+
+	if (options.count("scan-test"))
+	{
+		ThreadPool scan_pool(size_t(std::max(1, options["threads"].as<int>())));
+		auto result = run_scan_test(static_cast<T*>(nullptr), options["scan-test"].as<int>(), scan_pool, 0);
+		std::cout
+			<< "ns per pair scanning with forEach: " << result.scan_ns << std::endl
+			<< "ns per pair scanning with parallelForEach on " << scan_pool.size() << " threads: " << result.parallel_scan_ns << std::endl;
+		return;
+	}
+
+	if (options.count("snapshot-test"))
+	{
+		auto result = run_snapshot_test(static_cast<T*>(nullptr), options["snapshot-test"].as<int>(), options["snapshot-path"].as<std::string>());
+		std::cout
+			<< "seconds to build from pairs: " << result.assign_seconds << std::endl
+			<< "seconds to save snapshot: " << result.save_seconds << std::endl
+			<< "seconds to open snapshot: " << result.open_seconds << std::endl
+			<< "ns per lookup after opening: " << result.lookup_ns << std::endl;
+		return;
+	}
+
+	if (options.count("rebuild-test"))
+	{
+		auto result = rebuild_test<T, Hash>(options["pop"].as<int>(), options["rebuild-test"].as<int>(), pool.get());
+		std::cout
+			<< "seconds per rebuild: " << result.seconds << std::endl
+			<< "top-level hash attempts per rebuild: " << result.balanced_attempts << std::endl
+			<< "subtable searches per rebuild: " << result.subtable_searches << std::endl
+			<< "hash attempts per subtable search: " << result.subtable_attempts << std::endl;
+		return;
+	}
+
+	if (options.count("latency"))
+	{
+		auto incremental = options.count("incremental") > 0;
+		auto result = latency_test<T>(
+			options["key-max"].as<int>(),
+			options["iters"].as<int>(),
+			options["read"].as<int>(),
+			options["write"].as<int>(),
+			options["erase"].as<int>(),
+			options["pop"].as<int>(),
+			[&](T& map) { set_incremental(map, incremental); }
+		);
+		std::cout
+			<< "mean ns per operation: " << result.mean << std::endl
+			<< "99.9th percentile ns: " << result.p999 << std::endl
+			<< "max ns: " << result.max << std::endl;
+		return;
+	}
+
+	check_threads(static_cast<T*>(nullptr), options["threads"].as<int>());
+
+	if (options.count("read-latency"))
+	{
+		auto result = read_latency_test<T>(
+			options["key-max"].as<int>(),
+			options["threads"].as<int>(),
+			options["iters"].as<int>(),
+			options["pop"].as<int>()
+		);
+		std::cout
+			<< "mean ns per read: " << result.mean << std::endl
+			<< "99.9th percentile ns: " << result.p999 << std::endl
+			<< "max ns: " << result.max << std::endl;
+		return;
+	}
+
+	auto trace = make_trace(options);
+	auto result = benchmark_test<T>(
+		trace,
+		options["threads"].as<int>(),
+		options["batch"].as<int>(),
+		options["warmup"].as<int>(),
+		options["trials"].as<int>()
+	);
+
+	Report report;
+	add_config(report, options, trace);
+	report.addSummary("ops_per_sec", result.ops_per_second);
+	report.addHistogram("read", result.timed.reads);
+	report.addHistogram("insert", result.timed.inserts);
+	report.addHistogram("erase", result.timed.erases);
+	if (options.count("stats")) add_stats(report, result.timed);
+	report.print(std::cout, options["format"].as<std::string>());
+}
+
+/* run the speed test on ShardedFastMap T, the clients being the threads
+ * threads and each batch taking shard-batch operations
+ */
+template <class T>
+void run_sharded_speed_test(const po::variables_map& options)
+{
+	auto num_shards = size_t(std::max(0, options["shards"].as<int>()));
+	if (!num_shards) num_shards = std::max(1u, std::thread::hardware_concurrency());
+
+	auto trace = make_trace(options);
+	auto ops_per_second = sharded_benchmark_test<T>(
+		trace,
+		options["threads"].as<int>(),
+		num_shards,
+		options["shard-batch"].as<int>(),
+		options["warmup"].as<int>(),
+		options["trials"].as<int>()
+	);
+
+	Report report;
+	add_config(report, options, trace);
+	report.add("shards", double(num_shards));
+	report.add("shard_batch", options["shard-batch"].as<int>());
+	report.addSummary("ops_per_sec", ops_per_second);
+	report.print(std::cout, options["format"].as<std::string>());
+}
+
+// parse a comma-separated list of sizes, such as "1,2,4"
+std::vector<size_t> parse_sizes(const std::string& list)
+{
+	std::vector<size_t> sizes;
+	std::istringstream in(list);
+	std::string item;
+	while (std::getline(in, item, ','))
+	{
+		size_t end = 0;
+		auto size = std::stoul(item, &end);
+		if (end != item.size() || item[0] == '-') throw po::invalid_option_value(list);
+		sizes.push_back(size);
+	}
+	if (sizes.empty()) throw po::invalid_option_value(list);
+	return sizes;
+}
+
+/* run the speed test on map type T (which must use TunableGrowth and have
+ * stats) for every combination of the growth constants listed in the
+ * options, and report throughput, rebuilds and memory for each. settings
+ * whose top-level hash search could hardly succeed are skipped (see
+ * is_growth_feasible). a setting is Pareto-optimal if no other one is at
+ * least as good on all three and better on one
+ */
+template <class T, class Hash>
+void run_tuning_sweep(const po::variables_map& options)
+{
+	typedef HashSearch<Hash> search_t;
+	HashSearch<Hash>::setBatchSize(options["search-batch"].as<int>());
+	check_threads(static_cast<T*>(nullptr), options["threads"].as<int>());
+
+	auto trace = make_trace(options);
+	auto runs = double(options["warmup"].as<int>() + options["trials"].as<int>() + 1);
+
+	struct setting_t
+	{
+		Report report;
+		bool feasible;
+		double ops_per_second;
+		double rebuilds;
+		double memory;
+	};
+	std::vector<setting_t> settings;
+
+	for (auto c : parse_sizes(options["tune-threshold-scale"].as<std::string>()))
+	for (auto s : parse_sizes(options["tune-top-level-scale"].as<std::string>()))
+	for (auto a : parse_sizes(options["tune-balance-linear"].as<std::string>()))
+	for (auto b : parse_sizes(options["tune-balance-quadratic"].as<std::string>()))
+	for (auto f : parse_sizes(options["tune-subtable-scale"].as<std::string>()))
+	{
+		TunableGrowth::threshold_scale = c;
+		TunableGrowth::top_level_scale = s;
+		TunableGrowth::balance_linear = a;
+		TunableGrowth::balance_quadratic = b;
+		TunableGrowth::subtable_scale = f;
+
+		setting_t setting {Report(), is_growth_feasible<TunableGrowth>(), 0, 0, 0};
+		auto& report = setting.report;
+		add_config(report, options, trace);
+		report.add("threshold_scale", double(c));
+		report.add("top_level_scale", double(s));
+		report.add("balance_linear", double(a));
+		report.add("balance_quadratic", double(b));
+		report.add("subtable_scale", double(f));
+		report.add("feasible", setting.feasible ? "yes" : "no");
+
+		// global rebuilds are counted by their top-level hash searches, subtable rebuilds by theirs
+		BenchmarkResult result;
+		auto balanced = search_t::balancedCounters();
+		auto collision_free = search_t::collisionFreeCounters();
+		if (setting.feasible)
+		{
+			result = benchmark_test<T>(trace, options["threads"].as<int>(), options["batch"].as<int>(),
+				options["warmup"].as<int>(), options["trials"].as<int>());
+			if (!result.timed.has_stats) throw po::error("--tune requires --map fast or concurrent");
+		}
+
+		auto& stats = result.timed.stats;
+		setting.ops_per_second = summarize(result.ops_per_second).mean;
+		setting.rebuilds = double(search_t::balancedCounters().searches - balanced.searches) / runs;
+		setting.memory = setting.feasible ? double(stats.slot_bytes + stats.num_subtables * sizeof(void*)) : 0;
+		report.addSummary("ops_per_sec", result.ops_per_second);
+		report.add("rebuilds_per_run", setting.rebuilds);
+		report.add("subtable_rebuilds_per_run", double(search_t::collisionFreeCounters().searches - collision_free.searches) / runs);
+		report.add("memory_bytes", setting.memory);
+		report.add("bytes_per_pair", setting.feasible && stats.num_pairs ? setting.memory / double(stats.num_pairs) : 0);
+		settings.push_back(std::move(setting));
+	}
+
+	for (auto& setting : settings)
+	{
+		auto dominated = [&](const setting_t& other)
+		{
+			return other.feasible &&
+				other.ops_per_second >= setting.ops_per_second && other.rebuilds <= setting.rebuilds && other.memory <= setting.memory &&
+				(other.ops_per_second > setting.ops_per_second || other.rebuilds < setting.rebuilds || other.memory < setting.memory);
+		};
+		auto pareto = setting.feasible && std::none_of(settings.begin(), settings.end(), dominated);
+		setting.report.add("pareto", pareto ? "yes" : "no");
+	}
+
+	for (size_t i = 0; i < settings.size(); ++i) settings[i].report.print(std::cout, options["format"].as<std::string>(), i == 0);
+}
+
 int main(int argc, char** argv)
 {
 	po::options_description desc("Allowed options");
 	desc.add_options()
 		("help,h", "print this message and exit")
-		("key-max,k", po::value<int>()->required(), "upper bound of random keys")
-		("threads,t", po::value<int>()->required(), "number of threads")
-		("iters,i", po::value<int>()->required(), "number of iterations per-thread")
+		("key-max,k", po::value<int>()->default_value(100000), "upper bound of random keys")
+		("threads,t", po::value<int>()->default_value(1), "number of threads")
+		("iters,i", po::value<int>()->default_value(1000000), "total number of iterations (split between the threads)")
 		("read,r", po::value<int>()->default_value(1), "proportion of reads in speed test")
 		("write,w", po::value<int>()->default_value(1), "proportion of writes in speed test")
 		("erase,e", po::value<int>()->default_value(1), "proportion of erases in speed test")
 		("pop,p", po::value<int>()->default_value(0), "initial number of inserts before speed test")
+		("workload", po::value<std::string>()->default_value("uniform"), "how the speed test chooses keys: uniform, zipf (a few hot keys), sequential, latest (mostly recently inserted keys)")
+		("zipf-theta", po::value<double>()->default_value(0.99), "skew of the zipf and latest workloads, in (0, 1)")
+		("seed", po::value<uint64_t>()->default_value(1), "seed of the speed test workload")
+		("trace", po::value<std::string>(), "replay the operations in this trace file in the speed test instead of generating them")
+		("record-trace", po::value<std::string>(), "save the speed test's operations to this trace file")
+		("trials", po::value<int>()->default_value(5), "number of measured runs of the speed test")
+		("warmup", po::value<int>()->default_value(1), "number of unmeasured runs of the speed test before the trials")
+		("format", po::value<std::string>()->default_value("text"), "speed test report format: text, csv, json")
+		("stats", "add the map's shape and rebuild counters after the timed run to the speed test report (fast and concurrent maps; the counters need a build with -DFAST_MAP_STATS)")
+		("batch,b", po::value<int>()->default_value(1), "number of keys read together (with countMany) in speed test")
+		("map,m", po::value<std::string>()->default_value("concurrent"), "map to test: fast (single-threaded only), concurrent, epoch, sharded (speed test only), unordered (std::unordered_map, single-threaded only)")
+		("shards", po::value<int>()->default_value(0), "number of shards of the sharded map, each owned by a worker thread (0: one per hardware thread)")
+		("shard-batch", po::value<int>()->default_value(int(ShardedFastMap<int, int>::DEFAULT_BATCH_SIZE)), "operations each client of the sharded map sends a shard at once")
+		("storage,s", po::value<std::string>()->default_value("node"), "subtable storage: node (one allocation per pair), inline")
+		("alloc,a", po::value<std::string>()->default_value("std"), "pair allocator: std, pool")
+		("hash", po::value<std::string>()->default_value("mersenne"), "hash family: mersenne, mersenne61, mod-prime, multiply-shift, tabulation")
+		("search-batch", po::value<int>()->default_value(HashSearch<MersenneHash>::DEFAULT_BATCH_SIZE), "candidate hashes tested per pass during rebuilds")
+		("rebuild-test", po::value<int>(), "instead of the speed test, time this many full rebuilds of a map with pop pairs")
+		("rebuild-threads", po::value<int>()->default_value(1), "threads the rebuild and bulk tests spread each rebuild over")
+		("bulk-test", po::value<int>(), "instead of the speed test, compare filling a map with this many random pairs by inserts and by assign")
+		("freeze-test", po::value<int>(), "instead of the speed test, freeze a map with this many random pairs and compare lookups (fast map only)")
+		("shrink-test", po::value<int>(), "instead of the speed test, fill a map with this many keys, erase them all and check and time what is left, and the same with a map hinted for them (fast map only)")
+		("scan-test", po::value<int>(), "instead of the speed test, time scanning every pair of a map with this many random pairs, on one thread and on threads threads")
+		("string-test", po::value<int>(), "instead of the speed test, time inserts, lookups and rebuilds of this many random std::string keys in FastMap (with storage) and std::unordered_map")
+		("collision-test", po::value<int>(), "instead of the speed test, check and time FastMap (with storage) holding this many keys, the first 2 of every 64 sharing a hash input, and a subtable holding some")
+		("failure-test", po::value<int>(), "instead of the speed test, fill FastMap (with storage) with this many keys while every 13th allocation fails, on one thread and on threads threads, checking that it stays consistent and leaks nothing")
+		("stress-test", po::value<uint64_t>(), "instead of the speed test, insert this many distinct 64-bit keys into FastMap (with storage) one at a time, reporting rebuilds, memory and insert times at every power of two")
+		("snapshot-test", po::value<int>(), "instead of the speed test, save a map with this many random pairs and time opening it again (fast map only)")
+		("snapshot-path", po::value<std::string>()->default_value("fast_map_snapshot.bin"), "file the snapshot test writes (and removes)")
+		("latency", "instead of the speed test, time each operation on a single thread and report the tail")
+		("incremental", "rebuild incrementally in the latency test (fast map only)")
+		("lock-test", "instead of the speed test, time read : write critical sections of threads threads under each reader-writer lock")
+		("tune", "instead of the speed test, run it for every combination of the growth constants below (see growth_policy.h) and report throughput, rebuilds and memory of each (fast and concurrent maps)")
+		("tune-threshold-scale", po::value<std::string>()->default_value("1,2,4"), "comma-separated values of c, the threshold being (1 + c) * pairs, to tune over")
+		("tune-top-level-scale", po::value<std::string>()->default_value("1,2,3"), "values of the number of top-level buckets per unit of threshold to tune over")
+		("tune-balance-linear", po::value<std::string>()->default_value("4,8"), "values of a in the balance bound a * M + b * M^2 / s(M) to tune over")
+		("tune-balance-quadratic", po::value<std::string>()->default_value("16,32,64"), "values of b in the balance bound to tune over")
+		("tune-subtable-scale", po::value<std::string>()->default_value("1,2"), "values of f, subtables having f * m * (m - 1) slots for capacity m, to tune over")
+		("read-latency", "instead of the speed test, time each read of threads - 1 readers while another thread inserts and erases")
 	;
 
 	po::variables_map options;
@@ -36,21 +536,148 @@ int main(int argc, char** argv)
 
 		po::notify(options);
 
-		std::cout << speed_test<FastMap<int, int>>(
-			options["key-max"].as<int>(),
-			options["threads"].as<int>(),
-			options["iters"].as<int>(),
-			options["read"].as<int>(),
-			options["write"].as<int>(),
-			options["erase"].as<int>(),
-			options["pop"].as<int>()
-		) << std::endl;
+		if (options.count("lock-test"))
+		{
+			auto threads = options["threads"].as<int>();
+			auto iters = options["iters"].as<int>();
+			auto reads = options["read"].as<int>();
+			auto writes = options["write"].as<int>();
+			RWMutex rw_mutex;
+			RWMutex rw_mutex_readers(RWMutex::PREFER_READERS);
+			SpinRWMutex spin_mutex;
+			SharedTimedMutex shared_mutex;
+			std::cout
+				<< "RWMutex ns per lock: " << lock_test(rw_mutex, threads, iters, reads, writes) << std::endl
+				<< "RWMutex (prefer readers) ns per lock: " << lock_test(rw_mutex_readers, threads, iters, reads, writes) << std::endl
+				<< "SpinRWMutex ns per lock: " << lock_test(spin_mutex, threads, iters, reads, writes) << std::endl
+				<< "std::shared_timed_mutex ns per lock: " << lock_test(shared_mutex, threads, iters, reads, writes) << std::endl;
+			return EXIT_SUCCESS;
+		}
+
+		if (options.count("string-test"))
+		{
+			auto num_keys = options["string-test"].as<int>();
+			auto print = [](const std::string& name, const StringResult& result)
+			{
+				std::cout
+					<< name << " ns per insert: " << result.insert_ns << std::endl
+					<< name << " ns per lookup of a stored key: " << result.hit_ns << std::endl
+					<< name << " ns per lookup of a missing key: " << result.miss_ns << std::endl
+					<< name << " seconds per rebuild: " << result.rebuild_seconds << std::endl;
+			};
+
+			with_storage(options["storage"].as<std::string>(), [&](auto storage)
+			{
+				print("FastMap", string_test<FastMap<std::string, int, decltype(storage)>>(num_keys));
+			});
+			print("std::unordered_map", string_test<UnorderedMapAdapter<std::string, int>>(num_keys));
+			return EXIT_SUCCESS;
+		}
+
+		if (options.count("collision-test"))
+		{
+			auto num_keys = options["collision-test"].as<int>();
+			with_storage(options["storage"].as<std::string>(), [&](auto storage)
+			{
+				auto result = collision_test<FastMap<CollidingKey, int, decltype(storage)>, FastLookupMap<CollidingKey, int, decltype(storage)>>(num_keys);
+				std::cout
+					<< "ns per insert: " << result.insert_ns << std::endl
+					<< "ns per lookup of a stored key: " << result.hit_ns << std::endl
+					<< "ns per lookup of a stored key in the frozen map: " << result.frozen_hit_ns << std::endl;
+			});
+			return EXIT_SUCCESS;
+		}
+
+		if (options.count("failure-test"))
+		{
+			auto num_keys = options["failure-test"].as<int>();
+			ThreadPool pool(size_t(std::max(1, options["threads"].as<int>())));
+			with_storage(options["storage"].as<std::string>(), [&](auto storage)
+			{
+				typedef FailingAllocator<std::pair<const int, int>> alloc_t;
+				typedef FastMap<int, int, decltype(storage), alloc_t> map_t;
+				typedef FastLookupMap<int, int, decltype(storage), alloc_t, MultiplyShiftHash> subtable_t;
+				auto result = failure_test<map_t, subtable_t>(num_keys, pool);
+				std::cout
+					<< "failed allocations: " << result.failures << std::endl
+					<< "pairs kept after failed inserts: " << result.kept << std::endl;
+			});
+			return EXIT_SUCCESS;
+		}
+
+		if (options.count("stress-test"))
+		{
+			auto format = options["format"].as<std::string>();
+			bool first = true;
+			auto print = [&](const StressResult& result)
+			{
+				Report report;
+				report.add("pairs", double(result.num_pairs));
+				report.add("global_rebuilds", double(result.global_rebuilds));
+				report.add("attempts_per_rebuild", result.attempts_per_rebuild);
+				report.add("subtable_rebuilds", double(result.subtable_rebuilds));
+				report.add("top_level_buckets", double(result.top_level_buckets));
+				report.add("bytes_per_pair", result.bytes_per_pair);
+				report.add("insert_ns", result.insert_ns);
+				report.add("max_insert_ms", result.max_insert_ms);
+				report.print(std::cout, format, first);
+				first = false;
+			};
+
+			with_storage(options["storage"].as<std::string>(), [&](auto storage)
+			{
+				typedef FastMap<uint64_t, uint64_t, decltype(storage), std::allocator<std::pair<const uint64_t, uint64_t>>, Mersenne61Hash> map_t;
+				stress_test<map_t, Mersenne61Hash>(size_t(options["stress-test"].as<uint64_t>()), print);
+			});
+			return EXIT_SUCCESS;
+		}
+
+		auto map = options["map"].as<std::string>();
+		with_storage(options["storage"].as<std::string>(), [&](auto storage)
+		{
+			with_allocator<std::pair<const int, int>>(options["alloc"].as<std::string>(), [&](auto alloc)
+			{
+				with_hash(options["hash"].as<std::string>(), [&](auto hash)
+				{
+					typedef decltype(storage) storage_t;
+					typedef decltype(alloc) alloc_t;
+					typedef decltype(hash) hash_t;
+
+					if (options.count("tune"))
+					{
+						if (map == "fast")
+							run_tuning_sweep<FastMap<int, int, storage_t, alloc_t, hash_t, TunableGrowth>, hash_t>(options);
+						else if (map == "concurrent")
+							run_tuning_sweep<ConcurrentFastMap<int, int, storage_t, alloc_t, hash_t, TunableGrowth>, hash_t>(options);
+						else
+							throw po::error("--tune requires --map fast or concurrent");
+					}
+					else if (map == "fast")
+						run_speed_test<FastMap<int, int, storage_t, alloc_t, hash_t>, hash_t>(options);
+					else if (map == "concurrent")
+						run_speed_test<ConcurrentFastMap<int, int, storage_t, alloc_t, hash_t>, hash_t>(options);
+					else if (map == "epoch")
+						run_speed_test<EpochFastMap<int, int, storage_t, alloc_t, hash_t>, hash_t>(options);
+					else if (map == "sharded")
+						run_sharded_speed_test<ShardedFastMap<int, int, storage_t, alloc_t, hash_t>>(options);
+					else if (map == "unordered")
+						run_speed_test<UnorderedMapAdapter<int, int>, hash_t>(options);
+					else
+						throw po::invalid_option_value(map);
+				});
+			});
+		});
 	}
 	catch (const po::error& e)
 	{
 		std::cerr << e.what() << std::endl << desc << std::endl;
 		return EXIT_FAILURE;
 	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
 
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,122 @@
+#include <algorithm>
+
+#include "node_pool.h"
+
+const size_t NodePool::MIN_CHUNK_BLOCKS;
+const size_t NodePool::MAX_CHUNK_BLOCKS;
+const size_t NodePool::NUM_STRIPES;
+const size_t NodePool::BATCH_BLOCKS;
+
+NodePool::NodePool(size_t block_size)
+	: m_block_size {std::max(block_size, sizeof(FreeBlock))}
+{
+}
+
+NodePool::~NodePool()
+{
+	for (auto chunk : m_chunks) ::operator delete(chunk);
+}
+
+void NodePool::lock(std::atomic_flag& flag)
+{
+	while (flag.test_and_set(std::memory_order_acquire));
+}
+
+void NodePool::unlock(std::atomic_flag& flag)
+{
+	flag.clear(std::memory_order_release);
+}
+
+NodePool::Stripe& NodePool::stripe()
+{
+	// threads take stripes round-robin as they first use a pool
+	static std::atomic<size_t> next_stripe {0};
+	thread_local size_t index = next_stripe++ % NUM_STRIPES;
+	return m_stripes[index];
+}
+
+void NodePool::refill(Stripe& stripe)
+{
+	lock(m_lock);
+
+	// link the blocks in order, so that fresh ones are handed out by increasing address
+	auto link = &stripe.free;
+	for (size_t i = 0; i < BATCH_BLOCKS; ++i)
+	{
+		FreeBlock* block;
+		if (m_free)
+		{
+			// reuse blocks given back by stripes first
+			block = m_free;
+			m_free = m_free->next;
+		}
+		else
+		{
+			// carve a new chunk if the current one is used up
+			if (m_next == m_end)
+			{
+				m_chunks.push_back(static_cast<char*>(::operator new(m_chunk_blocks * m_block_size)));
+				m_next = m_chunks.back();
+				m_end = m_next + m_chunk_blocks * m_block_size;
+				m_chunk_blocks = std::min(2 * m_chunk_blocks, MAX_CHUNK_BLOCKS);
+			}
+
+			block = reinterpret_cast<FreeBlock*>(m_next);
+			m_next += m_block_size;
+		}
+
+		*link = block;
+		link = &block->next;
+	}
+	*link = nullptr;
+	stripe.num_free = BATCH_BLOCKS;
+
+	unlock(m_lock);
+}
+
+void NodePool::spill(Stripe& stripe)
+{
+	// split off the most recently freed blocks
+	auto first = stripe.free;
+	auto last = first;
+	for (size_t i = 1; i < BATCH_BLOCKS; ++i) last = last->next;
+	stripe.free = last->next;
+	stripe.num_free -= BATCH_BLOCKS;
+
+	lock(m_lock);
+	last->next = m_free;
+	m_free = first;
+	unlock(m_lock);
+}
+
+void* NodePool::allocate()
+{
+	auto& s = stripe();
+	lock(s.lock);
+
+	if (!s.free) refill(s);
+	auto block = s.free;
+	s.free = block->next;
+	--s.num_free;
+
+	unlock(s.lock);
+	return block;
+}
+
+void NodePool::deallocate(void* block)
+{
+	auto& s = stripe();
+	lock(s.lock);
+
+	auto free_block = static_cast<FreeBlock*>(block);
+	free_block->next = s.free;
+	s.free = free_block;
+	if (++s.num_free > 2 * BATCH_BLOCKS) spill(s);
+
+	unlock(s.lock);
+}
+
+NodePools::NodePools()
+{
+	for (size_t i = 0; i < NUM_CLASSES; ++i) m_pools[i].reset(new NodePool((i + 1) * GRANULARITY));
+}
@@ -0,0 +1,146 @@
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+/* arena of fixed-size blocks carved out of large contiguous chunks. freed
+ * blocks are reused before new ones are carved, so churn doesn't touch the
+ * system allocator. each thread allocates from and frees to a stripe of its
+ * own (shared only once there are more threads than stripes), and stripes
+ * trade blocks with the pool's chunks and shared free list BATCH_BLOCKS at a
+ * time, so threads rarely wait on each other. blocks are carved in address
+ * order, but freed ones are reused most recent first: after churn, pairs
+ * inserted together are no longer neighbours in memory
+ */
+class NodePool
+{
+	struct FreeBlock
+	{
+		FreeBlock* next;
+	};
+
+	// the free list of the threads mapped to it (see stripe), padded to a cache line
+	struct Stripe
+	{
+		std::atomic_flag lock = ATOMIC_FLAG_INIT;
+		FreeBlock* free {nullptr};
+		size_t num_free {0};
+		char padding[64 - 3 * sizeof(void*)];
+	};
+
+	static const size_t MIN_CHUNK_BLOCKS = 64;
+	static const size_t MAX_CHUNK_BLOCKS = 1 << 16;
+	static const size_t NUM_STRIPES = 16;
+	// blocks a stripe takes when it runs out, and gives back once it holds twice as many
+	static const size_t BATCH_BLOCKS = 32;
+
+	size_t m_block_size;
+	size_t m_chunk_blocks {MIN_CHUNK_BLOCKS}; // size of the next chunk, doubles up to the max
+	std::vector<char*> m_chunks;
+	char* m_next {nullptr}; // next uncarved block in the newest chunk
+	char* m_end {nullptr};
+	FreeBlock* m_free {nullptr}; // blocks given back by stripes
+	std::atomic_flag m_lock = ATOMIC_FLAG_INIT; // guards the chunks and m_free
+	Stripe m_stripes[NUM_STRIPES];
+
+	static void lock(std::atomic_flag& flag);
+	static void unlock(std::atomic_flag& flag);
+	Stripe& stripe(); // the calling thread's stripe
+	void refill(Stripe& stripe); // give an empty (locked) stripe BATCH_BLOCKS blocks
+	void spill(Stripe& stripe); // take BATCH_BLOCKS blocks back from a (locked) stripe
+public:
+	NodePool(size_t block_size);
+	~NodePool();
+	NodePool(const NodePool&) = delete;
+	NodePool& operator=(const NodePool&) = delete;
+
+	void* allocate(); // get an uninitialized block
+	void deallocate(void* block); // return a block to the pool
+};
+
+// one NodePool per size class, shared by every copy of a PoolAllocator
+class NodePools
+{
+	static const size_t GRANULARITY = alignof(void*);
+	static const size_t NUM_CLASSES = 32;
+
+	std::unique_ptr<NodePool> m_pools[NUM_CLASSES];
+public:
+	static const size_t MAX_SIZE = GRANULARITY * NUM_CLASSES;
+
+	NodePools();
+
+	// can a single object of this size and alignment come from a pool?
+	static bool pooled(size_t size, size_t align)
+	{
+		return size <= MAX_SIZE && align <= GRANULARITY;
+	}
+
+	void* allocate(size_t size)
+	{
+		return m_pools[(size - 1) / GRANULARITY]->allocate();
+	}
+
+	void deallocate(void* block, size_t size)
+	{
+		m_pools[(size - 1) / GRANULARITY]->deallocate(block);
+	}
+};
+
+/* standard allocator that serves single small objects (i.e. hash table nodes)
+ * from NodePools and everything else from operator new. copies (including
+ * rebound copies) share pools, so a node may be freed through any of them
+ */
+template <class T>
+class PoolAllocator
+{
+	template <class> friend class PoolAllocator;
+
+	std::shared_ptr<NodePools> m_pools;
+public:
+	typedef T value_type;
+
+	PoolAllocator()
+		: m_pools {std::make_shared<NodePools>()}
+	{
+	}
+
+	template <class U>
+	PoolAllocator(const PoolAllocator<U>& other)
+		: m_pools {other.m_pools}
+	{
+	}
+
+	T* allocate(size_t n)
+	{
+		if (n == 1 && NodePools::pooled(sizeof(T), alignof(T)))
+			return static_cast<T*>(m_pools->allocate(sizeof(T)));
+		return static_cast<T*>(::operator new(n * sizeof(T)));
+	}
+
+	void deallocate(T* p, size_t n)
+	{
+		if (n == 1 && NodePools::pooled(sizeof(T), alignof(T)))
+			m_pools->deallocate(p, sizeof(T));
+		else
+			::operator delete(p);
+	}
+
+	template <class U>
+	bool operator==(const PoolAllocator<U>& other) const
+	{
+		return m_pools == other.m_pools;
+	}
+
+	template <class U>
+	bool operator!=(const PoolAllocator<U>& other) const
+	{
+		return m_pools != other.m_pools;
+	}
+};
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef PRE_HASH_H
+#define PRE_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+/* the universal hash families (see universal_hash.h) hash 64-bit integers.
+ * PreHash<K> turns a key into one, its hash input, once per operation:
+ *   hash(key): the key's hash input
+ *   INPUT_BITS: the inputs of distinct keys differ in their low INPUT_BITS
+ *       bits, or are at least unlikely to be equal in them. the family must
+ *       read that many bits
+ *   STORED: whether computing the input is expensive enough that the maps
+ *       keep it next to the pair. then rebuilds reuse it instead of hashing
+ *       the key again, and lookups compare it before comparing keys
+ *
+ * integers are their own inputs, so small integer keys (and pairs of them)
+ * have exact inputs and never collide. strings and other keys get a 64-bit
+ * hash, and keys with equal hashes can't be told apart by any member of a
+ * family. among n such keys some two share a hash with probability about
+ * n^2 / 2^65, which is small but not negligible for huge maps (around 3% at
+ * a billion keys). the maps still hold such keys: a subtable or bucket that
+ * has some scans its pairs instead of hashing them (see FastLookupMap and
+ * FrozenFastMap)
+ */
+
+// the splitmix64 finalizer, which spreads every bit of x over the result
+inline uint64_t mix64(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+// a hash of the two hashes, depending on their order
+inline uint64_t combine_hashes(uint64_t first, uint64_t second)
+{
+	return mix64(first * 0x9e3779b97f4a7c15ULL + second);
+}
+
+// MurmurHash64A by Austin Appleby (public domain), 8 bytes at a time
+inline uint64_t hash_bytes(const void* data, size_t n)
+{
+	const uint64_t m = 0xc6a4a7935bd1e995ULL;
+	const int r = 47;
+
+	auto p = static_cast<const unsigned char*>(data);
+	uint64_t h = n * m;
+
+	for (; n >= 8; p += 8, n -= 8)
+	{
+		uint64_t k;
+		std::memcpy(&k, p, 8);
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+		h ^= k;
+		h *= m;
+	}
+
+	if (n)
+	{
+		uint64_t tail = 0;
+		std::memcpy(&tail, p, n);
+		h ^= tail;
+		h *= m;
+	}
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+	return h;
+}
+
+// any other key: its std::hash, mixed, since many standard library hashes are the identity
+template <class K, class Enable = void>
+struct PreHash
+{
+	static const unsigned int INPUT_BITS = 64;
+	static const bool STORED = true;
+
+	static uint64_t hash(const K& key)
+	{
+		return mix64(uint64_t(std::hash<K>()(key)));
+	}
+};
+
+// integers and enums are their own inputs
+template <class K>
+struct PreHash<K, typename std::enable_if<std::is_integral<K>::value || std::is_enum<K>::value>::type>
+{
+	static const unsigned int INPUT_BITS = 8 * sizeof(K);
+	static const bool STORED = false;
+
+	static uint64_t hash(const K& key)
+	{
+		return uint64_t(key);
+	}
+};
+
+template <class Char, class Traits, class Alloc>
+struct PreHash<std::basic_string<Char, Traits, Alloc>>
+{
+	static const unsigned int INPUT_BITS = 64;
+	static const bool STORED = true;
+
+	static uint64_t hash(const std::basic_string<Char, Traits, Alloc>& key)
+	{
+		return hash_bytes(key.data(), key.size() * sizeof(Char));
+	}
+};
+
+/* pairs of keys whose exact inputs fit in 64 bits together are packed into
+ * one, so they stay exact. other pairs combine the inputs of their halves
+ */
+template <class A, class B>
+struct PreHash<std::pair<A, B>>
+{
+	static const bool PACKED = !PreHash<A>::STORED && !PreHash<B>::STORED &&
+		PreHash<A>::INPUT_BITS + PreHash<B>::INPUT_BITS <= 64;
+	static const unsigned int INPUT_BITS = PACKED ? PreHash<A>::INPUT_BITS + PreHash<B>::INPUT_BITS : 64;
+	static const bool STORED = PreHash<A>::STORED || PreHash<B>::STORED;
+
+	static uint64_t hash(const std::pair<A, B>& key)
+	{
+		auto first = PreHash<A>::hash(key.first);
+		auto second = PreHash<B>::hash(key.second);
+		if (!PACKED) return combine_hashes(first, second);
+
+		// sign-extended inputs have to be cut down to their bits first
+		auto b_bits = PreHash<B>::INPUT_BITS;
+		auto b_mask = b_bits < 64 ? (uint64_t(1) << b_bits) - 1 : ~uint64_t(0);
+		return b_bits < 64 ? (first << b_bits) | (second & b_mask) : second;
+	}
+};
+
+// tuples combine the inputs of their elements in order
+template <class... Ts>
+struct PreHash<std::tuple<Ts...>>
+{
+	static const unsigned int INPUT_BITS = 64;
+	static const bool STORED = true;
+
+	static uint64_t hash(const std::tuple<Ts...>& key)
+	{
+		return hashFrom(key, std::index_sequence_for<Ts...>());
+	}
+
+private:
+	template <size_t... Is>
+	static uint64_t hashFrom(const std::tuple<Ts...>& key, std::index_sequence<Is...>)
+	{
+		uint64_t h = 0;
+		uint64_t inputs[] = {0, PreHash<typename std::tuple_element<Is, std::tuple<Ts...>>::type>::hash(std::get<Is>(key))...};
+		for (size_t i = 1; i < sizeof(inputs) / sizeof(inputs[0]); ++i) h = combine_hashes(h, inputs[i]);
+		return h;
+	}
+};
+
+#endif
@@ -2,12 +2,8 @@
 #define RANDOM_UTILS_H
 
 #include <cstdint>
+#include <limits>
 #include <random>
-#include <stdexcept>
-
-// TODO this hard-coded prime causes infinite loops if too large, why?
-// something to do with modular arithmetic and (key % range) == 1 ?
-static const uint32_t HASH_PRIME = 2695268753U;
 
 // return a random size_t >= min and <= max if provided
 inline unsigned int random_uint(unsigned int min, unsigned int max = std::numeric_limits<unsigned int>::max())
@@ -24,16 +20,23 @@ inline unsigned int random_uint(unsigned int min, unsigned int max = std::numeri
 	return dist(generator);
 }
 
-// return a random hash function onto [0, range)
-template <class K>
-std::function<size_t(K)> random_hash(size_t range)
+// return a random 64-bit unsigned integer
+inline uint64_t random_uint64()
 {
-	if (HASH_PRIME < range) throw std::out_of_range("random_hash requested range is larger than HASH_PRIME");
-
-	uint32_t a = random_uint(1, HASH_PRIME - 1);
-	uint32_t b = random_uint(0, HASH_PRIME - 1);
+	return (uint64_t(random_uint(0)) << 32) | random_uint(0);
+}
 
-	return [range, a, b](K key) { return ((a * key + b) % HASH_PRIME) % range; };
+// return a random 64-bit unsigned integer >= min and <= max
+inline uint64_t random_uint64(uint64_t min, uint64_t max)
+{
+	// draw from the smallest power of two covering the range until in it
+	uint64_t span = max - min;
+	uint64_t mask = span;
+	for (unsigned int shift = 1; shift < 64; shift *= 2) mask |= mask >> shift;
+
+	uint64_t x;
+	do x = random_uint64() & mask; while (x > span);
+	return min + x;
 }
 
 #endif
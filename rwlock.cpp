@@ -1,21 +1,254 @@
 #include "rwlock.h"
 
-unsigned int RWMutex::readers(unsigned int rw)
+#include <algorithm>
+#include <climits>
+#include <new>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// sleep while word holds value (may also return spuriously)
+static void futexWait(std::atomic<uint32_t>& word, uint32_t value)
+{
+#ifdef __linux__
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+#else
+	(void)word;
+	(void)value;
+	std::this_thread::yield();
+#endif
+}
+
+// wake every thread sleeping on word
+static void futexWakeAll(std::atomic<uint32_t>& word)
+{
+#ifdef __linux__
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+	(void)word;
+#endif
+}
+
+static void cpuRelax()
+{
+#if defined(__GNUG__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_ia32_pause();
+#else
+	std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+// spins with exponentially growing pauses, until it's time to sleep instead
+class Backoff
+{
+	static const unsigned int MAX_PAUSES = 256;
+	unsigned int m_pauses {1};
+public:
+	// pause and return true, or return false if we've spun long enough
+	bool pause()
+	{
+		if (m_pauses > MAX_PAUSES) return false;
+		for (unsigned int i = 0; i < m_pauses; ++i) cpuRelax();
+		m_pauses *= 2;
+		return true;
+	}
+};
+
+const uint32_t RWMutex::FREE;
+const uint32_t RWMutex::PENDING;
+const uint32_t RWMutex::HELD;
+
+size_t RWMutex::numSlots()
+{
+	// a power of two at least the number of cores, up to 32
+	static const size_t num_slots = []
+	{
+		size_t cores = std::max(1u, std::thread::hardware_concurrency());
+		size_t n = 1;
+		while (n < cores && n < 32) n *= 2;
+		return n;
+	}();
+	return num_slots;
+}
+
+std::atomic<size_t>& RWMutex::readerSlot()
+{
+	// threads take slots round-robin as they first lock
+	static std::atomic<size_t> next_slot {0};
+	thread_local size_t slot = next_slot++;
+	return m_slots[slot & m_slot_mask].readers;
+}
+
+size_t RWMutex::readers() const
+{
+	size_t sum = 0;
+	for (size_t i = 0; i <= m_slot_mask; ++i) sum += m_slots[i].readers.load();
+	return sum;
+}
+
+RWMutex::RWMutex(Preference preference)
+	: m_slot_mask {numSlots() - 1},
+	m_preference {preference}
+{
+	// operator new doesn't align beyond the fundamental alignment before C++17
+	auto num_slots = m_slot_mask + 1;
+	m_slot_memory.reset(new char[(num_slots + 1) * sizeof(slot_t)]);
+	auto address = reinterpret_cast<uintptr_t>(m_slot_memory.get());
+	m_slots = reinterpret_cast<slot_t*>((address + alignof(slot_t) - 1) & ~uintptr_t(alignof(slot_t) - 1));
+	for (size_t i = 0; i < num_slots; ++i) new (&m_slots[i]) slot_t {{0}};
+}
+
+void RWMutex::lock_read()
+{
+	auto& slot = readerSlot();
+	for (;;)
+	{
+		// announce ourselves, then check for a writer (which announces itself, then checks for readers)
+		slot.fetch_add(1);
+		auto writer = m_writer.load();
+		if (writer == FREE || (writer == PENDING && m_preference == PREFER_READERS)) return;
+
+		// back out so the writer can go ahead, and try again once it's done
+		leaveRead();
+		waitForWriter();
+	}
+}
+
+void RWMutex::unlock_read()
+{
+	leaveRead();
+}
+
+void RWMutex::lock_write()
+{
+	claimWriter();
+	drainReaders();
+}
+
+void RWMutex::unlock_write()
+{
+	releaseWriter();
+}
+
+void RWMutex::lock_upgrade()
+{
+	uint32_t expected = FREE;
+	if (!m_writer.compare_exchange_strong(expected, PENDING))
+	{
+		// another writer got there first, and might be waiting for our reader to leave
+		unlock_read();
+		lock_write();
+		return;
+	}
+
+	// no other writer can be draining, so there's nobody to wake
+	readerSlot().fetch_sub(1);
+	drainReaders();
+}
+
+void RWMutex::lock_downgrade()
+{
+	// nobody else can get in before we release the writer word
+	readerSlot().fetch_add(1);
+	releaseWriter();
+}
+
+void RWMutex::claimWriter()
+{
+	Backoff backoff;
+	for (;;)
+	{
+		uint32_t expected = FREE;
+		if (m_writer.compare_exchange_weak(expected, PENDING)) return;
+		if (backoff.pause()) continue;
+
+		++m_writer_sleepers;
+		futexWait(m_writer, expected);
+		--m_writer_sleepers;
+	}
+}
+
+void RWMutex::drainReaders()
+{
+	Backoff backoff;
+	for (;;)
+	{
+		if (m_preference == PREFER_READERS)
+		{
+			// readers still enter while we're PENDING, so we've only won if
+			// nobody is counted after we switch to HELD
+			m_writer = HELD;
+			if (!readers()) return;
+			m_writer = PENDING;
+			if (m_writer_sleepers) futexWakeAll(m_writer);
+		}
+		else if (!readers())
+		{
+			m_writer = HELD;
+			return;
+		}
+
+		if (backoff.pause()) continue;
+
+		// sleep until a reader leaves (leaveRead checks m_drain_sleeping after decrementing)
+		m_drain_sleeping = 1;
+		auto seq = m_drain_seq.load();
+		if (readers()) futexWait(m_drain_seq, seq);
+		m_drain_sleeping = 0;
+	}
+}
+
+void RWMutex::releaseWriter()
+{
+	m_writer = FREE;
+	if (m_writer_sleepers) futexWakeAll(m_writer);
+}
+
+void RWMutex::waitForWriter()
+{
+	Backoff backoff;
+	for (;;)
+	{
+		auto writer = m_writer.load();
+		if (writer == FREE || (writer == PENDING && m_preference == PREFER_READERS)) return;
+		if (backoff.pause()) continue;
+
+		++m_writer_sleepers;
+		futexWait(m_writer, writer);
+		--m_writer_sleepers;
+	}
+}
+
+void RWMutex::leaveRead()
+{
+	readerSlot().fetch_sub(1);
+	if (m_drain_sleeping)
+	{
+		++m_drain_seq;
+		futexWakeAll(m_drain_seq);
+	}
+}
+
+unsigned int SpinRWMutex::readers(unsigned int rw)
 {
 	return rw >> 1;
 }
 
-unsigned int RWMutex::writing(unsigned int rw)
+unsigned int SpinRWMutex::writing(unsigned int rw)
 {
 	return rw & 1;
 }
 
-unsigned int RWMutex::mkrw(unsigned int rds, unsigned int wrt)
+unsigned int SpinRWMutex::mkrw(unsigned int rds, unsigned int wrt)
 {
 	return (rds << 1) | wrt;
 }
 
-void RWMutex::lock_read()
+void SpinRWMutex::lock_read()
 {
 	// repeatedly try to add one more reader, without a write lock
 	unsigned int old_rw = mkrw(readers(m_rw), 0);
@@ -27,7 +260,7 @@ void RWMutex::lock_read()
 	}
 }
 
-void RWMutex::unlock_read()
+void SpinRWMutex::unlock_read()
 {
 	// repeatedly try to remove a reader (ignoring write lock)
 	unsigned int old_rw = m_rw;
@@ -38,7 +271,7 @@ void RWMutex::unlock_read()
 	}
 }
 
-void RWMutex::lock_write()
+void SpinRWMutex::lock_write()
 {
 	// repeatedly try to set writing from false to true (ignoring readers)
 	unsigned int old_rw = mkrw(readers(m_rw), 0);
@@ -53,12 +286,12 @@ void RWMutex::lock_write()
 	while (readers(m_rw) > 0);
 }
 
-void RWMutex::unlock_write()
+void SpinRWMutex::unlock_write()
 {
 	m_rw = 0;
 }
 
-void RWMutex::lock_upgrade()
+void SpinRWMutex::lock_upgrade()
 {
 	// repeatedly try to set writing from false to true and remove a reader
 	unsigned int old_rw = mkrw(readers(m_rw), 0);
@@ -82,7 +315,7 @@ void RWMutex::lock_upgrade()
 	while (readers(m_rw) > 0);
 }
 
-void RWMutex::lock_downgrade()
+void SpinRWMutex::lock_downgrade()
 {
 	// we had exclusive access, so just set to 1 reader, no writer
 	m_rw = mkrw(1, 0);
@@ -2,15 +2,83 @@
 #define RWLOCK_H
 
 #include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 
+/* reader-writer mutex that scales with the number of readers. each reader
+ * only touches its thread's slot of a set of cache-line padded reader
+ * counters, so readers in different slots don't contend. threads take slots
+ * round-robin as they first lock, and there are as many slots as cores
+ * (rounded up to a power of two, at most 32), so threads only share a slot
+ * once there are more of them than slots. a writer claims the writer word,
+ * then waits for the sum of the counters to drain. that makes writes cost a
+ * pass over every slot, so prefer SpinRWMutex for locks that are mostly
+ * written. waiters spin with exponential backoff for a while and then sleep
+ * (on a futex, where available).
+ *
+ * with PREFER_WRITERS (the default) a waiting writer holds off new readers,
+ * so writers can't starve. with PREFER_READERS readers keep entering until
+ * the writer catches the counters at zero
+ */
 class RWMutex
+{
+public:
+	enum Preference { PREFER_WRITERS, PREFER_READERS };
+
+	explicit RWMutex(Preference preference = PREFER_WRITERS);
+	RWMutex(const RWMutex&) = delete;
+	RWMutex& operator=(const RWMutex&) = delete;
+
+	void lock_read(); // acquire shared ownership
+	void unlock_read(); // release shared ownership
+	void lock_write(); // acquire unique ownership
+	void unlock_write(); // release unique ownership
+	void lock_upgrade(); // switch from shared to unique ownership
+	void lock_downgrade(); // switch from unique to shared ownership
+
+private:
+	// values of m_writer
+	static const uint32_t FREE = 0; // no writer
+	static const uint32_t PENDING = 1; // a writer is waiting for readers to leave
+	static const uint32_t HELD = 2; // a writer has unique ownership
+
+	struct alignas(64) slot_t
+	{
+		std::atomic<size_t> readers; // may wrap if a thread's slot changes, only the sum counts
+	};
+
+	static size_t numSlots();
+	std::atomic<size_t>& readerSlot(); // the calling thread's counter
+	size_t readers() const; // sum of the counters
+	void claimWriter(); // set m_writer from FREE to PENDING
+	void drainReaders(); // wait until there are no readers and take m_writer to HELD
+	void releaseWriter(); // set m_writer to FREE, waking sleepers
+	void waitForWriter(); // wait until a reader may enter
+	void leaveRead(); // drop the calling thread's reader count, waking a draining writer
+
+	std::unique_ptr<char[]> m_slot_memory; // m_slots, aligned within
+	slot_t* m_slots;
+	size_t m_slot_mask; // number of slots - 1
+	Preference m_preference;
+	std::atomic<uint32_t> m_writer {FREE};
+	std::atomic<uint32_t> m_writer_sleepers {0}; // threads sleeping until m_writer changes
+	std::atomic<uint32_t> m_drain_seq {0}; // bumped when a reader leaves while a writer sleeps
+	std::atomic<uint32_t> m_drain_sleeping {0}; // a writer sleeps until m_drain_seq changes
+};
+
+/* the original reader-writer spin lock: one word holding the reader count and
+ * writer flag. cheaper than RWMutex to write lock and only a word in size, but
+ * every reader writes the same word
+ */
+class SpinRWMutex
 {
 	std::atomic<unsigned int> m_rw {0};
 	static unsigned int readers(unsigned int);
 	static unsigned int writing(unsigned int);
 	static unsigned int mkrw(unsigned int, unsigned int);
 public:
-	RWMutex() {};
+	SpinRWMutex() {};
 	void lock_read(); // acquire shared ownership
 	void unlock_read(); // release shared ownership
 	void lock_write(); // acquire unique ownership
@@ -19,58 +87,65 @@ public:
 	void lock_downgrade(); // switch from unique to shared ownership
 };
 
-class UpgradeLock;
+template <class Mutex> class BasicUpgradeLock;
 
 // acquire shared ownership of mutex, automatically releasing when destroyed
-class ReadLock
+template <class Mutex>
+class BasicReadLock
 {
-	friend UpgradeLock;
-	RWMutex& m_mutex;
+	friend BasicUpgradeLock<Mutex>;
+	Mutex& m_mutex;
 public:
-	ReadLock(RWMutex& mutex)
+	BasicReadLock(Mutex& mutex)
 		: m_mutex {mutex}
 	{
 		m_mutex.lock_read();
 	}
 
-	~ReadLock()
+	~BasicReadLock()
 	{
 		m_mutex.unlock_read();
 	}
 };
 
 // acquire unique ownership of mutex, automatically releasing when destroyed
-class WriteLock
+template <class Mutex>
+class BasicWriteLock
 {
-	RWMutex& m_mutex;
+	Mutex& m_mutex;
 public:
-	WriteLock(RWMutex& mutex)
+	BasicWriteLock(Mutex& mutex)
 		: m_mutex {mutex}
 	{
 		m_mutex.lock_write();
 	}
 
-	~WriteLock()
+	~BasicWriteLock()
 	{
 		m_mutex.unlock_write();
 	}
 };
 
 // upgrade lock to unique ownership, automatically reverting to shared when destroyed
-class UpgradeLock
+template <class Mutex>
+class BasicUpgradeLock
 {
-	ReadLock& m_lock;
+	BasicReadLock<Mutex>& m_lock;
 public:
-	UpgradeLock(ReadLock& lock)
+	BasicUpgradeLock(BasicReadLock<Mutex>& lock)
 		: m_lock {lock}
 	{
 		m_lock.m_mutex.lock_upgrade();
 	}
 
-	~UpgradeLock()
+	~BasicUpgradeLock()
 	{
 		m_lock.m_mutex.lock_downgrade();
 	}
 };
 
+typedef BasicReadLock<RWMutex> ReadLock;
+typedef BasicWriteLock<RWMutex> WriteLock;
+typedef BasicUpgradeLock<RWMutex> UpgradeLock;
+
 #endif
@@ -0,0 +1,483 @@
+#ifndef SHARDED_FAST_MAP_H
+#define SHARDED_FAST_MAP_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "fast_map.h"
+#include "pre_hash.h"
+#include "thread_pool.h"
+
+/* FastMap split into shards by key, each owned by a worker thread that is the
+ * only one ever touching it. clients don't lock anything: they push tasks
+ * onto a shard's queue, and the worker runs them. so the shards need no
+ * locking of their own, and a rebuild stalls only its shard.
+ *
+ * the queues are lock-free stacks. the worker takes everything queued at once
+ * and runs it back to back (the combining of flat combining, without clients
+ * competing for the combiner's role). single operations return futures, and a
+ * Batcher collects many operations per shard into one task, handing the
+ * results to a callback. either way, operations a client submits to a shard
+ * are applied in the order it submitted them
+ */
+template <class K, class V, class... Policies>
+class ShardedFastMap
+{
+public:
+	typedef FastMap<K, V, Policies...> map_t;
+	typedef std::pair<const K, V> pair_t;
+
+	static const size_t DEFAULT_BATCH_SIZE = 64;
+
+	// an operation submitted through a Batcher, and its result
+	struct Request
+	{
+		enum Type : uint8_t { FIND, INSERT, ERASE };
+
+		Type type;
+		bool result; // key found / pair inserted / pair erased
+		K key;
+		V value; // INSERT: the value to insert, moved into the map. FIND: the value found, if any
+	};
+
+	class Batcher;
+
+private:
+	// work for one shard, run and then deleted by its worker
+	struct task_t
+	{
+		task_t* next {nullptr};
+
+		virtual ~task_t() {}
+		virtual void run(map_t& map) = 0;
+	};
+
+	// a call of f(map), fulfilling a promise with its result
+	template <class F, class R>
+	struct call_task_t : task_t
+	{
+		F f;
+		std::promise<R> promise;
+
+		call_task_t(F&& f) : f {std::move(f)} {}
+
+		void run(map_t& map) override
+		{
+			try
+			{
+				setValue(promise, map);
+			}
+			catch (...)
+			{
+				promise.set_exception(std::current_exception());
+			}
+		}
+
+		template <class T>
+		void setValue(std::promise<T>& p, map_t& map) { p.set_value(f(map)); }
+		void setValue(std::promise<void>& p, map_t& map) { f(map); p.set_value(); }
+	};
+
+	struct shard_t
+	{
+		std::atomic<task_t*> tasks {nullptr}; // pushed by clients, taken all at once by the worker
+		std::atomic<bool> sleeping {false};
+		// keep the state only the worker writes off the line clients write to
+		char padding[64 - sizeof(std::atomic<task_t*>) - sizeof(std::atomic<bool>)];
+
+		map_t map;
+		std::atomic<size_t> size {0}; // map.size() after the last task
+		bool stop {false}; // guarded by mutex
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::thread worker;
+	};
+
+	// yields before the worker goes to sleep, as waking it up is slow
+	static const int SPIN_LIMIT = 64;
+
+	std::vector<std::unique_ptr<shard_t>> m_shards;
+
+public:
+	/* construct with num_shards shards (one per hardware thread if 0). with
+	 * pin, shard i's worker is bound to cpu i, where the system supports it
+	 */
+	explicit ShardedFastMap(size_t num_shards = 0, bool pin = true)
+	{
+		if (!num_shards) num_shards = std::max(1u, std::thread::hardware_concurrency());
+
+		for (size_t i = 0; i < num_shards; ++i)
+		{
+			m_shards.emplace_back(new shard_t);
+			auto& shard = *m_shards.back();
+			shard.worker = std::thread([&shard] { work(shard); });
+			if (pin) pin_thread(shard.worker, i);
+		}
+	}
+
+	// runs every task already submitted, then stops the workers
+	~ShardedFastMap()
+	{
+		for (auto& shard : m_shards)
+		{
+			std::lock_guard<std::mutex> lock(shard->mutex);
+			shard->stop = true;
+			shard->wake.notify_one();
+		}
+		for (auto& shard : m_shards) shard->worker.join();
+	}
+
+	ShardedFastMap(const ShardedFastMap&) = delete;
+	ShardedFastMap& operator=(const ShardedFastMap&) = delete;
+
+	size_t numShards() const
+	{
+		return m_shards.size();
+	}
+
+	// the shard holding key
+	size_t shardOf(const K& key) const
+	{
+		return size_t(mix64(PreHash<K>::hash(key)) % m_shards.size());
+	}
+
+	// number of pairs, as of the last task each shard ran
+	size_t size() const
+	{
+		size_t size = 0;
+		for (auto& shard : m_shards) size += shard->size.load(std::memory_order_relaxed);
+		return size;
+	}
+
+	/* run f(map) on the worker owning shard, where map is the shard's FastMap,
+	 * and return a future for its result. f must not keep a reference to map
+	 */
+	template <class F>
+	auto onShard(size_t shard, F f) -> std::future<decltype(f(std::declval<map_t&>()))>
+	{
+		typedef decltype(f(std::declval<map_t&>())) result_t;
+
+		auto task = new call_task_t<F, result_t>(std::move(f));
+		auto future = task->promise.get_future();
+		push(*m_shards[shard], task);
+		return future;
+	}
+
+	std::future<bool> insert(const pair_t& pair)
+	{
+		return onShard(shardOf(pair.first), [pair](map_t& map) { return map.insert(pair); });
+	}
+
+	std::future<size_t> erase(const K& key)
+	{
+		return onShard(shardOf(key), [key](map_t& map) { return map.erase(key); });
+	}
+
+	std::future<size_t> count(const K& key)
+	{
+		return onShard(shardOf(key), [key](map_t& map) { return map.count(key); });
+	}
+
+	// a copy of the value matching key. the future holds std::out_of_range if there is none
+	std::future<V> at(const K& key)
+	{
+		return onShard(shardOf(key), [key](map_t& map) { return map.at(key); });
+	}
+
+	// replace the contents with the pairs in [first, last), the shards assigning theirs in parallel
+	template <class It>
+	void assign(It first, It last)
+	{
+		std::vector<std::vector<pair_t>> parts(m_shards.size());
+		for (auto it = first; it != last; ++it) parts[shardOf(it->first)].push_back(*it);
+		forEachShard([&parts](size_t i, map_t& map) { map.assign(parts[i].begin(), parts[i].end()); });
+	}
+
+	// rebuild every shard, in parallel
+	void rebuild()
+	{
+		forEachShard([](size_t, map_t& map) { map.rebuild(); });
+	}
+
+	/* call f(i, map) on each shard i's worker, and wait for all of them.
+	 * rethrows the first exception thrown by a call
+	 */
+	template <class F>
+	void forEachShard(F f)
+	{
+		std::vector<std::future<void>> done;
+		for (size_t i = 0; i < m_shards.size(); ++i)
+			done.push_back(onShard(i, [&f, i](map_t& map) { f(i, map); }));
+		for (auto& d : done) d.wait();
+		for (auto& d : done) d.get();
+	}
+
+private:
+	void push(shard_t& shard, task_t* task)
+	{
+		task->next = shard.tasks.load(std::memory_order_relaxed);
+		while (!shard.tasks.compare_exchange_weak(task->next, task, std::memory_order_seq_cst, std::memory_order_relaxed));
+
+		// the worker sets sleeping before its last look at the queue, so it either sees the task or gets notified
+		if (shard.sleeping.load(std::memory_order_seq_cst))
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			shard.wake.notify_one();
+		}
+	}
+
+	// take everything queued on shard, oldest first
+	static task_t* takeTasks(shard_t& shard)
+	{
+		auto tasks = shard.tasks.exchange(nullptr, std::memory_order_acquire);
+
+		task_t* reversed = nullptr;
+		while (tasks)
+		{
+			auto next = tasks->next;
+			tasks->next = reversed;
+			reversed = tasks;
+			tasks = next;
+		}
+		return reversed;
+	}
+
+	static void work(shard_t& shard)
+	{
+		int idle = 0;
+
+		while (true)
+		{
+			auto tasks = takeTasks(shard);
+			if (tasks)
+			{
+				while (tasks)
+				{
+					auto next = tasks->next;
+					tasks->run(shard.map);
+					delete tasks;
+					tasks = next;
+				}
+				shard.size.store(shard.map.size(), std::memory_order_relaxed);
+				idle = 0;
+				continue;
+			}
+
+			if (++idle < SPIN_LIMIT)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(shard.mutex);
+			shard.sleeping.store(true, std::memory_order_seq_cst);
+			shard.wake.wait(lock, [&shard] { return shard.stop || shard.tasks.load(std::memory_order_seq_cst); });
+			shard.sleeping.store(false, std::memory_order_relaxed);
+			if (shard.stop && !shard.tasks.load(std::memory_order_acquire)) return;
+			idle = 0;
+		}
+	}
+
+	// requests of one Batcher for one shard
+	struct batch_task_t : task_t
+	{
+		Batcher& batcher;
+		std::vector<Request> requests;
+
+		batch_task_t(Batcher& batcher) : batcher(batcher) {}
+
+		void run(map_t& map) override
+		{
+			try
+			{
+				apply(map);
+			}
+			catch (...)
+			{
+				batcher.setError(std::current_exception());
+			}
+
+			try
+			{
+				if (batcher.m_done) batcher.m_done(requests.data(), requests.size());
+			}
+			catch (...)
+			{
+				batcher.setError(std::current_exception());
+			}
+
+			// the batcher may be gone right after this
+			batcher.m_pending.fetch_sub(1, std::memory_order_release);
+		}
+
+		void apply(map_t& map)
+		{
+			// lookups of each run of finds overlap their memory accesses
+			thread_local std::vector<K> keys;
+			thread_local std::vector<const V*> values;
+
+			for (size_t i = 0; i < requests.size();)
+			{
+				auto& request = requests[i];
+				if (request.type == Request::INSERT)
+				{
+					request.result = map.try_emplace(std::move(request.key), std::move(request.value)).second;
+					++i;
+				}
+				else if (request.type == Request::ERASE)
+				{
+					request.result = map.erase(request.key) != 0;
+					++i;
+				}
+				else
+				{
+					size_t end = i;
+					keys.clear();
+					for (; end < requests.size() && requests[end].type == Request::FIND; ++end) keys.push_back(requests[end].key);
+					values.resize(keys.size());
+					map.findMany(keys.data(), keys.size(), values.data());
+
+					for (size_t k = 0; k < keys.size(); ++k)
+					{
+						requests[i + k].result = values[k] != nullptr;
+						if (values[k]) requests[i + k].value = *values[k];
+					}
+					i = end;
+				}
+			}
+		}
+	};
+
+public:
+	/* submits operations in batches, one per shard, for a single client
+	 * thread. a batch is sent when it is full or on flush(), and done(requests,
+	 * num_requests) is called with its results on the shard's worker thread.
+	 * the keys of inserted pairs are moved from, so done can't rely on them
+	 */
+	class Batcher
+	{
+		friend struct ShardedFastMap::batch_task_t;
+
+	public:
+		typedef std::function<void(Request* requests, size_t num_requests)> callback_t;
+
+		Batcher(ShardedFastMap& map, size_t batch_size = DEFAULT_BATCH_SIZE, callback_t done = callback_t())
+			: m_map(map),
+			m_batch_size {std::max<size_t>(1, batch_size)},
+			m_done {std::move(done)},
+			m_batches(map.numShards())
+		{
+		}
+
+		// sends the open batches and waits for them, ignoring errors
+		~Batcher()
+		{
+			try
+			{
+				wait();
+			}
+			catch (...)
+			{
+			}
+		}
+
+		Batcher(const Batcher&) = delete;
+		Batcher& operator=(const Batcher&) = delete;
+
+		void insert(const K& key, const V& value)
+		{
+			add({Request::INSERT, false, key, value});
+		}
+
+		void erase(const K& key)
+		{
+			add({Request::ERASE, false, key, V()});
+		}
+
+		void find(const K& key)
+		{
+			add({Request::FIND, false, key, V()});
+		}
+
+		// send the batches that aren't full yet
+		void flush()
+		{
+			for (size_t i = 0; i < m_batches.size(); ++i)
+			{
+				if (m_batches[i]) send(i);
+			}
+		}
+
+		/* flush, then wait until every batch sent has been applied and its
+		 * callback has returned. rethrows the first exception from either
+		 */
+		void wait()
+		{
+			flush();
+			while (m_pending.load(std::memory_order_acquire)) std::this_thread::yield();
+
+			std::lock_guard<std::mutex> lock(m_error_mutex);
+			if (m_error)
+			{
+				auto error = m_error;
+				m_error = nullptr;
+				std::rethrow_exception(error);
+			}
+		}
+
+		// batches sent but not yet done
+		size_t pending() const
+		{
+			return m_pending.load(std::memory_order_relaxed);
+		}
+
+	private:
+		ShardedFastMap& m_map;
+		size_t m_batch_size;
+		callback_t m_done;
+		std::vector<std::unique_ptr<batch_task_t>> m_batches; // the open batch of each shard, if any
+		std::atomic<size_t> m_pending {0};
+		std::mutex m_error_mutex; // workers of different shards may fail at once
+		std::exception_ptr m_error;
+
+		void add(Request&& request)
+		{
+			auto shard = m_map.shardOf(request.key);
+			auto& batch = m_batches[shard];
+			if (!batch)
+			{
+				batch.reset(new batch_task_t(*this));
+				batch->requests.reserve(m_batch_size);
+			}
+
+			batch->requests.push_back(std::move(request));
+			if (batch->requests.size() >= m_batch_size) send(shard);
+		}
+
+		void send(size_t shard)
+		{
+			m_pending.fetch_add(1, std::memory_order_relaxed);
+			m_map.push(*m_map.m_shards[shard], m_batches[shard].release());
+		}
+
+		void setError(std::exception_ptr error)
+		{
+			std::lock_guard<std::mutex> lock(m_error_mutex);
+			if (!m_error) m_error = error;
+		}
+	};
+};
+
+#endif
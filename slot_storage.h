@@ -0,0 +1,553 @@
+#ifndef SLOT_STORAGE_H
+#define SLOT_STORAGE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "pre_hash.h"
+
+#if defined(__GNUG__) && defined(__x86_64__)
+#define SLOT_STORAGE_X86
+#include <emmintrin.h>
+#endif
+
+// index of the lowest set bit of a nonzero word
+inline size_t lowest_bit(uint64_t word)
+{
+#ifdef __GNUG__
+	return size_t(__builtin_ctzll(word));
+#else
+	size_t i = 0;
+	while (!(word & 1)) { word >>= 1; ++i; }
+	return i;
+#endif
+}
+
+// hint that the cache line holding p will be read soon
+inline void prefetch(const void* p)
+{
+#ifdef __GNUG__
+	__builtin_prefetch(p);
+#else
+	(void)p;
+#endif
+}
+
+// bit i set for each of the first n (at most 8) bytes of tags that equal tag
+inline unsigned match_tags(uint64_t tags, uint8_t tag, size_t n)
+{
+#ifdef SLOT_STORAGE_X86
+	// all eight at once (SSE2 is part of x86-64)
+	auto equal = _mm_cmpeq_epi8(_mm_cvtsi64_si128(int64_t(tags)), _mm_set1_epi8(char(tag)));
+	auto bits = unsigned(_mm_movemask_epi8(equal));
+#else
+	unsigned bits = 0;
+	for (size_t i = 0; i < 8; ++i) bits |= unsigned(uint8_t(tags >> (8 * i)) == tag) << i;
+#endif
+	return bits & ((1u << n) - 1);
+}
+
+/* a pair, or a pointer to one, along with the hash input of its key where
+ * PreHash stores it (see pre_hash.h). otherwise it's just the value, and the
+ * input is computed from the key when needed
+ */
+template <class K, class T, bool Stored = PreHash<K>::STORED>
+struct HashedEntry
+{
+	T value;
+	uint64_t input;
+
+	static HashedEntry make(T value, uint64_t input)
+	{
+		return HashedEntry {std::move(value), input};
+	}
+
+	uint64_t hashInput(const K&) const
+	{
+		return input;
+	}
+
+	// could the key be one with this input?
+	bool hasInput(uint64_t key_input) const
+	{
+		return input == key_input;
+	}
+};
+
+template <class K, class T>
+struct HashedEntry<K, T, false>
+{
+	T value;
+
+	static HashedEntry make(T value, uint64_t)
+	{
+		return HashedEntry {std::move(value)};
+	}
+
+	uint64_t hashInput(const K& key) const
+	{
+		return PreHash<K>::hash(key);
+	}
+
+	bool hasInput(uint64_t) const
+	{
+		return true;
+	}
+};
+
+/* storage policies for the hash table inside FastLookupMap. a policy provides
+ * a slot table type for a given key type, value type and allocator. tables
+ * move pairs between each other as "nodes" during rebuilds. nodes are made
+ * and destroyed with the table's allocator_type, which tables sharing nodes
+ * must share. nodes carry their keys' hash inputs where those are stored
+ */
+
+// each slot holds a pointer to a separately allocated pair (and its key's
+// stored hash input, if any, so that lookups of other keys rarely follow the
+// pointer). pairs never move once inserted, but every lookup has to follow a pointer
+template <class K, class V, class Alloc>
+class NodeSlots
+{
+public:
+	typedef std::pair<const K, V> pair_t;
+	typedef HashedEntry<K, pair_t*> node_t; // pairs are moved around by pointer
+	typedef typename std::allocator_traits<Alloc>::template rebind_alloc<pair_t> allocator_type;
+
+private:
+	typedef std::allocator_traits<allocator_type> alloc_traits;
+
+public:
+	NodeSlots(const allocator_type& alloc = allocator_type())
+		: m_alloc {alloc}
+	{
+	}
+
+	NodeSlots(const NodeSlots&) = delete;
+	NodeSlots& operator=(const NodeSlots&) = delete;
+
+	~NodeSlots()
+	{
+		clear();
+	}
+
+	// a node holding the pair constructed from args
+	template <class... Args>
+	static node_t makeNode(allocator_type& alloc, Args&&... args)
+	{
+		auto p = newPair(alloc, std::forward<Args>(args)...);
+		return node_t::make(p, PreHash<K>::hash(p->first));
+	}
+
+	// the same, for a pair whose key has hash input input
+	template <class... Args>
+	static node_t makeHashedNode(allocator_type& alloc, uint64_t input, Args&&... args)
+	{
+		return node_t::make(newPair(alloc, std::forward<Args>(args)...), input);
+	}
+
+	// destroy a node that was never placed in a table
+	static void destroyNode(allocator_type& alloc, node_t& node)
+	{
+		alloc_traits::destroy(alloc, node.value);
+		alloc_traits::deallocate(alloc, node.value, 1);
+		node.value = nullptr;
+	}
+
+	static const K& nodeKey(const node_t& node)
+	{
+		return node.value->first;
+	}
+
+	static uint64_t nodeHashInput(const node_t& node)
+	{
+		return node.hashInput(nodeKey(node));
+	}
+
+	allocator_type& allocator()
+	{
+		return m_alloc;
+	}
+
+	// number of slots
+	size_t size() const
+	{
+		return m_slots.size();
+	}
+
+	// memory taken by num_slots slots (the pairs are allocated separately)
+	static size_t slotBytes(size_t num_slots)
+	{
+		return num_slots * sizeof(node_t);
+	}
+
+	// change number of slots (table must be empty). the new slots are
+	// allocated before the old ones are released, so if that throws the table
+	// is left as it was
+	void resize(size_t num_slots)
+	{
+		if (num_slots != m_slots.size()) std::vector<node_t>(num_slots).swap(m_slots);
+	}
+
+	bool occupied(size_t i) const
+	{
+		return m_slots[i].value != nullptr;
+	}
+
+	// return pair in slot i, or null if empty
+	pair_t* get(size_t i)
+	{
+		return m_slots[i].value;
+	}
+
+	const pair_t* get(size_t i) const
+	{
+		return m_slots[i].value;
+	}
+
+	// return pair in slot i if its key could have hash input input (see
+	// HashedEntry::hasInput), or null. doesn't touch the pair otherwise
+	const pair_t* getIfInput(size_t i, uint64_t input) const
+	{
+		return m_slots[i].hasInput(input) ? m_slots[i].value : nullptr;
+	}
+
+	// start loading slot i into the cache
+	void prefetchSlot(size_t i) const
+	{
+		prefetch(&m_slots[i]);
+	}
+
+	// index of the first occupied slot at or after i, or size() if there is none
+	size_t nextOccupied(size_t i) const
+	{
+		while (i < m_slots.size() && !m_slots[i].value) ++i;
+		return i;
+	}
+
+	// call f with each pair, in slot order
+	template <class F>
+	void forEach(F&& f) const
+	{
+		for (auto& slot : m_slots)
+		{
+			if (slot.value) f(static_cast<const pair_t&>(*slot.value));
+		}
+	}
+
+	// start loading the pair in slot i into the cache (the slot should be loaded already)
+	void prefetchPair(size_t i) const
+	{
+		if (m_slots[i].value) prefetch(m_slots[i].value);
+	}
+
+	// place node in empty slot i
+	void put(size_t i, node_t&& node)
+	{
+		m_slots[i] = node;
+	}
+
+	// destroy pair in occupied slot i
+	void erase(size_t i)
+	{
+		destroyNode(m_alloc, m_slots[i]);
+	}
+
+	// move the pair in occupied slot from to empty slot to
+	void move(size_t from, size_t to)
+	{
+		m_slots[to] = m_slots[from];
+		m_slots[from].value = nullptr;
+	}
+
+	// move all pairs onto the end of nodes, leaving every slot empty. if
+	// growing nodes throws, the pairs not moved yet are destroyed
+	void moveTo(std::vector<node_t>& nodes)
+	{
+		try
+		{
+			for (auto& slot : m_slots)
+			{
+				if (!slot.value) continue;
+				nodes.push_back(slot);
+				slot.value = nullptr;
+			}
+		}
+		catch (...)
+		{
+			clear();
+			throw;
+		}
+	}
+
+	// destroy all pairs (without shrinking the table)
+	void clear()
+	{
+		for (auto& slot : m_slots)
+		{
+			if (slot.value) destroyNode(m_alloc, slot);
+		}
+	}
+
+private:
+	// a pair constructed in place from args
+	template <class... Args>
+	static pair_t* newPair(allocator_type& alloc, Args&&... args)
+	{
+		auto p = alloc_traits::allocate(alloc, 1);
+		try
+		{
+			alloc_traits::construct(alloc, p, std::forward<Args>(args)...);
+		}
+		catch (...)
+		{
+			alloc_traits::deallocate(alloc, p, 1);
+			throw;
+		}
+		return p;
+	}
+
+	allocator_type m_alloc; // for nodes
+	std::vector<node_t> m_slots; // empty slots hold null
+};
+
+// pairs are stored directly in the slots, with a bitmap marking the occupied
+// ones. lookups touch the slot (and bitmap) only and inserts don't allocate,
+// but pairs move whenever the table is rebuilt. best for small, cheaply
+// copyable keys and values
+template <class K, class V, class Alloc>
+class InlineSlots
+{
+	typedef HashedEntry<K, std::pair<const K, V>> entry_t; // a pair and its key's stored hash input, if any
+	typedef typename std::aligned_storage<sizeof(entry_t), alignof(entry_t)>::type slot_t;
+	typedef typename std::allocator_traits<Alloc>::template rebind_alloc<slot_t> slot_alloc_t;
+	typedef typename std::allocator_traits<Alloc>::template rebind_alloc<uint64_t> word_alloc_t;
+	static const size_t WORD_BITS = 64;
+
+public:
+	typedef std::pair<const K, V> pair_t;
+	typedef entry_t node_t; // pairs are moved around by value
+	typedef typename std::allocator_traits<Alloc>::template rebind_alloc<pair_t> allocator_type;
+
+	InlineSlots(const allocator_type& alloc = allocator_type())
+		: m_alloc {alloc},
+		m_slots(slot_alloc_t(alloc)),
+		m_used(word_alloc_t(alloc))
+	{
+	}
+
+	InlineSlots(const InlineSlots&) = delete;
+	InlineSlots& operator=(const InlineSlots&) = delete;
+
+	~InlineSlots()
+	{
+		clear();
+	}
+
+	// the pair is built first and then moved into the node, which copies its key
+	template <class... Args>
+	static node_t makeNode(allocator_type& alloc, Args&&... args)
+	{
+		pair_t pair(std::forward<Args>(args)...);
+		auto input = PreHash<K>::hash(pair.first);
+		return makeHashedNode(alloc, input, std::move(pair));
+	}
+
+	template <class... Args>
+	static node_t makeHashedNode(allocator_type&, uint64_t input, Args&&... args)
+	{
+		return node_t::make(pair_t(std::forward<Args>(args)...), input);
+	}
+
+	static void destroyNode(allocator_type&, node_t&)
+	{
+	}
+
+	static const K& nodeKey(const node_t& node)
+	{
+		return node.value.first;
+	}
+
+	static uint64_t nodeHashInput(const node_t& node)
+	{
+		return node.hashInput(nodeKey(node));
+	}
+
+	allocator_type& allocator()
+	{
+		return m_alloc;
+	}
+
+	size_t size() const
+	{
+		return m_slots.size();
+	}
+
+	// memory taken by num_slots slots, including the occupancy bitmap
+	static size_t slotBytes(size_t num_slots)
+	{
+		return num_slots * sizeof(slot_t) + (num_slots + WORD_BITS - 1) / WORD_BITS * sizeof(uint64_t);
+	}
+
+	void resize(size_t num_slots)
+	{
+		if (num_slots == m_slots.size()) return;
+
+		std::vector<slot_t, slot_alloc_t> slots(num_slots, m_slots.get_allocator());
+		std::vector<uint64_t, word_alloc_t> used((num_slots + WORD_BITS - 1) / WORD_BITS, 0, m_used.get_allocator());
+		m_slots.swap(slots);
+		m_used.swap(used);
+	}
+
+	bool occupied(size_t i) const
+	{
+		return (m_used[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+	}
+
+	pair_t* get(size_t i)
+	{
+		return occupied(i) ? slot(i) : nullptr;
+	}
+
+	const pair_t* get(size_t i) const
+	{
+		return occupied(i) ? slot(i) : nullptr;
+	}
+
+	// the stored input is in the same slot as the pair
+	const pair_t* getIfInput(size_t i, uint64_t input) const
+	{
+		return occupied(i) && entry(i)->hasInput(input) ? slot(i) : nullptr;
+	}
+
+	void prefetchSlot(size_t i) const
+	{
+		prefetch(&m_used[i / WORD_BITS]);
+		prefetch(&m_slots[i]);
+	}
+
+	// the pair is in the slot
+	void prefetchPair(size_t) const
+	{
+	}
+
+	// skips empty words of the bitmap
+	size_t nextOccupied(size_t i) const
+	{
+		if (i >= size()) return size();
+
+		auto w = i / WORD_BITS;
+		auto bits = m_used[w] & (~uint64_t(0) << (i % WORD_BITS));
+		while (!bits)
+		{
+			if (++w == m_used.size()) return size();
+			bits = m_used[w];
+		}
+		return w * WORD_BITS + lowest_bit(bits);
+	}
+
+	template <class F>
+	void forEach(F&& f) const
+	{
+		forEachOccupied([&](size_t i) { f(*slot(i)); });
+	}
+
+	void put(size_t i, node_t&& node)
+	{
+		// keys are const, so this copies the key and moves the value
+		new (&m_slots[i]) entry_t(std::move(node));
+		m_used[i / WORD_BITS] |= uint64_t(1) << (i % WORD_BITS);
+	}
+
+	void erase(size_t i)
+	{
+		entry(i)->~entry_t();
+		m_used[i / WORD_BITS] &= ~(uint64_t(1) << (i % WORD_BITS));
+	}
+
+	void move(size_t from, size_t to)
+	{
+		put(to, std::move(*entry(from)));
+		erase(from);
+	}
+
+	// moving a pair copies its key. if that throws, so does this, and the
+	// pairs not moved yet are destroyed
+	void moveTo(std::vector<node_t>& nodes)
+	{
+		try
+		{
+			forEachOccupied([&](size_t i)
+			{
+				nodes.push_back(std::move(*entry(i)));
+				erase(i);
+			});
+		}
+		catch (...)
+		{
+			clear();
+			throw;
+		}
+	}
+
+	void clear()
+	{
+		forEachOccupied([&](size_t i) { entry(i)->~entry_t(); });
+		std::fill(m_used.begin(), m_used.end(), 0);
+	}
+
+private:
+	entry_t* entry(size_t i)
+	{
+		return reinterpret_cast<entry_t*>(&m_slots[i]);
+	}
+
+	const entry_t* entry(size_t i) const
+	{
+		return reinterpret_cast<const entry_t*>(&m_slots[i]);
+	}
+
+	pair_t* slot(size_t i)
+	{
+		return &entry(i)->value;
+	}
+
+	const pair_t* slot(size_t i) const
+	{
+		return &entry(i)->value;
+	}
+
+	// call f with the index of each occupied slot, skipping empty words of the bitmap
+	template <class F>
+	void forEachOccupied(F f) const
+	{
+		for (size_t w = 0; w < m_used.size(); ++w)
+		{
+			for (auto bits = m_used[w]; bits; bits &= bits - 1)
+				f(w * WORD_BITS + lowest_bit(bits));
+		}
+	}
+
+	allocator_type m_alloc;
+	std::vector<slot_t, slot_alloc_t> m_slots; // uninitialized unless the matching bit in m_used is set
+	std::vector<uint64_t, word_alloc_t> m_used; // occupancy bitmap
+};
+
+// policy selecting NodeSlots
+struct NodeStorage
+{
+	template <class K, class V, class Alloc> using table = NodeSlots<K, V, Alloc>;
+};
+
+// policy selecting InlineSlots
+struct InlineStorage
+{
+	template <class K, class V, class Alloc> using table = InlineSlots<K, V, Alloc>;
+};
+
+#endif
@@ -1,52 +1,241 @@
 #ifndef SPEED_TEST_H
 #define SPEED_TEST_H
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <limits>
+#include <memory>
+#include <random>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "bench_stats.h"
+#include "fast_map_stats.h"
+#include "hash_search.h"
 #include "random_utils.h"
+#include "thread_pool.h"
+#include "workload.h"
 
+// one run of the speed test
+struct SpeedResult
+{
+	double seconds;
+	LatencyHistogram reads, inserts, erases; // per-operation times, if they were measured
+	bool has_stats {false}; // whether the map has stats (see map_stats)
+	FastMapStats stats;     // the map's stats at the end of the run, including the prepopulating assign
+};
+
+// set stats to the stats of map and return true, if it has any (see FastMap::stats)
+template<class T>
+auto map_stats(const T& map, FastMapStats& stats, int = 0) -> decltype(map.stats(), true)
+{
+	stats = map.stats();
+	return true;
+}
+
+template<class T>
+bool map_stats(const T&, FastMapStats&, long = 0)
+{
+	return false;
+}
+
+/* replay trace with num_threads threads, each taking an equal, contiguous
+ * share of its operations. runs of up to batch reads are done together with
+ * countMany if batch > 1. if time_ops, each operation is timed separately,
+ * which slows the run down by the cost of reading the clock (a batch of reads
+ * counts as that many reads of its average time)
+ */
 template<class T>
-std::chrono::high_resolution_clock::rep speed_test(int key_max, int num_threads, int iters, int reads, int writes, int erases, int prepop)
+SpeedResult speed_test(const Trace& trace, int num_threads, int batch, bool time_ops)
 {
 	std::atomic<int> barrier_1, barrier_2, barrier_3;
+	std::atomic<size_t> num_found {0}; // results of reads are used, so that they can't be optimized away
 
-	std::chrono::high_resolution_clock::time_point start_time, end_time;
+	std::chrono::steady_clock::time_point start_time, end_time;
 
 	barrier_1 = 0; barrier_2 = 0; barrier_3 = 0;
 
 	T map;
-	// pre-populate map (non-randomly because it doesn't matter)
-	for (int i = 0; i < prepop && i <= key_max; ++i) map.insert(std::make_pair(i, -i));
+	std::vector<std::pair<int, int>> pairs;
+	for (auto key : trace.prepop) pairs.push_back(std::make_pair(key, -key));
+	map.assign(pairs.begin(), pairs.end());
 
-	int ops = reads + writes + erases - 1;
-	writes += reads;
+	SpeedResult result;
+	std::vector<SpeedResult> thread_results;
+	thread_results.resize(size_t(num_threads));
 
 	auto task = [&](int id)
 	{
 		barrier_1++;
 		while (barrier_1 < num_threads) { }
-		if (id == 0) start_time = std::chrono::high_resolution_clock::now();
+		if (id == 0) start_time = std::chrono::steady_clock::now();
 		barrier_2++;
 		while (barrier_2 < num_threads) { }
 
-		for (int i = 0; i < iters; ++i)
+		std::vector<int> batch_keys;
+		std::vector<size_t> batch_counts(size_t(std::max(batch, 1)));
+		size_t found = 0;
+		auto& times = thread_results[size_t(id)];
+		auto& ops = trace.ops;
+		auto first = ops.size() * size_t(id) / size_t(num_threads);
+		auto last = ops.size() * size_t(id + 1) / size_t(num_threads);
+
+		for (auto i = first; i < last; ++i)
 		{
-			int action = random_uint(0, ops);
-			int val = random_uint(0, key_max);
-			if (action < reads)
-				map.count(val);
-			else if (action < writes)
-				map.insert(std::make_pair(val, -val));
+			auto& op = ops[i];
+			std::chrono::steady_clock::time_point op_start;
+			if (time_ops) op_start = std::chrono::steady_clock::now();
+			auto elapsed = [&]
+			{
+				return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - op_start).count();
+			};
+
+			if (op.type == Operation::READ && batch > 1)
+			{
+				batch_keys.clear();
+				for (; i < last && ops[i].type == Operation::READ && batch_keys.size() < batch_counts.size(); ++i) batch_keys.push_back(ops[i].key);
+				--i;
+
+				map.countMany(batch_keys.data(), batch_keys.size(), batch_counts.data());
+				if (time_ops)
+				{
+					auto ns = elapsed() / double(batch_keys.size());
+					for (size_t j = 0; j < batch_keys.size(); ++j) times.reads.add(ns);
+				}
+				for (size_t j = 0; j < batch_keys.size(); ++j) found += batch_counts[j];
+			}
+			else if (op.type == Operation::READ)
+			{
+				found += map.count(op.key);
+				if (time_ops) times.reads.add(elapsed());
+			}
+			else if (op.type == Operation::INSERT)
+			{
+				map.insert(std::make_pair(op.key, -op.key));
+				if (time_ops) times.inserts.add(elapsed());
+			}
 			else
-				map.erase(val);
+			{
+				map.erase(op.key);
+				if (time_ops) times.erases.add(elapsed());
+			}
 		}
 
+		num_found += found;
 		barrier_3++;
 		while (barrier_3 < num_threads) {}
-		if (id == 0) end_time = std::chrono::high_resolution_clock::now();
+		if (id == 0) end_time = std::chrono::steady_clock::now();
+	};
+
+	std::vector<std::thread> threads;
+
+	for (int i = 0; i < num_threads; ++i) threads.push_back(std::thread(task, i));
+	for (int i = 0; i < num_threads; ++i) threads[i].join();
+
+	result.seconds = std::chrono::duration<double>(end_time - start_time).count();
+	result.has_stats = map_stats(map, result.stats, 0);
+	for (auto& times : thread_results)
+	{
+		result.reads.merge(times.reads);
+		result.inserts.merge(times.inserts);
+		result.erases.merge(times.erases);
+	}
+
+	return result;
+}
+
+// throughput of repeated speed tests, plus per-operation times from one more timed run
+struct BenchmarkResult
+{
+	std::vector<double> ops_per_second; // one per trial
+	SpeedResult timed; // the timed run
+};
+
+/* replay trace warmups times (ignoring the results), then trials times
+ * measuring throughput, then once more timing every operation (so the clock
+ * reads don't skew the throughput trials)
+ */
+template<class T>
+BenchmarkResult benchmark_test(const Trace& trace, int num_threads, int batch, int warmups, int trials)
+{
+	BenchmarkResult result;
+
+	for (int i = 0; i < warmups; ++i) speed_test<T>(trace, num_threads, batch, false);
+	for (int i = 0; i < trials; ++i)
+	{
+		auto trial = speed_test<T>(trace, num_threads, batch, false);
+		result.ops_per_second.push_back(double(trace.ops.size()) / trial.seconds);
+	}
+	result.timed = speed_test<T>(trace, num_threads, batch, true);
+
+	return result;
+}
+
+/* the speed test for a ShardedFastMap T with num_shards shards: num_threads
+ * clients each replay their share of trace through a Batcher, which sends
+ * the map's workers batch operations at a time. the run ends once every
+ * batch has been applied. returns the seconds it took (operations complete
+ * asynchronously, so they aren't timed one by one)
+ */
+template<class T>
+double sharded_speed_test(const Trace& trace, int num_threads, size_t num_shards, int batch)
+{
+	typedef typename T::Request request_t;
+
+	std::atomic<int> barrier_1, barrier_2;
+	std::atomic<size_t> num_found {0}; // results of reads are used, so that they can't be optimized away
+
+	std::chrono::steady_clock::time_point start_time, end_time;
+
+	barrier_1 = 0; barrier_2 = 0;
+
+	T map(num_shards);
+	std::vector<std::pair<int, int>> pairs;
+	for (auto key : trace.prepop) pairs.push_back(std::make_pair(key, -key));
+	map.assign(pairs.begin(), pairs.end());
+
+	// runs on the workers
+	auto done = [&num_found](request_t* requests, size_t num_requests)
+	{
+		size_t found = 0;
+		for (size_t i = 0; i < num_requests; ++i) found += requests[i].type == request_t::FIND && requests[i].result;
+		if (found) num_found += found;
+	};
+
+	auto task = [&](int id)
+	{
+		typename T::Batcher batcher(map, size_t(std::max(batch, 1)), done);
+
+		barrier_1++;
+		while (barrier_1 < num_threads) { }
+		if (id == 0) start_time = std::chrono::steady_clock::now();
+
+		auto& ops = trace.ops;
+		auto first = ops.size() * size_t(id) / size_t(num_threads);
+		auto last = ops.size() * size_t(id + 1) / size_t(num_threads);
+
+		for (auto i = first; i < last; ++i)
+		{
+			auto& op = ops[i];
+			if (op.type == Operation::READ)
+				batcher.find(op.key);
+			else if (op.type == Operation::INSERT)
+				batcher.insert(op.key, -op.key);
+			else
+				batcher.erase(op.key);
+		}
+		batcher.wait();
+
+		barrier_2++;
+		while (barrier_2 < num_threads) {}
+		if (id == 0) end_time = std::chrono::steady_clock::now();
 	};
 
 	std::vector<std::thread> threads;
@@ -54,7 +243,919 @@ std::chrono::high_resolution_clock::rep speed_test(int key_max, int num_threads,
 	for (int i = 0; i < num_threads; ++i) threads.push_back(std::thread(task, i));
 	for (int i = 0; i < num_threads; ++i) threads[i].join();
 
-	return (end_time - start_time).count();
+	return std::chrono::duration<double>(end_time - start_time).count();
+}
+
+// throughput of trials sharded speed tests, after warmups unmeasured ones
+template<class T>
+std::vector<double> sharded_benchmark_test(const Trace& trace, int num_threads, size_t num_shards, int batch, int warmups, int trials)
+{
+	std::vector<double> ops_per_second;
+
+	for (int i = 0; i < warmups; ++i) sharded_speed_test<T>(trace, num_threads, num_shards, batch);
+	for (int i = 0; i < trials; ++i)
+		ops_per_second.push_back(double(trace.ops.size()) / sharded_speed_test<T>(trace, num_threads, num_shards, batch));
+
+	return ops_per_second;
+}
+
+// std::unordered_map with the interface the tests use, to compare against (not thread-safe)
+template<class K, class V>
+class UnorderedMapAdapter
+{
+	std::unordered_map<K, V> m_map;
+
+public:
+	size_t size() const { return m_map.size(); }
+	bool insert(const std::pair<const K, V>& pair) { return m_map.insert(pair).second; }
+	size_t erase(const K& key) { return m_map.erase(key); }
+	size_t count(const K& key) const { return m_map.count(key); }
+
+	void countMany(const K* keys, size_t num_keys, size_t* counts) const
+	{
+		for (size_t k = 0; k < num_keys; ++k) counts[k] = m_map.count(keys[k]);
+	}
+
+	template<class It>
+	void assign(It first, It last)
+	{
+		m_map.clear();
+		m_map.insert(first, last);
+	}
+
+	// rehash everything (asking for the same number of buckets would do nothing)
+	void rebuild() { m_map.rehash(m_map.bucket_count() + 1); }
+
+	// rehashes are always serial
+	void setThreadPool(ThreadPool*) {}
+};
+
+// per-operation times measured by the latency tests, in nanoseconds
+struct LatencyResult
+{
+	double mean;
+	double p999; // 99.9th percentile
+	double max;
+};
+
+// mean, 99.9th percentile and maximum of times (which gets reordered)
+inline LatencyResult latency_result(std::vector<double>& times)
+{
+	LatencyResult result {0, 0, 0};
+	if (times.empty()) return result;
+
+	for (auto time : times) result.mean += time / double(times.size());
+	auto p999 = times.begin() + std::ptrdiff_t(times.size() * 999 / 1000);
+	std::nth_element(times.begin(), p999, times.end());
+	result.p999 = *p999;
+	result.max = *std::max_element(p999, times.end());
+
+	return result;
+}
+
+// time each of iters random operations on a single thread, after calling setup on the (empty) map
+template<class T, class Setup>
+LatencyResult latency_test(int key_max, int iters, int reads, int writes, int erases, int prepop, Setup setup)
+{
+	T map;
+	setup(map);
+	std::vector<std::pair<int, int>> pairs;
+	for (int i = 0; i < prepop && i <= key_max; ++i) pairs.push_back(std::make_pair(i, -i));
+	map.assign(pairs.begin(), pairs.end());
+
+	int ops = reads + writes + erases - 1;
+	writes += reads;
+
+	std::vector<double> times;
+	times.reserve(size_t(iters));
+	for (int i = 0; i < iters; ++i)
+	{
+		int action = random_uint(0, ops);
+		int val = random_uint(0, key_max);
+
+		auto start_time = std::chrono::steady_clock::now();
+		if (action < reads)
+			map.count(val);
+		else if (action < writes)
+			map.insert(std::make_pair(val, -val));
+		else
+			map.erase(val);
+		auto end_time = std::chrono::steady_clock::now();
+
+		times.push_back(std::chrono::duration<double, std::nano>(end_time - start_time).count());
+	}
+
+	return latency_result(times);
+}
+
+/* time each read of num_threads - 1 reader threads, doing iters reads in total,
+ * while one more thread keeps inserting and erasing random keys (so the map
+ * keeps rebuilding underneath the readers)
+ */
+template<class T>
+LatencyResult read_latency_test(int key_max, int num_threads, int iters, int prepop)
+{
+	T map;
+	std::vector<std::pair<int, int>> pairs;
+	for (int i = 0; i < prepop && i <= key_max; ++i) pairs.push_back(std::make_pair(i, -i));
+	map.assign(pairs.begin(), pairs.end());
+
+	int num_readers = std::max(1, num_threads - 1);
+	std::atomic<int> readers_done {0};
+	std::atomic<size_t> num_found {0};
+	std::vector<std::vector<double>> reader_times;
+	reader_times.resize(size_t(num_readers));
+
+	std::thread writer([&]
+	{
+		while (readers_done < num_readers)
+		{
+			int val = random_uint(0, key_max);
+			map.insert(std::make_pair(val, -val));
+			map.erase(random_uint(0, key_max));
+		}
+	});
+
+	std::vector<std::thread> readers;
+	for (int id = 0; id < num_readers; ++id)
+	{
+		readers.push_back(std::thread([&, id]
+		{
+			auto& times = reader_times[size_t(id)];
+			int reader_iters = iters / num_readers + (id < iters % num_readers);
+			times.reserve(size_t(reader_iters));
+			size_t found = 0;
+			for (int i = 0; i < reader_iters; ++i)
+			{
+				int val = random_uint(0, key_max);
+
+				auto start_time = std::chrono::steady_clock::now();
+				found += map.count(val);
+				auto end_time = std::chrono::steady_clock::now();
+
+				times.push_back(std::chrono::duration<double, std::nano>(end_time - start_time).count());
+			}
+			num_found += found;
+			++readers_done;
+		}));
+	}
+
+	for (auto& reader : readers) reader.join();
+	writer.join();
+
+	std::vector<double> times;
+	for (auto& t : reader_times) times.insert(times.end(), t.begin(), t.end());
+	return latency_result(times);
+}
+
+// std::shared_timed_mutex (std::shared_mutex is C++17) with the RWMutex interface, for lock_test
+struct SharedTimedMutex
+{
+	std::shared_timed_mutex mutex;
+	void lock_read() { mutex.lock_shared(); }
+	void unlock_read() { mutex.unlock_shared(); }
+	void lock_write() { mutex.lock(); }
+	void unlock_write() { mutex.unlock(); }
+};
+
+/* ns per critical section when num_threads threads each run iters critical
+ * sections under mutex, reads : writes of them shared (reading a few shared
+ * words) and the rest unique (incrementing them)
+ */
+template<class Mutex>
+double lock_test(Mutex& mutex, int num_threads, int iters, int reads, int writes)
+{
+	const size_t num_words = 8;
+	std::vector<size_t> words(num_words);
+	std::atomic<size_t> sink {0};
+	auto total = unsigned(std::max(1, reads + writes));
+
+	auto task = [&](unsigned seed)
+	{
+		size_t sum = 0;
+		unsigned x = seed * 2654435761u + 1;
+		for (int i = 0; i < iters; ++i)
+		{
+			// a cheap generator, so that it doesn't dominate the critical sections
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			if (x % total < unsigned(reads))
+			{
+				mutex.lock_read();
+				for (auto word : words) sum += word;
+				mutex.unlock_read();
+			}
+			else
+			{
+				mutex.lock_write();
+				for (auto& word : words) ++word;
+				mutex.unlock_write();
+			}
+		}
+		sink += sum;
+	};
+
+	auto start_time = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (int i = 0; i < num_threads; ++i) threads.push_back(std::thread(task, unsigned(i)));
+	for (auto& thread : threads) thread.join();
+	auto end_time = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double, std::nano>(end_time - start_time).count() / (double(iters) * num_threads);
+}
+
+// averages over the rebuilds timed by rebuild_test
+struct RebuildResult
+{
+	double seconds; // time per full rebuild
+	double balanced_attempts; // top-level hashes tried per rebuild
+	double subtable_searches; // subtable rebuilds per full rebuild
+	double subtable_attempts; // subtable hashes tried per subtable rebuild
+};
+
+// num_pairs pairs with random (not necessarily distinct) keys
+inline std::vector<std::pair<int, int>> random_pairs(int num_pairs)
+{
+	std::vector<std::pair<int, int>> pairs;
+	for (int i = 0; i < num_pairs; ++i)
+	{
+		int key = int(random_uint(0, std::numeric_limits<int>::max()));
+		pairs.push_back(std::make_pair(key, -key));
+	}
+	return pairs;
+}
+
+// seconds taken to fill a map from the same random pairs by inserts and by assign
+struct BulkResult
+{
+	double insert_seconds;
+	double assign_seconds;
+};
+
+// time filling a map with num_pairs random pairs, one insert at a time and
+// in one bulk assign (on pool if it isn't null)
+template<class T>
+BulkResult bulk_test(int num_pairs, ThreadPool* pool)
+{
+	auto pairs = random_pairs(num_pairs);
+	BulkResult result;
+
+	{
+		T map;
+		auto start_time = std::chrono::high_resolution_clock::now();
+		for (auto& pair : pairs) map.insert(pair);
+		auto end_time = std::chrono::high_resolution_clock::now();
+		result.insert_seconds = std::chrono::duration<double>(end_time - start_time).count();
+	}
+
+	{
+		T map;
+		map.setThreadPool(pool);
+		auto start_time = std::chrono::high_resolution_clock::now();
+		map.assign(pairs.begin(), pairs.end());
+		auto end_time = std::chrono::high_resolution_clock::now();
+		result.assign_seconds = std::chrono::duration<double>(end_time - start_time).count();
+	}
+
+	return result;
+}
+
+struct FreezeResult
+{
+	double freeze_seconds;
+	double map_lookup_ns; // mean time to look up a stored key
+	double frozen_lookup_ns;
+	double frozen_bytes_per_pair;
+};
+
+// fill a FastMap of type T with num_pairs random pairs, freeze it and compare
+// looking up every key in the map and in the frozen copy
+template <class T>
+FreezeResult freeze_test(int num_pairs)
+{
+	auto pairs = random_pairs(num_pairs);
+	T map(pairs.begin(), pairs.end());
+	FreezeResult result;
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	auto frozen = map.freeze();
+	auto end_time = std::chrono::high_resolution_clock::now();
+	result.freeze_seconds = std::chrono::duration<double>(end_time - start_time).count();
+	result.frozen_bytes_per_pair = double(frozen.memoryUsage()) / double(std::max<size_t>(1, frozen.size()));
+
+	std::vector<int> keys;
+	for (auto& pair : pairs) keys.push_back(pair.first);
+	std::shuffle(keys.begin(), keys.end(), std::mt19937(random_uint(0)));
+
+	auto time_lookups = [&](const auto& lookup_map)
+	{
+		size_t found = 0;
+		auto start_time = std::chrono::high_resolution_clock::now();
+		for (auto key : keys) found += lookup_map.count(key);
+		auto end_time = std::chrono::high_resolution_clock::now();
+
+		if (found != keys.size()) throw std::logic_error("freeze_test: stored key not found");
+		return std::chrono::duration<double, std::nano>(end_time - start_time).count() / double(std::max<size_t>(1, keys.size()));
+	};
+	result.map_lookup_ns = time_lookups(map);
+	result.frozen_lookup_ns = time_lookups(frozen);
+
+	return result;
+}
+
+// the shape of a map after mass deletes and the cost of churning it (see shrink_test)
+struct ShrinkResult
+{
+	size_t full_subtables;    // size of the top-level table when full
+	size_t emptied_subtables; // and after erasing every pair
+	double churn_ns;          // mean time per insert or erase of one key in the emptied map
+	double hinted_churn_ns;   // same, in a new map hinted to hold the pairs
+};
+
+/* fill a FastMap of type T with num_pairs keys and erase them all, checking
+ * that the emptied map isn't left oversized. then time inserting and erasing
+ * a key over and over in it and in a new map hinted to hold num_pairs pairs,
+ * which should keep its tables without rebuilding
+ */
+template <class T>
+ShrinkResult shrink_test(int num_pairs)
+{
+	const int churn = 2000;
+	ShrinkResult result;
+
+	auto time_churn = [&](T& map)
+	{
+		auto start_time = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < churn; ++i)
+		{
+			map.insert(std::make_pair(i, i));
+			map.erase(i);
+		}
+		auto end_time = std::chrono::high_resolution_clock::now();
+		return std::chrono::duration<double, std::nano>(end_time - start_time).count() / double(2 * churn);
+	};
+
+	T map;
+	for (int i = 0; i < num_pairs; ++i) map.insert(std::make_pair(i, i));
+	result.full_subtables = map.stats().num_subtables;
+	for (int i = 0; i < num_pairs; ++i) map.erase(i);
+	auto emptied = map.stats();
+	result.emptied_subtables = emptied.num_subtables;
+	if (emptied.threshold > T().stats().threshold * T::SHRINK_SLACK) throw std::logic_error("shrink_test: emptied map is oversized");
+	result.churn_ns = time_churn(map);
+
+	T hinted(size_t(std::max(0, num_pairs)));
+	auto before = hinted.stats();
+	result.hinted_churn_ns = time_churn(hinted);
+	auto after = hinted.stats();
+	if (before.threshold > size_t(2 * churn) && (after.threshold != before.threshold || after.num_operations != size_t(2 * churn)))
+		throw std::logic_error("shrink_test: hinted map rebuilt before reaching its threshold");
+
+	return result;
+}
+
+struct ScanResult
+{
+	double scan_ns;          // per pair, scanning with forEach
+	double parallel_scan_ns; // per pair, scanning with parallelForEach
+};
+
+// fill a map of type T with num_pairs random pairs and time checksumming
+// every pair with forEach and with parallelForEach on pool
+template <class T>
+ScanResult scan_test(int num_pairs, ThreadPool& pool)
+{
+	// distinct keys, so the sum of the pairs is known
+	auto pairs = random_pairs(num_pairs);
+	std::sort(pairs.begin(), pairs.end());
+	pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+	T map;
+	map.assign(pairs.begin(), pairs.end());
+
+	auto time_scan = [&](auto scan)
+	{
+		std::atomic<uint64_t> checksum {0};
+		auto start_time = std::chrono::high_resolution_clock::now();
+		scan(checksum);
+		auto end_time = std::chrono::high_resolution_clock::now();
+
+		uint64_t expected = 0;
+		for (auto& pair : pairs) expected += uint64_t(pair.first) * 31 + uint64_t(pair.second);
+		if (checksum != expected) throw std::logic_error("scan_test: scan missed or repeated pairs");
+		return std::chrono::duration<double, std::nano>(end_time - start_time).count() / double(std::max<size_t>(1, pairs.size()));
+	};
+
+	ScanResult result;
+	result.scan_ns = time_scan([&](std::atomic<uint64_t>& checksum)
+	{
+		uint64_t sum = 0;
+		map.forEach([&](const std::pair<const int, int>& pair) { sum += uint64_t(pair.first) * 31 + uint64_t(pair.second); });
+		checksum = sum;
+	});
+	result.parallel_scan_ns = time_scan([&](std::atomic<uint64_t>& checksum)
+	{
+		// each thread sums into its own cache line (give or take), so the threads don't contend
+		struct sum_t
+		{
+			std::atomic<uint64_t> value {0};
+			char padding[64 - sizeof(std::atomic<uint64_t>)];
+		};
+		static const size_t NUM_SUMS = 256;
+		static std::atomic<size_t> next_sum {0};
+		std::unique_ptr<sum_t[]> sums(new sum_t[NUM_SUMS]);
+
+		map.parallelForEach(pool, [&](const std::pair<const int, int>& pair)
+		{
+			thread_local size_t sum = next_sum++ % NUM_SUMS;
+			sums[sum].value.fetch_add(uint64_t(pair.first) * 31 + uint64_t(pair.second), std::memory_order_relaxed);
+		});
+		for (size_t i = 0; i < NUM_SUMS; ++i) checksum += sums[i].value;
+	});
+
+	return result;
+}
+
+struct StringResult
+{
+	double insert_ns;       // per insert, filling the map
+	double hit_ns;          // per lookup of a stored key
+	double miss_ns;         // per lookup of a missing key
+	double rebuild_seconds; // per full rebuild
+};
+
+// num_keys distinct random strings of 32 characters, sharing a long prefix as
+// URLs and paths do, so comparing two of them has to read most of their bytes
+inline std::vector<std::string> random_strings(int num_keys)
+{
+	std::vector<std::string> keys;
+	std::unordered_set<std::string> used;
+	while (keys.size() < size_t(std::max(0, num_keys)))
+	{
+		char digits[17];
+		std::snprintf(digits, sizeof(digits), "%016llx", static_cast<unsigned long long>(random_uint64()));
+		std::string key = std::string("/users/profile/") + digits + "/";
+		if (used.insert(key).second) keys.push_back(key);
+	}
+	return keys;
+}
+
+// time filling a map of type T (keyed by std::string) with num_keys random
+// strings, looking up each of them and as many missing ones, and rebuilding it
+template <class T>
+StringResult string_test(int num_keys)
+{
+	auto keys = random_strings(2 * num_keys);
+	std::vector<std::string> missing(keys.begin() + num_keys, keys.end());
+	keys.resize(size_t(num_keys));
+	auto per_key = [&](double seconds) { return seconds * 1e9 / double(std::max(1, num_keys)); };
+
+	auto time = [](auto f)
+	{
+		auto start_time = std::chrono::high_resolution_clock::now();
+		f();
+		auto end_time = std::chrono::high_resolution_clock::now();
+		return std::chrono::duration<double>(end_time - start_time).count();
+	};
+
+	StringResult result;
+	T map;
+	result.insert_ns = per_key(time([&] { for (size_t i = 0; i < keys.size(); ++i) map.insert(std::make_pair(keys[i], int(i))); }));
+
+	// look keys up in a different order than they were inserted
+	std::shuffle(keys.begin(), keys.end(), std::mt19937(1));
+	size_t found = 0;
+	result.hit_ns = per_key(time([&] { for (auto& key : keys) found += map.count(key); }));
+	result.miss_ns = per_key(time([&] { for (auto& key : missing) found += map.count(key); }));
+	if (found != keys.size()) throw std::logic_error("string_test: wrong lookup result");
+
+	const int NUM_REBUILDS = 3;
+	result.rebuild_seconds = time([&] { for (int i = 0; i < NUM_REBUILDS; ++i) map.rebuild(); }) / NUM_REBUILDS;
+
+	return result;
+}
+
+/* a key whose std::hash, and so its hash input (see pre_hash.h), is shared by
+ * the first RUN ids of every STRIDE, which no hash function can separate. the
+ * other ids have inputs of their own. maps only stay balanced if few keys
+ * share inputs, as the subtables holding them are costed like any other
+ */
+struct CollidingKey
+{
+	static const uint64_t RUN = 2;
+	static const uint64_t STRIDE = 64;
+	uint64_t id;
+
+	bool operator==(const CollidingKey& other) const
+	{
+		return id == other.id;
+	}
+};
+
+namespace std
+{
+template <>
+struct hash<CollidingKey>
+{
+	size_t operator()(const CollidingKey& key) const
+	{
+		return size_t(key.id % CollidingKey::STRIDE < CollidingKey::RUN ? ~(key.id / CollidingKey::STRIDE) : key.id);
+	}
+};
+}
+
+struct CollisionResult
+{
+	double insert_ns;     // per insert, filling the map
+	double hit_ns;        // per lookup of a stored key
+	double frozen_hit_ns; // the same in a frozen copy of the map
+};
+
+/* fill a FastMap of type T, keyed by CollidingKey, with num_keys keys, some
+ * of which share hash inputs. check that lookups find exactly the stored keys
+ * after the inserts, after erasing every other key, after putting them back,
+ * after a rebuild and in a frozen copy, and time the inserts and lookups.
+ * then do the same with a single subtable of type Subtable, which holds
+ * enough keys to need a hash for them unless it can't find one
+ */
+template <class T, class Subtable>
+CollisionResult collision_test(int num_keys)
+{
+	auto num = size_t(std::max(0, num_keys));
+	auto per_key = [&](double seconds) { return seconds * 1e9 / double(std::max<size_t>(1, num)); };
+
+	auto time = [](auto f)
+	{
+		auto start_time = std::chrono::high_resolution_clock::now();
+		f();
+		auto end_time = std::chrono::high_resolution_clock::now();
+		return std::chrono::duration<double>(end_time - start_time).count();
+	};
+
+	// keys [0, end) are stored, except odd ones unless odd_stored. the stride after them is missing
+	auto check = [](const auto& map, size_t end, bool odd_stored, const char* when)
+	{
+		for (uint64_t id = 0; id < end + CollidingKey::STRIDE; ++id)
+		{
+			CollidingKey key {id};
+			bool stored = id < end && (odd_stored || id % 2 == 0);
+			if (map.count(key) != size_t(stored) || (stored && map.at(key) != int(id)))
+				throw std::logic_error(std::string("collision_test: wrong lookup result ") + when);
+		}
+	};
+
+	CollisionResult result;
+	T map;
+	result.insert_ns = per_key(time([&] { for (uint64_t id = 0; id < num; ++id) map.insert(std::make_pair(CollidingKey {id}, int(id))); }));
+	if (map.size() != num) throw std::logic_error("collision_test: keys were lost");
+
+	size_t found = 0;
+	result.hit_ns = per_key(time([&] { for (uint64_t id = 0; id < num; ++id) found += map.count(CollidingKey {id}); }));
+	if (found != num) throw std::logic_error("collision_test: stored key not found");
+	check(map, num, true, "after inserting");
+
+	for (uint64_t id = 1; id < num; id += 2) map.erase(CollidingKey {id});
+	check(map, num, false, "after erasing");
+
+	for (uint64_t id = 1; id < num; id += 2) map[CollidingKey {id}] = int(id);
+	check(map, num, true, "after inserting again");
+
+	map.rebuild();
+	check(map, num, true, "after rebuilding");
+
+	auto frozen = map.freeze();
+	found = 0;
+	result.frozen_hit_ns = per_key(time([&] { for (uint64_t id = 0; id < num; ++id) found += frozen.count(CollidingKey {id}); }));
+	if (found != num) throw std::logic_error("collision_test: stored key not found in frozen map");
+	check(frozen, num, true, "in frozen map");
+
+	// a subtable of a few strides, holding a run of each
+	const size_t SUBTABLE_KEYS = 4 * CollidingKey::STRIDE;
+	Subtable subtable;
+	for (uint64_t id = 0; id < SUBTABLE_KEYS; ++id) subtable.insert(std::make_pair(CollidingKey {id}, int(id)));
+	check(subtable, SUBTABLE_KEYS, true, "in subtable");
+	// no hash separates the runs, so the subtable scans its pairs, in one slot each
+	if (subtable.bucketCount() != subtable.capacity()) throw std::logic_error("collision_test: subtable hashed keys with equal inputs");
+
+	for (uint64_t id = 1; id < SUBTABLE_KEYS; id += 2) subtable.erase(CollidingKey {id});
+	check(subtable, SUBTABLE_KEYS, false, "in subtable after erasing");
+
+	subtable.shrinkToFit();
+	for (uint64_t id = 1; id < SUBTABLE_KEYS; id += 2) subtable.insert(std::make_pair(CollidingKey {id}, int(id)));
+	check(subtable, SUBTABLE_KEYS, true, "in subtable after inserting again");
+
+	return result;
+}
+
+// allocations made through FailingAllocator (of any type) that are still live, and the one to fail
+struct AllocationFailures
+{
+	std::atomic<long> live {0};
+	std::atomic<long> countdown {0}; // allocations until one throws std::bad_alloc (counting it), or 0 for none
+
+	static AllocationFailures& get()
+	{
+		static AllocationFailures failures;
+		return failures;
+	}
+};
+
+// std::allocator, but counted and failing when AllocationFailures says so (see failure_test)
+template <class T>
+struct FailingAllocator
+{
+	typedef T value_type;
+
+	FailingAllocator() = default;
+
+	template <class U>
+	FailingAllocator(const FailingAllocator<U>&)
+	{
+	}
+
+	T* allocate(size_t n)
+	{
+		auto& failures = AllocationFailures::get();
+		if (failures.countdown.load() > 0 && failures.countdown.fetch_sub(1) == 1) throw std::bad_alloc();
+
+		auto p = std::allocator<T>().allocate(n);
+		++failures.live;
+		return p;
+	}
+
+	void deallocate(T* p, size_t n)
+	{
+		--AllocationFailures::get().live;
+		std::allocator<T>().deallocate(p, n);
+	}
+
+	template <class U>
+	bool operator==(const FailingAllocator<U>&) const
+	{
+		return true;
+	}
+
+	template <class U>
+	bool operator!=(const FailingAllocator<U>&) const
+	{
+		return false;
+	}
+};
+
+struct FailureResult
+{
+	size_t failures; // allocations that threw
+	size_t kept;     // pairs the map still held after them, of the keys inserted so far
+};
+
+/* fill a FastMap of type T, whose allocator is a FailingAllocator, with
+ * num_keys int keys while every 13th allocation fails, then insert them all
+ * again and rebuild with failures, on one thread and on pool. the map has to
+ * stay consistent (its size, lookups and scans agreeing) after every failure,
+ * hold every key once nothing fails, and free everything it allocated. then
+ * check that a subtable of type Subtable, whose hash family can't reach the
+ * range of a much larger table, keeps its pairs when growing to it fails
+ */
+template <class T, class Subtable>
+FailureResult failure_test(int num_keys, ThreadPool& pool)
+{
+	const long PERIOD = 13;
+	auto& failures = AllocationFailures::get();
+	auto num = std::max(0, num_keys);
+
+	auto check = [](const auto& map, const char* when)
+	{
+		size_t num_pairs = 0;
+		bool found = true;
+		map.forEach([&](const std::pair<const int, int>& pair)
+		{
+			++num_pairs;
+			found = found && map.count(pair.first) && map.at(pair.first) == pair.second;
+		});
+		if (num_pairs != map.size() || !found) throw std::logic_error(std::string("failure_test: inconsistent map ") + when);
+	};
+
+	FailureResult result {0, 0};
+	{
+		T map;
+		for (auto threads : {0, 1})
+		{
+			map.setThreadPool(threads ? &pool : nullptr);
+
+			failures.countdown = PERIOD;
+			for (int id = 0; id < num; ++id)
+			{
+				try
+				{
+					map.insert(std::make_pair(id, id));
+				}
+				catch (const std::bad_alloc&)
+				{
+					++result.failures;
+					failures.countdown = PERIOD;
+					check(map, "after a failed insert");
+				}
+			}
+			if (!threads) result.kept = map.size();
+
+			for (int attempt = 0; attempt < 4; ++attempt)
+			{
+				failures.countdown = 1 + attempt * PERIOD / 4;
+				try
+				{
+					map.rebuild();
+				}
+				catch (const std::bad_alloc&)
+				{
+					++result.failures;
+					check(map, "after a failed rebuild");
+				}
+			}
+
+			failures.countdown = 0;
+			for (int id = 0; id < num; ++id) map.insert(std::make_pair(id, id));
+			check(map, "after inserting again");
+			if (map.size() != size_t(num)) throw std::logic_error("failure_test: keys were lost without a failure");
+		}
+	}
+	if (failures.live != 0) throw std::logic_error("failure_test: the map leaked memory");
+
+	{
+		const int SUBTABLE_KEYS = 100;
+		Subtable subtable;
+		for (int id = 0; id < SUBTABLE_KEYS; ++id) subtable.insert(std::make_pair(id, id));
+
+		bool failed = false;
+		try
+		{
+			subtable.reserve(size_t(1) << 20);
+		}
+		catch (const std::out_of_range&)
+		{
+			failed = true;
+		}
+		check(subtable, "after failing to grow");
+		if (!failed || subtable.size() != size_t(SUBTABLE_KEYS)) throw std::logic_error("failure_test: a subtable that couldn't grow lost pairs");
+
+		subtable.insert(std::make_pair(SUBTABLE_KEYS, SUBTABLE_KEYS));
+		check(subtable, "after inserting into it");
+	}
+	if (failures.live != 0) throw std::logic_error("failure_test: the subtable leaked memory");
+
+	return result;
+}
+
+// the state of the stress test after each checkpoint (see stress_test)
+struct StressResult
+{
+	size_t num_pairs;
+	size_t global_rebuilds;      // so far
+	double attempts_per_rebuild; // top-level hashes tried per global rebuild, so far
+	size_t subtable_rebuilds;    // subtable hash searches, so far
+	size_t top_level_buckets;    // size of the top-level table
+	double bytes_per_pair;       // subtable slots and top-level table
+	double insert_ns;            // mean time per insert since the last checkpoint
+	double max_insert_ms;        // slowest insert since the last checkpoint (a global rebuild)
+};
+
+/* insert num_pairs distinct keys (mixed indexes, so they look random) one at
+ * a time into a FastMap of type T with uint64_t keys, hashing with Hash.
+ * calls checkpoint with a StressResult at every power of two from 2^16 on
+ * and at the end. global rebuilds should grow with the logarithm of the
+ * number of pairs and each should take about as many attempts as the last
+ */
+template <class T, class Hash, class Checkpoint>
+void stress_test(size_t num_pairs, Checkpoint checkpoint)
+{
+	typedef HashSearch<Hash> search_t;
+	auto balanced = search_t::balancedCounters();
+	auto collision_free = search_t::collisionFreeCounters();
+
+	T map;
+	size_t next_checkpoint = size_t(1) << 16;
+	size_t last_checkpoint = 0;
+	double seconds = 0;
+	double max_seconds = 0;
+
+	for (size_t i = 0; i < num_pairs; ++i)
+	{
+		auto start_time = std::chrono::high_resolution_clock::now();
+		map.insert(std::make_pair(uint64_t(mix64(i)), uint64_t(i)));
+		auto insert_seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start_time).count();
+		seconds += insert_seconds;
+		max_seconds = std::max(max_seconds, insert_seconds);
+
+		if (i + 1 != next_checkpoint && i + 1 != num_pairs) continue;
+
+		auto rebuilds = search_t::balancedCounters().searches - balanced.searches;
+		auto stats = map.stats();
+
+		StressResult result;
+		result.num_pairs = map.size();
+		result.global_rebuilds = rebuilds;
+		result.attempts_per_rebuild = rebuilds ? double(search_t::balancedCounters().attempts - balanced.attempts) / double(rebuilds) : 0;
+		result.subtable_rebuilds = search_t::collisionFreeCounters().searches - collision_free.searches;
+		result.top_level_buckets = stats.num_subtables;
+		result.bytes_per_pair = double(stats.slot_bytes + stats.num_subtables * sizeof(void*)) / double(map.size());
+		result.insert_ns = seconds * 1e9 / double(i + 1 - last_checkpoint);
+		result.max_insert_ms = max_seconds * 1e3;
+		checkpoint(result);
+
+		last_checkpoint = i + 1;
+		next_checkpoint *= 2;
+		seconds = max_seconds = 0;
+	}
+
+	if (map.size() != num_pairs) throw std::logic_error("stress_test: keys were lost");
+}
+
+struct SnapshotResult
+{
+	double assign_seconds; // to build the map from its pairs, for comparison
+	double save_seconds;
+	double open_seconds;
+	double lookup_ns; // mean time to look up a stored key in the opened map
+};
+
+// fill a FastMap of type T with num_pairs random pairs, save a snapshot of
+// it at path and time opening it again against building it from scratch
+template <class T>
+SnapshotResult snapshot_test(int num_pairs, const std::string& path)
+{
+	auto pairs = random_pairs(num_pairs);
+	SnapshotResult result;
+
+	auto time = [](auto f)
+	{
+		auto start_time = std::chrono::high_resolution_clock::now();
+		f();
+		auto end_time = std::chrono::high_resolution_clock::now();
+		return std::chrono::duration<double>(end_time - start_time).count();
+	};
+
+	T map;
+	result.assign_seconds = time([&] { map.assign(pairs.begin(), pairs.end()); });
+	result.save_seconds = time([&] { map.save(path); });
+
+	T opened;
+	result.open_seconds = time([&] { opened.open(path); });
+
+	size_t found = 0;
+	auto lookup_seconds = time([&] { for (auto& pair : pairs) found += opened.count(pair.first); });
+	if (found != pairs.size()) throw std::logic_error("snapshot_test: stored key not found");
+
+	// finding keys, or missing one for an update, must not copy the pairs in
+	for (auto& pair : pairs)
+	{
+		if (!opened.find(pair.first) || *opened.find(pair.first) != pair.second)
+			throw std::logic_error("snapshot_test: find returned the wrong value");
+	}
+	int missing = 0;
+	while (opened.count(missing)) ++missing;
+	if (opened.findForUpdate(missing)) throw std::logic_error("snapshot_test: missing key found for update");
+	if (opened.bucketCount() != 0) throw std::logic_error("snapshot_test: a lookup copied the snapshot in");
+	if (!pairs.empty() && *opened.findForUpdate(pairs.front().first) != pairs.front().second)
+		throw std::logic_error("snapshot_test: findForUpdate returned the wrong value");
+
+	result.lookup_ns = lookup_seconds * 1e9 / double(std::max<size_t>(1, pairs.size()));
+
+	std::remove(path.c_str());
+	return result;
+}
+
+// time num_rebuilds full rebuilds of a map (hashing with Hash) holding num_pairs pairs
+// rebuilds run on pool if it isn't null
+template<class T, class Hash>
+RebuildResult rebuild_test(int num_pairs, int num_rebuilds, ThreadPool* pool)
+{
+	// random keys, since sequential ones spread unrealistically evenly under linear hashes
+	T map;
+	auto pairs = random_pairs(num_pairs);
+	map.assign(pairs.begin(), pairs.end());
+	while (map.size() < size_t(num_pairs))
+	{
+		int key = int(random_uint(0, std::numeric_limits<int>::max()));
+		map.insert(std::make_pair(key, -key));
+	}
+
+	map.setThreadPool(pool);
+
+	typedef HashSearch<Hash> search_t;
+	auto balanced = search_t::balancedCounters();
+	auto collision_free = search_t::collisionFreeCounters();
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < num_rebuilds; ++i) map.rebuild();
+	auto end_time = std::chrono::high_resolution_clock::now();
+
+	RebuildResult result;
+	auto subtable_searches = double(search_t::collisionFreeCounters().searches - collision_free.searches);
+	result.seconds = std::chrono::duration<double>(end_time - start_time).count() / num_rebuilds;
+	result.balanced_attempts = double(search_t::balancedCounters().attempts - balanced.attempts) / num_rebuilds;
+	result.subtable_searches = subtable_searches / num_rebuilds;
+	result.subtable_attempts = subtable_searches ? double(search_t::collisionFreeCounters().attempts - collision_free.attempts) / subtable_searches : 0;
+
+	return result;
 }
 
 #endif
@@ -0,0 +1,111 @@
+#include "thread_pool.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+ThreadPool::ThreadPool(size_t num_threads)
+{
+	for (size_t i = 1; i < num_threads; ++i) m_workers.push_back(std::thread([this] { work(); }));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_start.notify_all();
+
+	for (auto& worker : m_workers) worker.join();
+}
+
+void ThreadPool::run(size_t num_tasks, const std::function<void(size_t)>& task)
+{
+	std::lock_guard<std::mutex> run_lock(m_run_mutex);
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_task = &task;
+		m_num_tasks = num_tasks;
+		m_next_task = 0;
+		m_active = m_workers.size();
+		m_error = nullptr;
+		++m_generation;
+	}
+	m_start.notify_all();
+
+	// help out, then wait for the workers to finish their last tasks
+	runTasks(task, num_tasks);
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_done.wait(lock, [this] { return m_active == 0; });
+	m_task = nullptr;
+
+	if (m_error)
+	{
+		auto error = m_error;
+		m_error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+void ThreadPool::work()
+{
+	size_t generation = 0;
+
+	while (true)
+	{
+		const std::function<void(size_t)>* task;
+		size_t num_tasks;
+
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_start.wait(lock, [&] { return m_stop || m_generation != generation; });
+			if (m_stop) return;
+
+			generation = m_generation;
+			task = m_task;
+			num_tasks = m_num_tasks;
+		}
+
+		runTasks(*task, num_tasks);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (--m_active == 0) m_done.notify_one();
+	}
+}
+
+void ThreadPool::runTasks(const std::function<void(size_t)>& task, size_t num_tasks)
+{
+	for (size_t i = m_next_task++; i < num_tasks; i = m_next_task++)
+	{
+		try
+		{
+			task(i);
+		}
+		catch (...)
+		{
+			// keep the first error and skip the remaining tasks
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!m_error) m_error = std::current_exception();
+			m_next_task = num_tasks;
+		}
+	}
+}
+
+bool pin_thread(std::thread& thread, size_t cpu)
+{
+#ifdef __linux__
+	auto num_cpus = std::max(1u, std::thread::hardware_concurrency());
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu % num_cpus, &cpus);
+	return pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus) == 0;
+#else
+	(void)thread;
+	(void)cpu;
+	return false;
+#endif
+}
@@ -0,0 +1,74 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* fixed set of worker threads for data-parallel loops. run() hands out task
+ * indices to the workers and the calling thread until all are done, so a pool
+ * of n threads starts n - 1 workers. only one run() executes at a time
+ */
+class ThreadPool
+{
+	std::vector<std::thread> m_workers;
+	std::mutex m_mutex; // guards everything below except m_next_task
+	std::mutex m_run_mutex; // serializes run()
+	std::condition_variable m_start; // signalled when a run starts or the pool stops
+	std::condition_variable m_done; // signalled when the last worker finishes a run
+	const std::function<void(size_t)>* m_task {nullptr};
+	size_t m_num_tasks {0};
+	std::atomic<size_t> m_next_task {0};
+	size_t m_generation {0}; // number of runs started, so workers can tell a new run from a spurious wakeup
+	size_t m_active {0}; // workers still in the current run
+	std::exception_ptr m_error; // first exception thrown by a task in the current run
+	bool m_stop {false};
+
+	void work(); // worker thread body
+	void runTasks(const std::function<void(size_t)>& task, size_t num_tasks);
+public:
+	// num_threads includes the thread calling run()
+	explicit ThreadPool(size_t num_threads = std::thread::hardware_concurrency());
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// number of threads taking part in a run, including the caller
+	size_t size() const
+	{
+		return m_workers.size() + 1;
+	}
+
+	// call task(i) for each i in [0, num_tasks) across the pool, returning when
+	// all calls have finished. rethrows the first exception thrown by a task
+	void run(size_t num_tasks, const std::function<void(size_t)>& task);
+
+	// split [0, n) into contiguous chunks and call f(begin, end) on each across the pool
+	template <class F>
+	void forRange(size_t n, F f)
+	{
+		// a few chunks per thread evens out chunks that take longer than others
+		size_t num_chunks = std::min(n, 4 * size());
+		if (num_chunks <= 1)
+		{
+			if (n) f(size_t(0), n);
+			return;
+		}
+
+		run(num_chunks, [&](size_t chunk)
+		{
+			f(n * chunk / num_chunks, n * (chunk + 1) / num_chunks);
+		});
+	}
+};
+
+// bind thread to run only on cpu (modulo the number of cpus). returns false where that isn't supported
+bool pin_thread(std::thread& thread, size_t cpu);
+
+#endif
@@ -0,0 +1,457 @@
+#ifndef UNIVERSAL_HASH_H
+#define UNIVERSAL_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "pre_hash.h"
+#include "random_utils.h"
+
+#if defined(__GNUG__) && defined(__x86_64__)
+#define UNIVERSAL_HASH_X86
+#include <immintrin.h>
+#endif
+
+/* universal hash families for the Hash policy of FastLookupMap and FastMap.
+ * an object of a family is one member of it: it holds its coefficients and
+ * maps keys onto [0, range()), reading only their low INPUT_BITS bits.
+ * seed(range) re-seeds it as a random member onto [0, range).
+ * default-constructed objects map every key to 0 until seeded. keys are the
+ * hash inputs of the maps' keys (see pre_hash.h)
+ */
+
+/* a prime just above 2^32, so that distinct 32-bit keys stay distinct mod p.
+ * with a smaller prime, keys k and k + p (e.g. k and k + p - 2^32 as a
+ * negative int) collide under every member of the family, and the search for
+ * a collision-free hash of a subtable holding both never ends
+ */
+static const uint64_t HASH_PRIME = (uint64_t(1) << 32) + 15;
+
+// ((a * key + b) % p) % range for 32-bit keys, p = HASH_PRIME
+class ModPrimeHash
+{
+public:
+	static const uint64_t MAX_RANGE = HASH_PRIME;
+	static const unsigned int INPUT_BITS = 32;
+
+	ModPrimeHash() = default;
+
+	explicit ModPrimeHash(size_t range)
+	{
+		seed(range);
+	}
+
+	void seed(size_t range)
+	{
+		if (MAX_RANGE < range) throw std::out_of_range("ModPrimeHash requested range is larger than HASH_PRIME");
+
+		m_range = range;
+		m_a = random_uint64(1, HASH_PRIME - 1);
+		m_b = random_uint64(0, HASH_PRIME - 1);
+	}
+
+	size_t operator()(uint64_t key) const
+	{
+		uint64_t x = uint32_t(key);
+		// a * key may not fit in 64 bits, but a < 2^33, so split off its top bit
+		uint64_t h = ((m_a & 0xffffffff) * x + m_b) % HASH_PRIME;
+		if (m_a >> 32) h += (x << 32) % HASH_PRIME;
+		return size_t((h % HASH_PRIME) % m_range);
+	}
+
+	size_t range() const
+	{
+		return m_range;
+	}
+
+private:
+	uint64_t m_a {0};
+	uint64_t m_b {0};
+	uint64_t m_range {1};
+};
+
+// multiply-add-shift over the two 32-bit halves of the key:
+// ((a1 * lo + a2 * hi + b) >> 32) scaled onto range with a multiply instead of a division
+class MultiplyShiftHash
+{
+public:
+	static const uint64_t MAX_RANGE = uint64_t(1) << 32;
+	static const unsigned int INPUT_BITS = 64;
+
+	MultiplyShiftHash() = default;
+
+	explicit MultiplyShiftHash(size_t range)
+	{
+		seed(range);
+	}
+
+	void seed(size_t range)
+	{
+		if (MAX_RANGE < range) throw std::out_of_range("MultiplyShiftHash requested range is larger than 2^32");
+
+		m_range = range;
+		m_a1 = random_uint64();
+		m_a2 = random_uint64();
+		m_b = random_uint64();
+	}
+
+	size_t operator()(uint64_t key) const
+	{
+		uint64_t h = (m_a1 * uint32_t(key) + m_a2 * uint32_t(key >> 32) + m_b) >> 32;
+		return size_t((h * m_range) >> 32);
+	}
+
+	size_t range() const
+	{
+		return m_range;
+	}
+
+private:
+	uint64_t m_a1 {0};
+	uint64_t m_a2 {0};
+	uint64_t m_b {0};
+	uint64_t m_range {1};
+};
+
+// h * range / 2^61 for h < 2^61 and range <= 2^61: h, a hash mod 2^61 - 1, scaled onto range
+inline size_t scale_wide(uint64_t h, uint64_t range)
+{
+#ifdef __SIZEOF_INT128__
+	return size_t(((unsigned __int128)h * range) >> 61);
+#else
+	// the same from 32-bit halves: h * range = (h_hi * 2^32 + h_lo) * (r_hi * 2^32 + r_lo)
+	uint64_t h_lo = h & 0xffffffff, h_hi = h >> 32;
+	uint64_t r_lo = range & 0xffffffff, r_hi = range >> 32;
+	uint64_t mid = h_hi * r_lo + ((h_lo * r_lo) >> 32) + ((h_lo * r_hi) & 0xffffffff); // < 2^62
+	uint64_t hi = h_hi * r_hi + ((h_lo * r_hi) >> 32) + (mid >> 32);
+	return size_t((hi << 3) | ((mid & 0xffffffff) >> 29));
+#endif
+}
+
+/* ((a * key + b) mod p) for 32-bit keys, p = 2^61 - 1, scaled onto range by
+ * its top 32 bits with a multiply. reducing mod a Mersenne prime takes shifts
+ * and adds instead of a division, and splitting a into 32-bit halves keeps
+ * every multiply 32 x 32 bits, so hashMany can hash 2 (SSE2) or 4 (AVX2) keys
+ * per instruction. keys are below p, so (a * key + b) mod p is universal as
+ * usual, and the scaling keeps the chance of two keys colliding at most
+ * 1 / range + 2^-32. ranges of 2^32 or more (top-level tables of more than
+ * about 477 million pairs) are scaled from all 61 bits instead, one key at a
+ * time
+ */
+class MersenneHash
+{
+	static const uint64_t PRIME = (uint64_t(1) << 61) - 1;
+
+public:
+	static const uint64_t MAX_RANGE = uint64_t(1) << 48;
+	static const unsigned int INPUT_BITS = 32;
+
+	MersenneHash() = default;
+
+	explicit MersenneHash(size_t range)
+	{
+		seed(range);
+	}
+
+	void seed(size_t range)
+	{
+		if (MAX_RANGE < range) throw std::out_of_range("MersenneHash requested range is larger than 2^48");
+
+		m_range = range;
+		do m_a = random_uint64() >> 3; while (m_a == 0 || m_a >= PRIME);
+		do m_b = random_uint64() >> 3; while (m_b >= PRIME);
+	}
+
+	size_t operator()(uint64_t key) const
+	{
+		uint64_t x = uint32_t(key);
+#ifdef __SIZEOF_INT128__
+		// a * key + b < 2^93, fold it mod p (2^61 = 1 mod p)
+		auto y = (unsigned __int128)m_a * x + m_b;
+		uint64_t h = (uint64_t(y) & PRIME) + uint64_t(y >> 61);
+#else
+		uint64_t lo = (m_a & 0xffffffff) * x; // < 2^64
+		uint64_t hi = (m_a >> 32) * x; // < 2^61, stands for hi * 2^32
+
+		// fold each product mod p (2^61 = 1 mod p) and add them up, < 2^63
+		uint64_t h = (lo & PRIME) + (lo >> 61) + ((hi << 32) & PRIME) + (hi >> 29) + m_b;
+		h = (h & PRIME) + (h >> 61);
+#endif
+		h = (h + ((h + 1) >> 61)) & PRIME; // subtract p if h >= p
+
+		if (m_range >> 32) return scale_wide(h, m_range);
+		return size_t(((h >> 29) * m_range) >> 32);
+	}
+
+	// out[i] = (*this)(keys[i]) for each of the n keys
+	void hashMany(const uint64_t* keys, size_t n, size_t* out) const
+	{
+		size_t i = 0;
+#ifdef UNIVERSAL_HASH_X86
+		static_assert(sizeof(size_t) == sizeof(uint64_t), "hashMany stores hashes as 64-bit lanes");
+		// the vector code scales with 32 x 32-bit multiplies
+		if (!(m_range >> 32))
+		{
+#ifdef __AVX2__
+			i = hashManyAvx2(keys, n, out);
+#else
+			i = hasAvx2() ? hashManyAvx2(keys, n, out) : hashManySse2(keys, n, out);
+#endif
+		}
+#endif
+		for (; i < n; ++i) out[i] = (*this)(keys[i]);
+	}
+
+	size_t range() const
+	{
+		return m_range;
+	}
+
+private:
+#ifdef UNIVERSAL_HASH_X86
+	static bool hasAvx2()
+	{
+		static const bool has_avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+		return has_avx2;
+	}
+
+	// the same steps as operator() on 2 keys at a time. returns how many keys were hashed
+	size_t hashManySse2(const uint64_t* keys, size_t n, size_t* out) const
+	{
+		const __m128i prime = _mm_set1_epi64x(int64_t(PRIME));
+		const __m128i one = _mm_set1_epi64x(1);
+		const __m128i a_lo = _mm_set1_epi64x(int64_t(m_a & 0xffffffff));
+		const __m128i a_hi = _mm_set1_epi64x(int64_t(m_a >> 32));
+		const __m128i b = _mm_set1_epi64x(int64_t(m_b));
+		const __m128i range = _mm_set1_epi64x(int64_t(m_range));
+
+		size_t i = 0;
+		for (; i + 2 <= n; i += 2)
+		{
+			// _mm_mul_epu32 only reads the low 32 bits of each key
+			__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+			__m128i lo = _mm_mul_epu32(x, a_lo);
+			__m128i hi = _mm_mul_epu32(x, a_hi);
+
+			__m128i h = _mm_add_epi64(_mm_and_si128(lo, prime), _mm_srli_epi64(lo, 61));
+			h = _mm_add_epi64(h, _mm_and_si128(_mm_slli_epi64(hi, 32), prime));
+			h = _mm_add_epi64(h, _mm_add_epi64(_mm_srli_epi64(hi, 29), b));
+			h = _mm_add_epi64(_mm_and_si128(h, prime), _mm_srli_epi64(h, 61));
+			h = _mm_and_si128(_mm_add_epi64(h, _mm_srli_epi64(_mm_add_epi64(h, one), 61)), prime);
+
+			h = _mm_srli_epi64(_mm_mul_epu32(_mm_srli_epi64(h, 29), range), 32);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), h);
+		}
+		return i;
+	}
+
+	// 8 keys at a time
+	__attribute__((target("avx2")))
+	size_t hashManyAvx2(const uint64_t* keys, size_t n, size_t* out) const
+	{
+		const __m256i prime = _mm256_set1_epi64x(int64_t(PRIME));
+		const __m256i one = _mm256_set1_epi64x(1);
+		const __m256i a_lo = _mm256_set1_epi64x(int64_t(m_a & 0xffffffff));
+		const __m256i a_hi = _mm256_set1_epi64x(int64_t(m_a >> 32));
+		const __m256i b = _mm256_set1_epi64x(int64_t(m_b));
+		const __m256i range = _mm256_set1_epi64x(int64_t(m_range));
+
+		auto hash4 = [&](__m256i x) __attribute__((target("avx2")))
+		{
+			__m256i lo = _mm256_mul_epu32(x, a_lo);
+			__m256i hi = _mm256_mul_epu32(x, a_hi);
+
+			__m256i h = _mm256_add_epi64(_mm256_and_si256(lo, prime), _mm256_srli_epi64(lo, 61));
+			h = _mm256_add_epi64(h, _mm256_and_si256(_mm256_slli_epi64(hi, 32), prime));
+			h = _mm256_add_epi64(h, _mm256_add_epi64(_mm256_srli_epi64(hi, 29), b));
+			h = _mm256_add_epi64(_mm256_and_si256(h, prime), _mm256_srli_epi64(h, 61));
+			h = _mm256_and_si256(_mm256_add_epi64(h, _mm256_srli_epi64(_mm256_add_epi64(h, one), 61)), prime);
+
+			return _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(h, 29), range), 32);
+		};
+
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8)
+		{
+			__m256i x1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+			__m256i x2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i + 4));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), hash4(x1));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 4), hash4(x2));
+		}
+		return i;
+	}
+#endif
+
+	uint64_t m_a {0}; // 0 < a < p
+	uint64_t m_b {0}; // 0 <= b < p
+	uint64_t m_range {1};
+};
+
+/* (a1 * lo + a2 * hi + b) mod p over the two 32-bit halves of 64-bit keys,
+ * p = 2^61 - 1, scaled onto range from all 61 bits. universal over the whole
+ * key (both halves are below p), so two keys collide with chance at most
+ * about 1 / range, and ranges go far beyond 2^32. the family for keys with
+ * 64-bit hash inputs, and for maps of billions of pairs
+ */
+class Mersenne61Hash
+{
+	static const uint64_t PRIME = (uint64_t(1) << 61) - 1;
+
+public:
+	static const uint64_t MAX_RANGE = uint64_t(1) << 48;
+	static const unsigned int INPUT_BITS = 64;
+
+	Mersenne61Hash() = default;
+
+	explicit Mersenne61Hash(size_t range)
+	{
+		seed(range);
+	}
+
+	void seed(size_t range)
+	{
+		if (MAX_RANGE < range) throw std::out_of_range("Mersenne61Hash requested range is larger than 2^48");
+
+		m_range = range;
+		m_a1 = random_uint64(0, PRIME - 1);
+		m_a2 = random_uint64(0, PRIME - 1);
+		m_b = random_uint64(0, PRIME - 1);
+	}
+
+	size_t operator()(uint64_t key) const
+	{
+		uint64_t lo = uint32_t(key);
+		uint64_t hi = key >> 32;
+#ifdef __SIZEOF_INT128__
+		// < 2^95, fold it mod p (2^61 = 1 mod p) twice
+		auto y = (unsigned __int128)m_a1 * lo + (unsigned __int128)m_a2 * hi + m_b;
+		uint64_t h = (uint64_t(y) & PRIME) + uint64_t(y >> 61);
+		h = (h & PRIME) + (h >> 61);
+#else
+		uint64_t h = mulMod(m_a1, lo) + mulMod(m_a2, hi) + m_b; // < 3p
+		h = (h & PRIME) + (h >> 61);
+#endif
+		h = (h + ((h + 1) >> 61)) & PRIME; // subtract p if h >= p
+
+		return scale_wide(h, m_range);
+	}
+
+	size_t range() const
+	{
+		return m_range;
+	}
+
+private:
+#ifndef __SIZEOF_INT128__
+	// a * x mod p for a < p, x < 2^32, folding the two products as MersenneHash does
+	static uint64_t mulMod(uint64_t a, uint64_t x)
+	{
+		uint64_t lo = (a & 0xffffffff) * x;
+		uint64_t hi = (a >> 32) * x;
+		uint64_t h = (lo & PRIME) + (lo >> 61) + ((hi << 32) & PRIME) + (hi >> 29);
+		h = (h & PRIME) + (h >> 61);
+		return (h + ((h + 1) >> 61)) & PRIME;
+	}
+#endif
+
+	uint64_t m_a1 {0}; // 0 <= a1, a2, b < p
+	uint64_t m_a2 {0};
+	uint64_t m_b {0};
+	uint64_t m_range {1};
+};
+
+/* simple tabulation over the 4 bytes of 32-bit keys: xor of one random word
+ * per byte, scaled onto range with a multiply. the tables (TABLES_PER_BYTE
+ * for each byte, 256KB in all) are made once and shared by every object,
+ * which just picks one table for each byte. so objects are as small and
+ * cheap to seed as the other families, and the family is the 2^24
+ * combinations of tables, each 3-independent. the tables are the same in
+ * every process, so objects can be saved as raw bytes
+ */
+class TabulationHash
+{
+	static const size_t NUM_BYTES = 4;
+	static const size_t TABLES_PER_BYTE = 64;
+	static const size_t TABLE_SIZE = 256;
+
+public:
+	static const uint64_t MAX_RANGE = uint64_t(1) << 32;
+	static const unsigned int INPUT_BITS = 32;
+
+	TabulationHash() = default;
+
+	explicit TabulationHash(size_t range)
+	{
+		seed(range);
+	}
+
+	void seed(size_t range)
+	{
+		if (MAX_RANGE < range) throw std::out_of_range("TabulationHash requested range is larger than 2^32");
+
+		m_range = range;
+		for (size_t i = 0; i < NUM_BYTES; ++i)
+			m_tables[i] = uint8_t(random_uint64(0, TABLES_PER_BYTE - 1));
+	}
+
+	size_t operator()(uint64_t key) const
+	{
+		auto entries = tables();
+		uint64_t h = 0;
+		for (size_t i = 0; i < NUM_BYTES; ++i)
+			h ^= entries[((i * TABLES_PER_BYTE + m_tables[i]) * TABLE_SIZE) + ((key >> (8 * i)) & 0xff)];
+		return size_t((h * m_range) >> 32);
+	}
+
+	size_t range() const
+	{
+		return m_range;
+	}
+
+private:
+	// the shared tables, table t of byte i at (i * TABLES_PER_BYTE + t) * TABLE_SIZE
+	static const uint32_t* tables()
+	{
+		// expanded from a fixed seed with splitmix64, so every process has the same ones
+		static const std::vector<uint32_t> entries = []
+		{
+			std::vector<uint32_t> entries(NUM_BYTES * TABLES_PER_BYTE * TABLE_SIZE);
+			uint64_t state = 0;
+			for (auto& entry : entries)
+			{
+				uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+				entry = uint32_t(z ^ (z >> 31));
+			}
+			return entries;
+		}();
+		return entries.data();
+	}
+
+	uint8_t m_tables[NUM_BYTES] {}; // which table each byte uses
+	uint64_t m_range {1};
+};
+
+// out[i] = hash(keys[i]) for each of the n keys. families that can hash
+// many keys faster than one at a time overload this
+template <class Hash>
+void hash_many(const Hash& hash, const uint64_t* keys, size_t n, size_t* out)
+{
+	for (size_t i = 0; i < n; ++i) out[i] = hash(keys[i]);
+}
+
+inline void hash_many(const MersenneHash& hash, const uint64_t* keys, size_t n, size_t* out)
+{
+	hash.hashMany(keys, n, out);
+}
+
+// the family maps use for keys of type K unless told otherwise: MersenneHash
+// where it reads every bit the keys' hash inputs need, else Mersenne61Hash
+template <class K>
+using DefaultHash = typename std::conditional<PreHash<K>::INPUT_BITS <= MersenneHash::INPUT_BITS, MersenneHash, Mersenne61Hash>::type;
+
+#endif
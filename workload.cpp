@@ -0,0 +1,254 @@
+#include "workload.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_set>
+
+static const uint32_t TRACE_VERSION = 1;
+static const uint32_t TRACE_BYTE_ORDER = 0x01020304;
+
+struct trace_header_t
+{
+	char magic[8];         // "FMTRACE" and a null
+	uint32_t version;      // TRACE_VERSION when written
+	uint32_t byte_order;   // TRACE_BYTE_ORDER as written by the saving machine
+	uint64_t num_prepop;
+	uint64_t num_ops;
+};
+
+/* ranks [0, n) drawn from a Zipfian distribution, rank 0 being the most
+ * likely (the method of Gray et al., "Quickly Generating Billion-Record
+ * Synthetic Databases", as used by YCSB). setup takes O(n) time
+ */
+class ZipfGenerator
+{
+	uint64_t m_n;
+	double m_theta;
+	double m_alpha;
+	double m_zeta_n;
+	double m_eta;
+	std::uniform_real_distribution<double> m_uniform;
+
+	static double zeta(uint64_t n, double theta)
+	{
+		double sum = 0;
+		for (uint64_t i = 1; i <= n; ++i) sum += 1 / std::pow(double(i), theta);
+		return sum;
+	}
+
+public:
+	ZipfGenerator(uint64_t n, double theta)
+		: m_n {std::max<uint64_t>(1, n)},
+		m_theta {theta},
+		m_alpha {1 / (1 - theta)},
+		m_zeta_n {zeta(m_n, theta)},
+		m_eta {(1 - std::pow(2.0 / double(m_n), 1 - theta)) / (1 - zeta(2, theta) / m_zeta_n)}
+	{
+	}
+
+	template <class Rng>
+	uint64_t operator()(Rng& rng)
+	{
+		auto u = m_uniform(rng);
+		auto uz = u * m_zeta_n;
+		if (uz < 1) return 0;
+		if (uz < 1 + std::pow(0.5, m_theta)) return std::min<uint64_t>(1, m_n - 1);
+		auto rank = uint64_t(double(m_n) * std::pow(m_eta * u - m_eta + 1, m_alpha));
+		return std::min(rank, m_n - 1);
+	}
+};
+
+// prepop distinct random keys from [0, n)
+template <class Rng>
+static std::vector<int> random_keys(uint64_t n, uint64_t prepop, Rng& rng)
+{
+	std::vector<int> keys;
+	if (prepop * 2 > n)
+	{
+		// most keys are used, so shuffle them all and take the first ones
+		for (uint64_t key = 0; key < n; ++key) keys.push_back(int(key));
+		std::shuffle(keys.begin(), keys.end(), rng);
+		keys.resize(size_t(prepop));
+		return keys;
+	}
+
+	std::unordered_set<int> used;
+	std::uniform_int_distribution<uint64_t> dist(0, n - 1);
+	while (keys.size() < prepop)
+	{
+		auto key = int(dist(rng));
+		if (used.insert(key).second) keys.push_back(key);
+	}
+	return keys;
+}
+
+Trace generate_trace(const WorkloadConfig& config)
+{
+	auto& distribution = config.distribution;
+	if (distribution != "uniform" && distribution != "zipf" && distribution != "sequential" && distribution != "latest")
+		throw std::invalid_argument("unknown workload distribution " + distribution);
+	if (config.key_max < 0 || config.num_ops < 0 || config.reads < 0 || config.writes < 0 || config.erases < 0 ||
+		config.reads + config.writes + config.erases <= 0)
+		throw std::invalid_argument("bad workload parameters");
+	if ((distribution == "zipf" || distribution == "latest") && !(config.zipf_theta > 0 && config.zipf_theta < 1))
+		throw std::invalid_argument("zipf theta must be in (0, 1)");
+
+	std::mt19937_64 rng(config.seed);
+	auto n = uint64_t(config.key_max) + 1;
+	auto prepop = std::min(n, uint64_t(std::max(0, config.prepop)));
+
+	Trace trace;
+	if (distribution == "sequential")
+	{
+		for (uint64_t key = 0; key < prepop; ++key) trace.prepop.push_back(int(key));
+	}
+	else
+	{
+		trace.prepop = random_keys(n, prepop, rng);
+	}
+
+	std::uniform_int_distribution<int> op_dist(0, config.reads + config.writes + config.erases - 1);
+	std::uniform_int_distribution<uint64_t> key_dist(0, n - 1);
+
+	// zipf: multiplying ranks by a prime larger than n permutes them, scattering the hot keys
+	const uint64_t SCATTER = 2654435761u;
+	std::unique_ptr<ZipfGenerator> zipf;
+	if (distribution == "zipf") zipf.reset(new ZipfGenerator(n, config.zipf_theta));
+
+	// latest: ring of the most recently inserted keys
+	const size_t RECENT_SIZE = 4096;
+	std::vector<int> recent;
+	size_t recent_pos = 0;
+	if (distribution == "latest")
+	{
+		zipf.reset(new ZipfGenerator(RECENT_SIZE, config.zipf_theta));
+		auto first = trace.prepop.size() - std::min(trace.prepop.size(), RECENT_SIZE);
+		recent.assign(trace.prepop.begin() + std::ptrdiff_t(first), trace.prepop.end());
+	}
+
+	uint64_t next_key = prepop % n;
+	trace.ops.reserve(size_t(config.num_ops));
+	for (int i = 0; i < config.num_ops; ++i)
+	{
+		Operation op;
+		auto action = op_dist(rng);
+		op.type = action < config.reads ? Operation::READ : action < config.reads + config.writes ? Operation::INSERT : Operation::ERASE;
+
+		if (distribution == "uniform")
+		{
+			op.key = int(key_dist(rng));
+		}
+		else if (distribution == "zipf")
+		{
+			op.key = int((*zipf)(rng) * SCATTER % n);
+		}
+		else if (distribution == "sequential")
+		{
+			op.key = int(next_key);
+			next_key = (next_key + 1) % n;
+		}
+		else if (op.type == Operation::INSERT || recent.empty())
+		{
+			op.key = int(key_dist(rng));
+			if (op.type == Operation::INSERT)
+			{
+				if (recent.size() < RECENT_SIZE) recent.push_back(op.key);
+				else recent[recent_pos++ % RECENT_SIZE] = op.key;
+			}
+		}
+		else
+		{
+			// age 0 is the newest key in the ring
+			auto age = (*zipf)(rng) % recent.size();
+			auto newest = recent.size() < RECENT_SIZE ? recent.size() - 1 : (recent_pos + RECENT_SIZE - 1) % RECENT_SIZE;
+			op.key = recent[(newest + recent.size() - age) % recent.size()];
+		}
+
+		trace.ops.push_back(op);
+	}
+
+	return trace;
+}
+
+void Trace::save(const std::string& path) const
+{
+	trace_header_t header;
+	std::memset(static_cast<void*>(&header), 0, sizeof(header));
+	std::memcpy(header.magic, "FMTRACE", 8);
+	header.version = TRACE_VERSION;
+	header.byte_order = TRACE_BYTE_ORDER;
+	header.num_prepop = prepop.size();
+	header.num_ops = ops.size();
+
+	std::vector<int64_t> keys(prepop.begin(), prepop.end());
+	std::vector<uint8_t> types;
+	for (auto& op : ops)
+	{
+		keys.push_back(op.key);
+		types.push_back(op.type);
+	}
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(keys.data()), std::streamsize(keys.size() * sizeof(int64_t)));
+	file.write(reinterpret_cast<const char*>(types.data()), std::streamsize(types.size()));
+	file.close();
+	if (!file) throw std::runtime_error("Trace::save failed to write " + path);
+}
+
+Trace Trace::load(const std::string& path)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file) throw std::system_error(errno, std::generic_category(), "failed to open " + path);
+
+	trace_header_t header;
+	if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, "FMTRACE", 8) != 0)
+		throw std::runtime_error("Trace::load: " + path + " is not a trace");
+	if (header.version != TRACE_VERSION || header.byte_order != TRACE_BYTE_ORDER)
+		throw std::runtime_error("Trace::load: " + path + " is a trace of a different version or byte order");
+
+	// check the sizes against the file before allocating anything
+	file.seekg(0, std::ios::end);
+	auto file_size = uint64_t(file.tellg());
+	file.seekg(sizeof(header));
+	auto num_keys = header.num_prepop + header.num_ops;
+	if (header.num_prepop > file_size || header.num_ops > file_size ||
+		file_size != sizeof(header) + num_keys * sizeof(int64_t) + header.num_ops)
+		throw std::runtime_error("Trace::load: " + path + " is truncated or corrupt");
+
+	std::vector<int64_t> keys;
+	std::vector<uint8_t> types;
+	keys.resize(size_t(num_keys));
+	types.resize(size_t(header.num_ops));
+	file.read(reinterpret_cast<char*>(keys.data()), std::streamsize(keys.size() * sizeof(int64_t)));
+	file.read(reinterpret_cast<char*>(types.data()), std::streamsize(types.size()));
+	if (!file) throw std::runtime_error("Trace::load: " + path + " is truncated or corrupt");
+
+	for (auto key : keys)
+	{
+		if (key < std::numeric_limits<int>::min() || key > std::numeric_limits<int>::max())
+			throw std::runtime_error("Trace::load: " + path + " has keys that don't fit in an int");
+	}
+	for (auto type : types)
+	{
+		if (type > Operation::ERASE) throw std::runtime_error("Trace::load: " + path + " has an unknown operation type");
+	}
+
+	Trace trace;
+	trace.prepop.assign(keys.begin(), keys.begin() + std::ptrdiff_t(header.num_prepop));
+	for (size_t i = 0; i < types.size(); ++i)
+	{
+		trace.ops.push_back({Operation::Type(types[i]), int(keys[size_t(header.num_prepop) + i])});
+	}
+
+	return trace;
+}
@@ -0,0 +1,67 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// one operation of a benchmark workload
+struct Operation
+{
+	enum Type : uint8_t { READ, INSERT, ERASE };
+
+	Type type;
+	int key;
+};
+
+/* a benchmark workload generated (or recorded) ahead of time, so choosing
+ * keys costs nothing while the benchmark runs and a run can be repeated
+ * exactly. traces can be saved to and loaded from a binary file:
+ *
+ *   header: "FMTRACE" and a null, uint32 version, uint32 byte order marker,
+ *           uint64 number of prepopulated keys, uint64 number of operations
+ *   int64 prepopulated keys
+ *   int64 operation keys
+ *   uint8 operation types (0 read, 1 insert, 2 erase)
+ *
+ * all in the byte order of the machine that wrote it
+ */
+struct Trace
+{
+	std::vector<int> prepop; // keys inserted before the operations start
+	std::vector<Operation> ops;
+
+	// write the trace to path, replacing any existing file. throws runtime_error
+	void save(const std::string& path) const;
+
+	// read a trace written by save. throws system_error if the file can't be
+	// read, and runtime_error if it isn't a trace or its keys don't fit in an int
+	static Trace load(const std::string& path);
+};
+
+// how to generate a trace
+struct WorkloadConfig
+{
+	/* how keys are chosen:
+	 * uniform: uniformly from [0, key_max]
+	 * zipf: from a Zipfian distribution with parameter zipf_theta, so a few
+	 *       hot keys get most of the operations. hot keys are spread over
+	 *       [0, key_max] rather than being the smallest ones
+	 * sequential: each operation takes the next key, wrapping after key_max
+	 * latest: inserts choose uniformly, reads and erases choose mostly among
+	 *       the most recently inserted keys (Zipfian by how recent they are)
+	 */
+	std::string distribution {"uniform"};
+	int key_max {100000};
+	int reads {1}, writes {1}, erases {1}; // proportions of each operation
+	int prepop {0}; // number of distinct keys to insert first (sequential: 0 to prepop - 1, otherwise random)
+	int num_ops {0};
+	double zipf_theta {0.99}; // in (0, 1), larger means more skewed
+	uint64_t seed {1};
+};
+
+// throws invalid_argument for an unknown distribution or bad parameters
+Trace generate_trace(const WorkloadConfig& config);
+
+#endif